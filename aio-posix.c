@@ -17,18 +17,188 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "trace.h"
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
+
+/* Initial polling window once polling proves useful */
+#define AIO_POLL_NS_INITIAL 4000
 
 struct AioHandler
 {
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     int pollfds_idx;
     void *opaque;
     QLIST_ENTRY(AioHandler) node;
 };
 
+#ifdef CONFIG_EPOLL_CREATE1
+
+/* Number of fds at which the context switches from ppoll to epoll */
+#define EPOLL_ENABLE_THRESHOLD 64
+
+#define EPOLL_MAX_EVENTS 128
+
+static void aio_epoll_disable(AioContext *ctx)
+{
+    ctx->epoll_available = false;
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+        ctx->epollfd = -1;
+    }
+    ctx->epoll_enabled = false;
+}
+
+static inline int epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+/* Add all current handlers to the epoll interest set */
+static bool aio_epoll_try_enable(AioContext *ctx)
+{
+    AioHandler *node;
+    struct epoll_event event;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (node->deleted || !node->pfd.events) {
+            continue;
+        }
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        event.data.ptr = node;
+        if (epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, node->pfd.fd, &event)) {
+            return false;
+        }
+    }
+    ctx->epoll_enabled = true;
+    trace_aio_epoll_enable(ctx);
+    return true;
+}
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    struct epoll_event event;
+    int ctl;
+
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+    if (!node->pfd.events) {
+        ctl = EPOLL_CTL_DEL;
+    } else {
+        event.data.ptr = node;
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        ctl = is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    }
+
+    if (epoll_ctl(ctx->epollfd, ctl, node->pfd.fd, &event)) {
+        /* e.g. regular files cannot be added, go back to ppoll for good */
+        aio_epoll_disable(ctx);
+    }
+}
+
+static int aio_epoll(AioContext *ctx, int64_t timeout)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    AioHandler *node;
+    int i, ret = 0;
+
+    if (timeout > 0) {
+        /* epoll_wait only has millisecond resolution, wait on the epoll
+         * fd itself for the precise timeout and then collect the events.
+         */
+        GPollFD pfd = {
+            .fd = ctx->epollfd,
+            .events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR,
+        };
+
+        ret = qemu_poll_ns(&pfd, 1, timeout);
+        if (ret <= 0) {
+            return ret;
+        }
+        timeout = 0;
+    }
+
+    ret = epoll_wait(ctx->epollfd, events, EPOLL_MAX_EVENTS,
+                     timeout < 0 ? -1 : 0);
+    for (i = 0; i < ret; i++) {
+        int ev = events[i].events;
+
+        node = events[i].data.ptr;
+        node->pfd.revents = (ev & EPOLLIN ? G_IO_IN : 0) |
+                            (ev & EPOLLOUT ? G_IO_OUT : 0) |
+                            (ev & EPOLLHUP ? G_IO_HUP : 0) |
+                            (ev & EPOLLERR ? G_IO_ERR : 0);
+    }
+
+    return ret;
+}
+
+static bool aio_epoll_enabled(AioContext *ctx)
+{
+    return ctx->epoll_enabled;
+}
+
+/* Called with the pollfds array filled in; switch to epoll if it is large */
+static bool aio_epoll_check_poll(AioContext *ctx, unsigned npfd)
+{
+    if (!ctx->epoll_available || npfd < EPOLL_ENABLE_THRESHOLD) {
+        return false;
+    }
+    if (aio_epoll_try_enable(ctx)) {
+        return true;
+    }
+    aio_epoll_disable(ctx);
+    return false;
+}
+
+#else
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+}
+
+static int aio_epoll(AioContext *ctx, int64_t timeout)
+{
+    abort();
+}
+
+static bool aio_epoll_enabled(AioContext *ctx)
+{
+    return false;
+}
+
+static bool aio_epoll_check_poll(AioContext *ctx, unsigned npfd)
+{
+    return false;
+}
+
+#endif
+
+void aio_context_setup(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    ctx->epoll_available = ctx->epollfd >= 0;
+#endif
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    aio_epoll_disable(ctx);
+#endif
+}
+
 static AioHandler *find_aio_handler(AioContext *ctx, int fd)
 {
     AioHandler *node;
@@ -49,6 +219,7 @@ void aio_set_fd_handler(AioContext *ctx,
                         void *opaque)
 {
     AioHandler *node;
+    bool is_new = false;
 
     node = find_aio_handler(ctx, fd);
 
@@ -56,6 +227,8 @@ void aio_set_fd_handler(AioContext *ctx,
     if (!io_read && !io_write) {
         if (node) {
             g_source_remove_poll(&ctx->source, &node->pfd);
+            node->pfd.events = 0;
+            aio_epoll_update(ctx, node, false);
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
@@ -78,8 +251,12 @@ void aio_set_fd_handler(AioContext *ctx,
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
 
             g_source_add_poll(&ctx->source, &node->pfd);
+            is_new = true;
         }
         /* Update handler with latest information */
+        if (node->opaque != opaque) {
+            node->io_poll = NULL;
+        }
         node->io_read = io_read;
         node->io_write = io_write;
         node->opaque = opaque;
@@ -87,6 +264,7 @@ void aio_set_fd_handler(AioContext *ctx,
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+        aio_epoll_update(ctx, node, is_new);
     }
 
     aio_notify(ctx);
@@ -100,6 +278,97 @@ void aio_set_event_notifier(AioContext *ctx,
                        (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    AioHandler *node;
+
+    node = find_aio_handler(ctx, event_notifier_get_fd(notifier));
+    if (node) {
+        node->io_poll = io_poll;
+    }
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns)
+{
+    /* No thread synchronization here, it doesn't matter if an incorrect
+     * value is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+
+    aio_notify(ctx);
+}
+
+static bool aio_has_poll_handlers(AioContext *ctx)
+{
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Call every poll handler once.  Returns true if one of them made progress. */
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    AioHandler *node;
+    bool progress = false;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll && node->io_poll(node->opaque)) {
+            progress = true;
+        }
+    }
+
+    return progress;
+}
+
+/* Busy-wait on the poll handlers until one of them makes progress, someone
+ * calls aio_notify(), or @max_ns nanoseconds have passed.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    int64_t end = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+    bool progress;
+
+    ctx->walking_handlers++;
+    do {
+        progress = run_poll_handlers_once(ctx);
+    } while (!progress && !atomic_read(&ctx->notified) &&
+             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end);
+    ctx->walking_handlers--;
+
+    trace_run_poll_handlers(ctx, max_ns, progress);
+    return progress;
+}
+
+/* Grow the polling window if blocking ended shortly after polling gave up,
+ * shrink it if the context sat idle for longer than polling could cover.
+ */
+static void adjust_poll_ns(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+        return;
+    } else if (block_ns > ctx->poll_max_ns) {
+        ctx->poll_ns = 0;
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        ctx->poll_ns = ctx->poll_ns ? ctx->poll_ns * 2 : AIO_POLL_NS_INITIAL;
+        ctx->poll_ns = MIN(ctx->poll_ns, ctx->poll_max_ns);
+    }
+
+    if (ctx->poll_ns != old) {
+        trace_aio_poll_adjust(ctx, old, ctx->poll_ns);
+    }
+}
+
 bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
@@ -178,6 +447,8 @@ bool aio_poll(AioContext *ctx, bool blocking)
     bool was_dispatching;
     int ret;
     bool progress;
+    int64_t timeout;
+    int64_t start = 0;
 
     was_dispatching = ctx->dispatching;
     progress = false;
@@ -227,6 +498,31 @@ bool aio_poll(AioContext *ctx, bool blocking)
         goto out;
     }
 
+    timeout = blocking ? timerlistgroup_deadline_ns(&ctx->tlg) : 0;
+
+    /* Before blocking, busy-wait for a while in case new work shows up
+     * soon; this saves the syscall and the wakeup latency.
+     */
+    if (timeout && ctx->poll_max_ns && aio_has_poll_handlers(ctx)) {
+        int64_t poll_ns = ctx->poll_ns;
+
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (timeout > 0) {
+            poll_ns = MIN(poll_ns, timeout);
+        }
+        atomic_set(&ctx->notified, false);
+        if (poll_ns && run_poll_handlers(ctx, poll_ns)) {
+            progress = true;
+            timeout = 0;
+        }
+    }
+
+    if (aio_epoll_enabled(ctx)) {
+        /* The interest set is kept up to date by aio_set_fd_handler */
+        ret = aio_epoll(ctx, timeout);
+        goto dispatch;
+    }
+
     ctx->walking_handlers++;
 
     g_array_set_size(ctx->pollfds, 0);
@@ -246,10 +542,15 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     ctx->walking_handlers--;
 
+    if (aio_epoll_check_poll(ctx, ctx->pollfds->len)) {
+        ret = aio_epoll(ctx, timeout);
+        goto dispatch;
+    }
+
     /* wait until next event */
     ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
                          ctx->pollfds->len,
-                         blocking ? timerlistgroup_deadline_ns(&ctx->tlg) : 0);
+                         timeout);
 
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
@@ -262,6 +563,11 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
     }
 
+dispatch:
+    if (start) {
+        adjust_poll_ns(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
+
     /* Run dispatch even if there were no readable fds to run timers */
     aio_set_dispatching(ctx, true);
     if (aio_dispatch(ctx)) {
@@ -76,6 +76,26 @@ void aio_set_event_notifier(AioContext *ctx,
     aio_notify(ctx);
 }
 
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    /* Busy-polling is not implemented on Windows */
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns)
+{
+    /* Busy-polling is not implemented on Windows, the setting is ignored */
+}
+
 bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
@@ -107,9 +107,7 @@ int graphic_depth = 32;
 #endif
 
 const uint32_t arch_type = QEMU_ARCH;
-static bool mig_throttle_on;
 static int dirty_rate_high_cnt;
-static void check_guest_throttling(void);
 
 static uint64_t bitmap_sync_count;
 
@@ -124,6 +122,10 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
+#define RAM_SAVE_FLAG_MAPPED_RAM 0x100
+
+/* Alignment of the RAMBlock regions in a mapped-ram migration file */
+#define MAPPED_RAM_ALIGN       (1024 * 1024)
 
 static struct defconfig_file {
     const char *filename;
@@ -434,60 +436,119 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
-static inline bool migration_bitmap_set_dirty(ram_addr_t addr)
+static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 {
-    bool ret;
-    int nr = addr >> TARGET_PAGE_BITS;
+    migration_dirty_pages +=
+        cpu_physical_memory_sync_dirty_bitmap(migration_bitmap, start, length);
 
-    ret = test_and_set_bit(nr, migration_bitmap);
-
-    if (!ret) {
-        migration_dirty_pages++;
+    /* TCG only traps the first write to a page after its TLB entry
+     * has been reset, do that or further writes would go unnoticed.
+     */
+    if (tcg_enabled()) {
+        cpu_physical_memory_reset_dirty(start, length,
+                                        DIRTY_MEMORY_MIGRATION);
     }
-    return ret;
 }
 
-static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
+/* Number of pages synced between two releases of the ramlist lock */
+#define MIGRATION_BITMAP_SYNC_CHUNK (1 << 18)
+
+/* Needs the ramlist lock.  With @chunked, the lock is dropped after each
+ * chunk so that RAM hotplug in the main loop is never held off for long.
+ * If the block list changes meanwhile, the walk stops early; the pages it
+ * did not reach are still dirty and will be picked up by the next sync.
+ */
+static void migration_bitmap_sync_blocks(bool chunked)
 {
-    ram_addr_t addr;
-    unsigned long page = BIT_WORD(start >> TARGET_PAGE_BITS);
-
-    /* start address is aligned at the start of a word? */
-    if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
-        int k;
-        int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
-        unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
-
-        for (k = page; k < page + nr; k++) {
-            if (src[k]) {
-                unsigned long new_dirty;
-                new_dirty = ~migration_bitmap[k];
-                migration_bitmap[k] |= src[k];
-                new_dirty &= src[k];
-                migration_dirty_pages += ctpopl(new_dirty);
-                src[k] = 0;
+    RAMBlock *block;
+    ram_addr_t chunk = (ram_addr_t)MIGRATION_BITMAP_SYNC_CHUNK
+                       << TARGET_PAGE_BITS;
+    ram_addr_t offset, len;
+    uint32_t version = ram_list.version;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        for (offset = 0; offset < block->length; offset += len) {
+            len = MIN(chunk, block->length - offset);
+            migration_bitmap_sync_range(block->mr->ram_addr + offset, len);
+            if (chunked) {
+                qemu_mutex_unlock_ramlist();
+                qemu_mutex_lock_ramlist();
+                if (ram_list.version != version) {
+                    return;
+                }
             }
         }
+    }
+}
+
+/* Auto-converge throttle: start at 20% and step by 10% every time the
+ * guest keeps dirtying memory faster than we can send it.
+ */
+#define CPU_THROTTLE_PCT_INITIAL    20
+#define CPU_THROTTLE_PCT_INCREMENT  10
+
+/* To reduce the dirty rate explicitly disallow the VCPUs from spending
+   much time in the VM. The migration thread will try to catchup.
+   Workload will experience a performance drop.
+*/
+static void mig_throttle_guest_down(void)
+{
+    if (!cpu_throttle_active()) {
+        cpu_throttle_set(CPU_THROTTLE_PCT_INITIAL);
     } else {
-        for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(start + addr,
-                                              TARGET_PAGE_SIZE,
-                                              DIRTY_MEMORY_MIGRATION)) {
-                cpu_physical_memory_reset_dirty(start + addr,
-                                                TARGET_PAGE_SIZE,
-                                                DIRTY_MEMORY_MIGRATION);
-                migration_bitmap_set_dirty(start + addr);
-            }
-        }
+        cpu_throttle_set(cpu_throttle_get_percentage() +
+                         CPU_THROTTLE_PCT_INCREMENT);
+    }
+}
+
+/* The migration thread is comfortably ahead of the guest, give some of
+   the CPU time back.
+*/
+static void mig_throttle_guest_up(void)
+{
+    int pct = cpu_throttle_get_percentage() - CPU_THROTTLE_PCT_INCREMENT;
+
+    if (pct < CPU_THROTTLE_PCT_INITIAL) {
+        cpu_throttle_stop();
+    } else {
+        cpu_throttle_set(pct);
     }
 }
 
+/* Only throttle the vCPUs that are actually dirtying memory.  The per-vCPU
+ * dirty page counters are only maintained by TCG; with KVM the dirty log
+ * is per memory slot, so every running vCPU stays a throttle target.
+ */
+static void mig_throttle_update_targets(void)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+    int ncpus = 0;
 
-/* Needs iothread lock! */
+    CPU_FOREACH(cpu) {
+        total += cpu->dirty_pages;
+        ncpus++;
+    }
+    CPU_FOREACH(cpu) {
+        /* Spare vCPUs that dirtied less than half of their fair share */
+        cpu->throttle_exempt = total && cpu->dirty_pages * ncpus * 2 < total;
+        cpu->dirty_pages = 0;
+    }
+}
 
-static void migration_bitmap_sync(void)
+/*
+ * Pull the accelerator's dirty log into ram_list.dirty_memory and from
+ * there into the migration bitmap.
+ *
+ * With @locked the caller holds both the iothread and the ramlist lock
+ * (setup and completion stages).  Otherwise nothing must be held: the
+ * iothread lock is only taken for the accelerator log sync and the
+ * migration bitmap is updated under the ramlist lock alone, so the vCPUs
+ * and the main loop keep running.  TCG has to reset its TLBs together with
+ * the bitmap and therefore keeps the iothread lock throughout.
+ */
+static void migration_bitmap_sync(bool locked)
 {
-    RAMBlock *block;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
     static int64_t start_time;
@@ -495,6 +556,7 @@ static void migration_bitmap_sync(void)
     static int64_t num_dirty_pages_period;
     int64_t end_time;
     int64_t bytes_xfer_now;
+    int64_t sync_start;
     static uint64_t xbzrle_cache_miss_prev;
     static uint64_t iterations_prev;
 
@@ -509,11 +571,27 @@ static void migration_bitmap_sync(void)
     }
 
     trace_migration_bitmap_sync_start();
-    address_space_sync_dirty_bitmap(&address_space_memory);
+    sync_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->mr->ram_addr, block->length);
+    if (locked) {
+        address_space_sync_dirty_bitmap(&address_space_memory);
+        migration_bitmap_sync_blocks(false);
+    } else {
+        qemu_mutex_lock_iothread();
+        address_space_sync_dirty_bitmap(&address_space_memory);
+        if (!tcg_enabled()) {
+            qemu_mutex_unlock_iothread();
+        }
+        qemu_mutex_lock_ramlist();
+        migration_bitmap_sync_blocks(!tcg_enabled());
+        qemu_mutex_unlock_ramlist();
+        if (tcg_enabled()) {
+            qemu_mutex_unlock_iothread();
+        }
     }
+
+    s->dirty_sync_duration =
+        (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - sync_start) / 1000;
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
@@ -521,6 +599,9 @@ static void migration_bitmap_sync(void)
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
+        if (!locked) {
+            qemu_mutex_lock_iothread();
+        }
         if (migrate_auto_converge()) {
             /* The following detection logic can be refined later. For now:
                Check to see if the dirtied bytes is 50% more than the approx.
@@ -533,12 +614,17 @@ static void migration_bitmap_sync(void)
                    (bytes_xfer_now - bytes_xfer_prev)/2) &&
                (dirty_rate_high_cnt++ > 4)) {
                     trace_migration_throttle();
-                    mig_throttle_on = true;
+                    mig_throttle_guest_down();
                     dirty_rate_high_cnt = 0;
-             }
-             bytes_xfer_prev = bytes_xfer_now;
-        } else {
-             mig_throttle_on = false;
+            } else if (cpu_throttle_active() &&
+                       num_dirty_pages_period * TARGET_PAGE_SIZE <
+                           (bytes_xfer_now - bytes_xfer_prev)/4) {
+                    mig_throttle_guest_up();
+            }
+            if (cpu_throttle_active()) {
+                mig_throttle_update_targets();
+            }
+            bytes_xfer_prev = bytes_xfer_now;
         }
         if (migrate_use_xbzrle()) {
             if (iterations_prev != 0) {
@@ -556,9 +642,32 @@ static void migration_bitmap_sync(void)
         start_time = end_time;
         num_dirty_pages_period = 0;
         s->dirty_sync_count = bitmap_sync_count;
+        if (!locked) {
+            qemu_mutex_unlock_iothread();
+        }
     }
 }
 
+/*
+ * ram_save_mapped_page: Write the given page at its fixed offset in the
+ * block's region of the migration file.  Zero pages are skipped during the
+ * bulk stage since the region starts out as a hole.
+ *
+ * Returns: Number of bytes written.
+ */
+static int ram_save_mapped_page(QEMUFile *f, RAMBlock *block,
+                                ram_addr_t offset, uint8_t *p)
+{
+    if (ram_bulk_stage && is_zero_range(p, TARGET_PAGE_SIZE)) {
+        acct_info.dup_pages++;
+        return 0;
+    }
+
+    qemu_put_buffer_at(f, p, TARGET_PAGE_SIZE, block->mapped_offset + offset);
+    acct_info.norm_pages++;
+    return TARGET_PAGE_SIZE;
+}
+
 /*
  * ram_save_page: Send the given page to the stream
  *
@@ -579,6 +688,10 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
 
     p = memory_region_get_ram_ptr(mr) + offset;
 
+    if (migrate_mapped_ram()) {
+        return ram_save_mapped_page(f, block, offset, p);
+    }
+
     /* In doubt sent page as normal */
     bytes_sent = -1;
     ret = ram_control_save_page(f, block->offset,
@@ -730,6 +843,8 @@ void free_xbzrle_decoded_buf(void)
 
 static void migration_end(void)
 {
+    cpu_throttle_stop();
+
     if (migration_bitmap) {
         memory_global_dirty_log_stop();
         g_free(migration_bitmap);
@@ -769,10 +884,15 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
 
-    mig_throttle_on = false;
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
 
+    if (migrate_mapped_ram() && !qemu_file_is_seekable(f)) {
+        error_report("Capability 'mapped-ram' needs a migration file that "
+                     "can seek, use a file: URI");
+        return -ENOTSUP;
+    }
+
     if (migrate_use_xbzrle()) {
         XBZRLE_cache_lock();
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
@@ -825,15 +945,23 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     }
 
     memory_global_dirty_log_start();
-    migration_bitmap_sync();
+    migration_bitmap_sync(true);
     qemu_mutex_unlock_iothread();
 
-    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+    qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE |
+                  (migrate_mapped_ram() ? RAM_SAVE_FLAG_MAPPED_RAM : 0));
 
     QTAILQ_FOREACH(block, &ram_list.blocks, next) {
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->length);
+        if (migrate_mapped_ram()) {
+            /* Reserve the block's region right after its header */
+            block->mapped_offset = QEMU_ALIGN_UP(qemu_ftell(f) + 8,
+                                                 MAPPED_RAM_ALIGN);
+            qemu_put_be64(f, block->mapped_offset);
+            qemu_file_set_pos(f, block->mapped_offset + block->length);
+        }
     }
 
     qemu_mutex_unlock_ramlist();
@@ -856,6 +984,12 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     qemu_mutex_lock_ramlist();
 
     if (ram_list.version != last_version) {
+        if (migrate_mapped_ram()) {
+            /* The file has no region for blocks added after setup */
+            qemu_mutex_unlock_ramlist();
+            error_report("RAM blocks changed during mapped-ram migration");
+            return -EINVAL;
+        }
         reset_ram_globals();
     }
 
@@ -873,7 +1007,6 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         total_sent += bytes_sent;
         acct_info.iterations++;
-        check_guest_throttling();
         /* we want to check in the 1st loop, just in case it was the 1st time
            and we had to sync the dirty bitmap.
            qemu_get_clock_ns() is a bit expensive, so we only check each some
@@ -918,7 +1051,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     qemu_mutex_lock_ramlist();
-    migration_bitmap_sync();
+    migration_bitmap_sync(true);
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
@@ -952,9 +1085,7 @@ static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
     remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
 
     if (remaining_size < max_size) {
-        qemu_mutex_lock_iothread();
-        migration_bitmap_sync();
-        qemu_mutex_unlock_iothread();
+        migration_bitmap_sync(false);
         remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
     }
     return remaining_size;
@@ -1025,6 +1156,25 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     return NULL;
 }
 
+/*
+ * Load a RAMBlock from its region of a mapped-ram migration file, reading
+ * it straight into the memory that already backs guest RAM.
+ */
+static int ram_load_mapped_block(QEMUFile *f, RAMBlock *block,
+                                 int64_t pages_offset)
+{
+    uint8_t *host = memory_region_get_ram_ptr(block->mr);
+
+    trace_ram_load_mapped_block(block->idstr, pages_offset);
+    if (qemu_get_buffer_at(f, host, block->length, pages_offset) !=
+        block->length) {
+        error_report("Failed to read RAM block %s from the migration file",
+                     block->idstr);
+        return -EIO;
+    }
+    return 0;
+}
+
 /*
  * If a page (or a whole RDMA chunk) has been
  * determined to be zero, then zap it.
@@ -1059,6 +1209,16 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             char id[256];
             ram_addr_t length;
             ram_addr_t total_ram_bytes = addr;
+            int64_t pages_offset = 0;
+
+            /* Other transports would read the pages from the wrong place */
+            if ((flags & RAM_SAVE_FLAG_MAPPED_RAM) &&
+                !qemu_file_is_seekable(f)) {
+                error_report("Mapped-ram migration streams can only be "
+                             "loaded from a file: URI");
+                ret = -ENOTSUP;
+                break;
+            }
 
             while (total_ram_bytes) {
                 RAMBlock *block;
@@ -1068,6 +1228,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 qemu_get_buffer(f, (uint8_t *)id, len);
                 id[len] = 0;
                 length = qemu_get_be64(f);
+                if (flags & RAM_SAVE_FLAG_MAPPED_RAM) {
+                    pages_offset = qemu_get_be64(f);
+                }
 
                 QTAILQ_FOREACH(block, &ram_list.blocks, next) {
                     if (!strncmp(id, block->idstr, sizeof(id))) {
@@ -1090,6 +1253,14 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                     break;
                 }
 
+                if (flags & RAM_SAVE_FLAG_MAPPED_RAM) {
+                    ret = ram_load_mapped_block(f, block, pages_offset);
+                    if (ret) {
+                        break;
+                    }
+                    qemu_file_set_pos(f, pages_offset + length);
+                }
+
                 total_ram_bytes -= length;
             }
         } else if (flags & RAM_SAVE_FLAG_COMPRESS) {
@@ -1367,52 +1538,3 @@ TargetInfo *qmp_query_target(Error **errp)
 
     return info;
 }
-
-/* Stub function that's gets run on the vcpu when its brought out of the
-   VM to run inside qemu via async_run_on_cpu()*/
-static void mig_sleep_cpu(void *opq)
-{
-    qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
-    qemu_mutex_lock_iothread();
-}
-
-/* To reduce the dirty rate explicitly disallow the VCPUs from spending
-   much time in the VM. The migration thread will try to catchup.
-   Workload will experience a performance drop.
-*/
-static void mig_throttle_guest_down(void)
-{
-    CPUState *cpu;
-
-    qemu_mutex_lock_iothread();
-    CPU_FOREACH(cpu) {
-        async_run_on_cpu(cpu, mig_sleep_cpu, NULL);
-    }
-    qemu_mutex_unlock_iothread();
-}
-
-static void check_guest_throttling(void)
-{
-    static int64_t t0;
-    int64_t        t1;
-
-    if (!mig_throttle_on) {
-        return;
-    }
-
-    if (!t0)  {
-        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-        return;
-    }
-
-    t1 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-
-    /* If it has been more than 40 ms since the last time the guest
-     * was throttled then do it again.
-     */
-    if (40 < (t1-t0)/1000000) {
-        mig_throttle_guest_down();
-        t0 = t1;
-    }
-}
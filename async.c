@@ -221,6 +221,7 @@ aio_ctx_finalize(GSource     *source)
     thread_pool_free(ctx->thread_pool);
     aio_set_event_notifier(ctx, &ctx->notifier, NULL);
     event_notifier_cleanup(&ctx->notifier);
+    aio_context_destroy(ctx);
     rfifolock_destroy(&ctx->lock);
     qemu_mutex_destroy(&ctx->bh_lock);
     g_array_free(ctx->pollfds, TRUE);
@@ -262,6 +263,8 @@ void aio_set_dispatching(AioContext *ctx, bool dispatching)
 
 void aio_notify(AioContext *ctx)
 {
+    atomic_set(&ctx->notified, true);
+
     /* Write e.g. bh->scheduled before reading ctx->dispatching.  */
     smp_mb();
     if (!ctx->dispatching) {
@@ -286,6 +289,8 @@ AioContext *aio_context_new(void)
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
     ctx->pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
     ctx->thread_pool = NULL;
+    ctx->epollfd = -1;
+    aio_context_setup(ctx);
     qemu_mutex_init(&ctx->bh_lock);
     rfifolock_init(&ctx->lock, aio_rfifolock_cb, ctx);
     event_notifier_init(&ctx->notifier, false);
@@ -10,6 +10,7 @@
 #include "qemu-common.h"
 #include "block/aio.h"
 #include "qemu/queue.h"
+#include "qemu/atomic.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
 
@@ -86,28 +87,68 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
+/* Reap and complete whatever is in the completion ring, without waiting */
+static int qemu_laio_process_completions(struct qemu_laio_state *s)
+{
+    struct io_event events[MAX_EVENTS];
+    struct timespec ts = { 0 };
+    int nevents, i;
+
+    do {
+        nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS, events, &ts);
+    } while (nevents == -EINTR);
+
+    for (i = 0; i < nevents; i++) {
+        struct iocb *iocb = events[i].obj;
+        struct qemu_laiocb *laiocb =
+                container_of(iocb, struct qemu_laiocb, iocb);
+
+        laiocb->ret = io_event_ret(&events[i]);
+        qemu_laio_process_completion(s, laiocb);
+    }
+
+    return MAX(nevents, 0);
+}
+
 static void qemu_laio_completion_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
 
     while (event_notifier_test_and_clear(&s->e)) {
-        struct io_event events[MAX_EVENTS];
-        struct timespec ts = { 0 };
-        int nevents, i;
+        qemu_laio_process_completions(s);
+    }
+}
+
+/* The kernel's completion ring, mapped at the address of the io_context_t.
+ * Peeking at it lets us busy-poll for completions without a syscall.
+ */
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+    struct io_event io_events[0];
+};
 
-        do {
-            nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
+#define AIO_RING_MAGIC 0xa10a10a1
 
-        for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
-            struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
 
-            laiocb->ret = io_event_ret(&events[i]);
-            qemu_laio_process_completion(s, laiocb);
-        }
+    if (ring->magic != AIO_RING_MAGIC ||
+        atomic_read(&ring->head) == atomic_read(&ring->tail)) {
+        return false;
     }
+    smp_rmb();
+
+    return qemu_laio_process_completions(s) > 0;
 }
 
 static void laio_cancel(BlockDriverAIOCB *blockacb)
@@ -279,6 +320,7 @@ void laio_attach_aio_context(void *s_, AioContext *new_context)
     struct qemu_laio_state *s = s_;
 
     aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_poll_cb);
 }
 
 void *laio_init(void)
@@ -478,6 +478,97 @@ void configure_icount(const char *option)
                    get_ticks_per_sec() / 10);
 }
 
+/***********************************************************/
+/* vCPU throttling */
+
+#define CPU_THROTTLE_PCT_MIN 1
+#define CPU_THROTTLE_PCT_MAX 99
+#define CPU_THROTTLE_TIMESLICE_NS 10000000
+
+static QEMUTimer *throttle_timer;
+static int throttle_percentage;
+
+static void cpu_throttle_thread(void *opaque)
+{
+    CPUState *cpu = opaque;
+    double pct;
+    double throttle_ratio;
+    long sleeptime_ns;
+
+    if (!cpu_throttle_get_percentage()) {
+        return;
+    }
+
+    pct = (double)cpu_throttle_get_percentage() / 100;
+    throttle_ratio = pct / (1 - pct);
+    sleeptime_ns = (long)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS);
+
+    qemu_mutex_unlock_iothread();
+    atomic_set(&cpu->throttle_thread_scheduled, false);
+    g_usleep(sleeptime_ns / 1000);
+    qemu_mutex_lock_iothread();
+}
+
+static void cpu_throttle_timer_tick(void *opaque)
+{
+    CPUState *cpu;
+    double pct;
+
+    /* Stop the timer if needed */
+    if (!cpu_throttle_get_percentage()) {
+        return;
+    }
+    CPU_FOREACH(cpu) {
+        /* A halted vCPU does not dirty memory, leave it alone */
+        if (cpu->throttle_exempt || cpu_thread_is_idle(cpu)) {
+            continue;
+        }
+        if (!atomic_xchg(&cpu->throttle_thread_scheduled, true)) {
+            async_run_on_cpu(cpu, cpu_throttle_thread, cpu);
+        }
+    }
+
+    pct = (double)cpu_throttle_get_percentage() / 100;
+    timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                              CPU_THROTTLE_TIMESLICE_NS / (1 - pct));
+}
+
+void cpu_throttle_set(int new_throttle_pct)
+{
+    /* Ensure throttle percentage is within valid range */
+    new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+    new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+
+    atomic_set(&throttle_percentage, new_throttle_pct);
+
+    if (!throttle_timer) {
+        throttle_timer = timer_new_ns(QEMU_CLOCK_REALTIME,
+                                      cpu_throttle_timer_tick, NULL);
+    }
+    timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                              CPU_THROTTLE_TIMESLICE_NS);
+}
+
+void cpu_throttle_stop(void)
+{
+    CPUState *cpu;
+
+    atomic_set(&throttle_percentage, 0);
+    CPU_FOREACH(cpu) {
+        cpu->throttle_exempt = false;
+    }
+}
+
+bool cpu_throttle_active(void)
+{
+    return (cpu_throttle_get_percentage() != 0);
+}
+
+int cpu_throttle_get_percentage(void)
+{
+    return atomic_read(&throttle_percentage);
+}
+
 /***********************************************************/
 void hw_error(const char *fmt, ...)
 {
@@ -0,0 +1,209 @@
+/*
+ * Guest dirty page rate measurement
+ *
+ * Enables dirty logging for a fixed window outside of migration and counts
+ * the pages the guest dirtied in that window, so that the duration of a
+ * future migration can be estimated without starting one.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qemu/bitmap.h"
+#include "qom/cpu.h"
+#include "sysemu/kvm.h"
+#include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
+#include "migration/migration.h"
+#include "qmp-commands.h"
+#include "trace.h"
+
+#define DIRTY_RATE_MIN_CALC_TIME 1
+#define DIRTY_RATE_MAX_CALC_TIME 60
+
+typedef struct DirtyRateVcpuStat {
+    int64_t id;
+    int64_t dirty_rate;
+} DirtyRateVcpuStat;
+
+/* All of the state below is protected by the iothread lock */
+static DirtyRateStatus dirty_rate_status = DIRTY_RATE_STATUS_UNSTARTED;
+static int64_t dirty_rate_start_time;
+static int64_t dirty_rate_calc_time;
+static int64_t dirty_rate_mbps;
+static DirtyRateVcpuStat *dirty_rate_vcpus;
+static int dirty_rate_nr_vcpus;
+
+/* Called with the iothread and ramlist locks held.  Returns the number of
+ * pages dirtied since the previous call and clears them, re-arming the TCG
+ * not-dirty traps so that per-vCPU accounting keeps working.
+ */
+static uint64_t dirty_rate_collect_pages(void)
+{
+    RAMBlock *block;
+    uint64_t dirty_pages = 0;
+    unsigned long *bitmap = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+
+    address_space_sync_dirty_bitmap(&address_space_memory);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long first = block->mr->ram_addr >> TARGET_PAGE_BITS;
+        unsigned long last = first + (block->length >> TARGET_PAGE_BITS);
+        unsigned long page;
+
+        for (page = find_next_bit(bitmap, last, first); page < last;
+             page = find_next_bit(bitmap, last, page + 1)) {
+            dirty_pages++;
+        }
+        cpu_physical_memory_reset_dirty(block->mr->ram_addr, block->length,
+                                        DIRTY_MEMORY_MIGRATION);
+    }
+
+    return dirty_pages;
+}
+
+static int64_t dirty_rate_to_mbps(uint64_t pages, int64_t elapsed_ms)
+{
+    return (pages * TARGET_PAGE_SIZE * 1000 / elapsed_ms) >> 20;
+}
+
+static void *dirty_rate_thread(void *opaque)
+{
+    CPUState *cpu;
+    uint64_t dirty_pages;
+    int64_t start_time, elapsed;
+    int i;
+
+    qemu_mutex_lock_iothread();
+    /*
+     * The dirty log is a plain on/off switch shared with migration, and
+     * collecting pages clears migration's dirty bits.  qmp_migrate()
+     * refuses to start while we measure; this covers a migration that
+     * started before the measurement was requested.
+     */
+    if (migration_is_active(migrate_get_current())) {
+        trace_dirty_rate_aborted();
+        dirty_rate_status = DIRTY_RATE_STATUS_FAILED;
+        qemu_mutex_unlock_iothread();
+        return NULL;
+    }
+    qemu_mutex_lock_ramlist();
+    memory_global_dirty_log_start();
+    /* Discard whatever was dirty before the window started */
+    dirty_rate_collect_pages();
+    CPU_FOREACH(cpu) {
+        cpu->dirty_pages = 0;
+    }
+    qemu_mutex_unlock_ramlist();
+    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    dirty_rate_start_time = start_time / 1000;
+    qemu_mutex_unlock_iothread();
+
+    g_usleep(dirty_rate_calc_time * G_USEC_PER_SEC);
+
+    qemu_mutex_lock_iothread();
+    /* qmp_migrate() refused to start in the meantime */
+    assert(!migration_is_active(migrate_get_current()));
+
+    qemu_mutex_lock_ramlist();
+    dirty_pages = dirty_rate_collect_pages();
+    qemu_mutex_unlock_ramlist();
+    memory_global_dirty_log_stop();
+
+    elapsed = MAX(qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start_time, 1);
+    dirty_rate_mbps = dirty_rate_to_mbps(dirty_pages, elapsed);
+
+    g_free(dirty_rate_vcpus);
+    dirty_rate_vcpus = NULL;
+    dirty_rate_nr_vcpus = 0;
+    if (!kvm_enabled()) {
+        CPU_FOREACH(cpu) {
+            dirty_rate_nr_vcpus++;
+        }
+        dirty_rate_vcpus = g_new0(DirtyRateVcpuStat, dirty_rate_nr_vcpus);
+        i = 0;
+        CPU_FOREACH(cpu) {
+            dirty_rate_vcpus[i].id = cpu->cpu_index;
+            dirty_rate_vcpus[i].dirty_rate =
+                dirty_rate_to_mbps(cpu->dirty_pages, elapsed);
+            cpu->dirty_pages = 0;
+            i++;
+        }
+    }
+
+    trace_dirty_rate_measured(dirty_pages, elapsed, dirty_rate_mbps);
+    dirty_rate_status = DIRTY_RATE_STATUS_MEASURED;
+    qemu_mutex_unlock_iothread();
+
+    return NULL;
+}
+
+bool dirty_rate_is_measuring(void)
+{
+    return dirty_rate_status == DIRTY_RATE_STATUS_MEASURING;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    QemuThread thread;
+
+    if (dirty_rate_status == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "The dirty page rate is already being measured");
+        return;
+    }
+    if (migration_is_active(migrate_get_current())) {
+        error_setg(errp, "Cannot measure the dirty page rate during migration");
+        return;
+    }
+    if (calc_time < DIRTY_RATE_MIN_CALC_TIME ||
+        calc_time > DIRTY_RATE_MAX_CALC_TIME) {
+        error_setg(errp, "Parameter 'calc-time' expects a value between "
+                   "%d and %d", DIRTY_RATE_MIN_CALC_TIME,
+                   DIRTY_RATE_MAX_CALC_TIME);
+        return;
+    }
+
+    dirty_rate_status = DIRTY_RATE_STATUS_MEASURING;
+    dirty_rate_calc_time = calc_time;
+    dirty_rate_start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000;
+    qemu_thread_create(&thread, "dirtyrate", dirty_rate_thread, NULL,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info = g_malloc0(sizeof(*info));
+    DirtyRateVcpuList *head = NULL, **tail = &head;
+    int i;
+
+    info->status = dirty_rate_status;
+    info->start_time = dirty_rate_start_time;
+    info->calc_time = dirty_rate_calc_time;
+
+    if (dirty_rate_status != DIRTY_RATE_STATUS_MEASURED) {
+        return info;
+    }
+
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirty_rate_mbps;
+
+    for (i = 0; i < dirty_rate_nr_vcpus; i++) {
+        DirtyRateVcpuList *entry = g_malloc0(sizeof(*entry));
+
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->id = dirty_rate_vcpus[i].id;
+        entry->value->dirty_rate = dirty_rate_vcpus[i].dirty_rate;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    if (head) {
+        info->has_vcpu_dirty_rate = true;
+        info->vcpu_dirty_rate = head;
+    }
+
+    return info;
+}
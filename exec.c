@@ -1262,11 +1262,11 @@ static ram_addr_t ram_block_add(RAMBlock *new_block)
     }
     ram_list.mru_block = NULL;
 
-    ram_list.version++;
-    qemu_mutex_unlock_ramlist();
-
     new_ram_size = last_ram_offset() >> TARGET_PAGE_BITS;
 
+    /* The migration thread walks the dirty bitmaps with only the ramlist
+     * lock held, so they must be resized under it.
+     */
     if (new_ram_size > old_ram_size) {
         int i;
         for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
@@ -1275,6 +1275,10 @@ static ram_addr_t ram_block_add(RAMBlock *new_block)
                                    old_ram_size, new_ram_size);
        }
     }
+
+    ram_list.version++;
+    qemu_mutex_unlock_ramlist();
+
     cpu_physical_memory_set_dirty_range(new_block->offset, new_block->length);
 
     qemu_ram_setup_dump(new_block->host, new_block->length);
@@ -1568,6 +1572,10 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
     default:
         abort();
     }
+    if (!cpu_physical_memory_get_dirty_flag(ram_addr,
+                                            DIRTY_MEMORY_MIGRATION)) {
+        current_cpu->dirty_pages++;
+    }
     cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_MIGRATION);
     cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_VGA);
     /* we remove the notdirty callback only if the code has been
@@ -940,6 +940,22 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "second:i",
+        .params     = "second",
+        .help       = "start measuring the guest dirty page rate over "
+                      "'second' seconds",
+        .mhandler.cmd = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{second}
+@findex calc_dirty_rate
+Start measuring the guest dirty page rate over @var{second} seconds, without
+starting a migration. Use @code{info dirty_rate} to see the result.
 ETEXI
 
     {
@@ -1770,6 +1786,8 @@ show migration status
 show current migration capabilities
 @item info migrate_cache_size
 show current migration XBZRLE cache size
+@item info dirty_rate
+show the result of the last guest dirty page rate measurement
 @item info balloon
 show balloon information
 @item info qtree
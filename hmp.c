@@ -172,6 +172,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "setup: %" PRIu64 " milliseconds\n",
                            info->setup_time);
         }
+        if (info->has_cpu_throttle_percentage) {
+            monitor_printf(mon, "cpu throttle percentage: %" PRId64 "\n",
+                           info->cpu_throttle_percentage);
+        }
     }
 
     if (info->has_ram) {
@@ -193,6 +197,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync duration: %" PRIu64 " microseconds\n",
+                       info->ram->dirty_sync_duration);
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
@@ -252,6 +258,29 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info;
+    DirtyRateVcpuList *vcpu;
+
+    info = qmp_query_dirty_rate(NULL);
+
+    monitor_printf(mon, "Status: %s\n",
+                   DirtyRateStatus_lookup[info->status]);
+    monitor_printf(mon, "Start Time: %" PRIi64 " (s)\n", info->start_time);
+    monitor_printf(mon, "Period: %" PRIi64 " (s)\n", info->calc_time);
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "Dirty rate: %" PRIi64 " (MB/s)\n",
+                       info->dirty_rate);
+    }
+    for (vcpu = info->vcpu_dirty_rate; vcpu; vcpu = vcpu->next) {
+        monitor_printf(mon, "vcpu[%" PRIi64 "] dirty rate: %" PRIi64
+                       " (MB/s)\n", vcpu->value->id, vcpu->value->dirty_rate);
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -1039,6 +1068,21 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t sec = qdict_get_int(qdict, "second");
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(sec, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+    monitor_printf(mon, "Starting dirty rate measurement with period %"
+                   PRIi64 " seconds\n", sec);
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
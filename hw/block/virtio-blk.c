@@ -29,12 +29,18 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
-VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
+/* Largest request that merging may build, bdrv_aio_readv takes an int */
+#define VIRTIO_BLK_MAX_MERGE_SECTORS (INT_MAX >> BDRV_SECTOR_BITS)
+
+VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s, VirtQueue *vq)
 {
     VirtIOBlockReq *req = g_slice_new(VirtIOBlockReq);
     req->dev = s;
+    req->vq = vq;
     req->qiov.size = 0;
+    req->in_len = 0;
     req->next = NULL;
+    req->mr_next = NULL;
     return req;
 }
 
@@ -54,8 +60,8 @@ static void virtio_blk_complete_request(VirtIOBlockReq *req,
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->qiov.size + sizeof(*req->in));
-    virtio_notify(vdev, s->vq);
+    virtqueue_push(req->vq, &req->elem, req->in_len);
+    virtio_notify(vdev, req->vq);
 }
 
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
@@ -84,20 +90,32 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
 
 static void virtio_blk_rw_complete(void *opaque, int ret)
 {
-    VirtIOBlockReq *req = opaque;
+    VirtIOBlockReq *next = opaque;
 
-    trace_virtio_blk_rw_complete(req, ret);
+    while (next) {
+        VirtIOBlockReq *req = next;
+        next = req->mr_next;
+        trace_virtio_blk_rw_complete(req, ret);
 
-    if (ret) {
-        int p = virtio_ldl_p(VIRTIO_DEVICE(req->dev), &req->out.type);
-        bool is_read = !(p & VIRTIO_BLK_T_OUT);
-        if (virtio_blk_handle_rw_error(req, -ret, is_read))
-            return;
-    }
+        if (req->qiov.nalloc != -1) {
+            /* The head of a merged request owns a local copy of the
+             * iovecs, allocated in virtio_blk_submit_merged.
+             */
+            qemu_iovec_destroy(&req->qiov);
+        }
 
-    virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
-    bdrv_acct_done(req->dev->bs, &req->acct);
-    virtio_blk_free_request(req);
+        if (ret) {
+            int p = virtio_ldl_p(VIRTIO_DEVICE(req->dev), &req->out.type);
+            bool is_read = !(p & VIRTIO_BLK_T_OUT);
+            if (virtio_blk_handle_rw_error(req, -ret, is_read)) {
+                continue;
+            }
+        }
+
+        virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
+        bdrv_acct_done(req->dev->bs, &req->acct);
+        virtio_blk_free_request(req);
+    }
 }
 
 static void virtio_blk_flush_complete(void *opaque, int ret)
@@ -115,11 +133,11 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     virtio_blk_free_request(req);
 }
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+    VirtIOBlockReq *req = virtio_blk_alloc_request(s, vq);
 
-    if (!virtqueue_pop(s->vq, &req->elem)) {
+    if (!virtqueue_pop(vq, &req->elem)) {
         virtio_blk_free_request(req);
         return NULL;
     }
@@ -257,24 +275,104 @@ static void virtio_blk_handle_scsi(VirtIOBlockReq *req)
     virtio_blk_free_request(req);
 }
 
-void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb)
+/* Submit mrb->reqs[start..start+num_reqs-1], which are contiguous on disk,
+ * as a single request.  The requests are chained through mr_next so that
+ * virtio_blk_rw_complete completes all of them.
+ */
+static void virtio_blk_submit_merged(BlockDriverState *bs, MultiReqBuffer *mrb,
+                                     int start, int num_reqs, int niov)
+{
+    QEMUIOVector *qiov = &mrb->reqs[start]->qiov;
+    int64_t sector_num = mrb->reqs[start]->sector_num;
+    int nb_sectors;
+    int i;
+
+    if (num_reqs > 1) {
+        struct iovec *tmp_iov = qiov->iov;
+        int tmp_niov = qiov->niov;
+
+        /* The head's qiov points into its VirtQueueElement and cannot grow,
+         * replace it with an allocated one covering all requests.
+         */
+        qemu_iovec_init(qiov, niov);
+        for (i = 0; i < tmp_niov; i++) {
+            qemu_iovec_add(qiov, tmp_iov[i].iov_base, tmp_iov[i].iov_len);
+        }
+        for (i = start + 1; i < start + num_reqs; i++) {
+            qemu_iovec_concat(qiov, &mrb->reqs[i]->qiov, 0,
+                              mrb->reqs[i]->qiov.size);
+            mrb->reqs[i - 1]->mr_next = mrb->reqs[i];
+        }
+    }
+    nb_sectors = qiov->size / BDRV_SECTOR_SIZE;
+
+    trace_virtio_blk_submit_multireq(mrb, start, num_reqs, sector_num,
+                                     nb_sectors, mrb->is_write);
+
+    if (mrb->is_write) {
+        bdrv_aio_writev(bs, sector_num, qiov, nb_sectors,
+                        virtio_blk_rw_complete, mrb->reqs[start]);
+    } else {
+        bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
+                       virtio_blk_rw_complete, mrb->reqs[start]);
+    }
+}
+
+static int multireq_compare(const void *a, const void *b)
+{
+    const VirtIOBlockReq *req1 = *(VirtIOBlockReq **)a,
+                         *req2 = *(VirtIOBlockReq **)b;
+
+    if (req1->sector_num > req2->sector_num) {
+        return 1;
+    } else if (req1->sector_num < req2->sector_num) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Sort the queued requests, merge adjacent ones and submit them */
+void virtio_blk_submit_multireq(BlockDriverState *bs, MultiReqBuffer *mrb)
 {
-    int i, ret;
+    int i, start = 0, num_reqs = 0, niov = 0, nb_sectors = 0;
+    int64_t sector_num = 0;
 
-    if (!mrb->num_writes) {
+    if (mrb->num_reqs == 0) {
+        return;
+    }
+    if (mrb->num_reqs == 1) {
+        virtio_blk_submit_merged(bs, mrb, 0, 1, -1);
+        mrb->num_reqs = 0;
         return;
     }
 
-    ret = bdrv_aio_multiwrite(bs, mrb->blkreq, mrb->num_writes);
-    if (ret != 0) {
-        for (i = 0; i < mrb->num_writes; i++) {
-            if (mrb->blkreq[i].error) {
-                virtio_blk_rw_complete(mrb->blkreq[i].opaque, -EIO);
-            }
+    qsort(mrb->reqs, mrb->num_reqs, sizeof(*mrb->reqs), multireq_compare);
+
+    for (i = 0; i < mrb->num_reqs; i++) {
+        VirtIOBlockReq *req = mrb->reqs[i];
+        int req_sectors = req->qiov.size / BDRV_SECTOR_SIZE;
+
+        if (num_reqs > 0 &&
+            (sector_num + nb_sectors != req->sector_num ||
+             niov > IOV_MAX - req->qiov.niov ||
+             req_sectors > VIRTIO_BLK_MAX_MERGE_SECTORS - nb_sectors)) {
+            virtio_blk_submit_merged(bs, mrb, start, num_reqs, niov);
+            num_reqs = 0;
+        }
+
+        if (num_reqs == 0) {
+            start = i;
+            sector_num = req->sector_num;
+            nb_sectors = 0;
+            niov = 0;
         }
+        nb_sectors += req_sectors;
+        niov += req->qiov.niov;
+        num_reqs++;
     }
 
-    mrb->num_writes = 0;
+    virtio_blk_submit_merged(bs, mrb, start, num_reqs, niov);
+    mrb->num_reqs = 0;
 }
 
 static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
@@ -284,7 +382,7 @@ static void virtio_blk_handle_flush(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     /*
      * Make sure all outstanding writes are posted to the backing device.
      */
-    virtio_submit_multiwrite(req->dev->bs, mrb);
+    virtio_blk_submit_multireq(req->dev->bs, mrb);
     bdrv_aio_flush(req->dev->bs, virtio_blk_flush_complete, req);
 }
 
@@ -307,9 +405,23 @@ static bool virtio_blk_sect_range_ok(VirtIOBlock *dev,
     return true;
 }
 
+static void virtio_blk_add_to_multireq(VirtIOBlockReq *req,
+                                       MultiReqBuffer *mrb, bool is_write)
+{
+    /* Submit what is queued if the buffer is full or the direction changes */
+    if (mrb->num_reqs > 0 &&
+        (mrb->num_reqs == VIRTIO_BLK_MAX_MERGE_REQS ||
+         is_write != mrb->is_write || !req->dev->blk.request_merging)) {
+        virtio_blk_submit_multireq(req->dev->bs, mrb);
+    }
+
+    req->mr_next = NULL;
+    mrb->reqs[mrb->num_reqs++] = req;
+    mrb->is_write = is_write;
+}
+
 static void virtio_blk_handle_write(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
-    BlockRequest *blkreq;
     uint64_t sector;
 
     sector = virtio_ldq_p(VIRTIO_DEVICE(req->dev), &req->out.sector);
@@ -323,23 +435,11 @@ static void virtio_blk_handle_write(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     }
 
     bdrv_acct_start(req->dev->bs, &req->acct, req->qiov.size, BDRV_ACCT_WRITE);
-
-    if (mrb->num_writes == 32) {
-        virtio_submit_multiwrite(req->dev->bs, mrb);
-    }
-
-    blkreq = &mrb->blkreq[mrb->num_writes];
-    blkreq->sector = sector;
-    blkreq->nb_sectors = req->qiov.size / BDRV_SECTOR_SIZE;
-    blkreq->qiov = &req->qiov;
-    blkreq->cb = virtio_blk_rw_complete;
-    blkreq->opaque = req;
-    blkreq->error = 0;
-
-    mrb->num_writes++;
+    req->sector_num = sector;
+    virtio_blk_add_to_multireq(req, mrb, true);
 }
 
-static void virtio_blk_handle_read(VirtIOBlockReq *req)
+static void virtio_blk_handle_read(VirtIOBlockReq *req, MultiReqBuffer *mrb)
 {
     uint64_t sector;
 
@@ -354,9 +454,8 @@ static void virtio_blk_handle_read(VirtIOBlockReq *req)
     }
 
     bdrv_acct_start(req->dev->bs, &req->acct, req->qiov.size, BDRV_ACCT_READ);
-    bdrv_aio_readv(req->dev->bs, sector, &req->qiov,
-                   req->qiov.size / BDRV_SECTOR_SIZE,
-                   virtio_blk_rw_complete, req);
+    req->sector_num = sector;
+    virtio_blk_add_to_multireq(req, mrb, false);
 }
 
 void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
@@ -386,6 +485,8 @@ void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
         exit(1);
     }
 
+    /* We always touch the last byte, so just see how big in_iov is.  */
+    req->in_len = iov_size(in_iov, in_num);
     req->in = (void *)in_iov[in_num - 1].iov_base
               + in_iov[in_num - 1].iov_len
               - sizeof(struct virtio_blk_inhdr);
@@ -417,7 +518,7 @@ void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
         /* VIRTIO_BLK_T_IN is 0, so we can't just & it. */
         qemu_iovec_init_external(&req->qiov, &req->elem.in_sg[0],
                                  req->elem.in_num - 1);
-        virtio_blk_handle_read(req);
+        virtio_blk_handle_read(req, mrb);
     } else {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_UNSUPP);
         virtio_blk_free_request(req);
@@ -429,7 +530,7 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOBlock *s = VIRTIO_BLK(vdev);
     VirtIOBlockReq *req;
     MultiReqBuffer mrb = {
-        .num_writes = 0,
+        .num_reqs = 0,
     };
 
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
@@ -442,11 +543,13 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 #endif
 
-    while ((req = virtio_blk_get_request(s))) {
+    bdrv_io_plug(s->bs);
+    while ((req = virtio_blk_get_request(s, vq))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
-    virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_blk_submit_multireq(s->bs, &mrb);
+    bdrv_io_unplug(s->bs);
 
     /*
      * FIXME: Want to check for completions before returning to guest mode,
@@ -460,7 +563,7 @@ static void virtio_blk_dma_restart_bh(void *opaque)
     VirtIOBlock *s = opaque;
     VirtIOBlockReq *req = s->rq;
     MultiReqBuffer mrb = {
-        .num_writes = 0,
+        .num_reqs = 0,
     };
 
     qemu_bh_delete(s->bh);
@@ -468,12 +571,15 @@ static void virtio_blk_dma_restart_bh(void *opaque)
 
     s->rq = NULL;
 
+    bdrv_io_plug(s->bs);
     while (req) {
+        VirtIOBlockReq *next = req->next;
         virtio_blk_handle_request(req, &mrb);
-        req = req->next;
+        req = next;
     }
 
-    virtio_submit_multiwrite(s->bs, &mrb);
+    virtio_blk_submit_multireq(s->bs, &mrb);
+    bdrv_io_unplug(s->bs);
 }
 
 static void virtio_blk_dma_restart_cb(void *opaque, int running,
@@ -548,6 +654,7 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.physical_block_exp = get_physical_block_exp(s->conf);
     blkcfg.alignment_offset = 0;
     blkcfg.wce = bdrv_enable_write_cache(s->bs);
+    virtio_stw_p(vdev, &blkcfg.num_queues, s->blk.num_queues);
     memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
 }
 
@@ -576,6 +683,9 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     if (s->blk.config_wce) {
         features |= (1 << VIRTIO_BLK_F_CONFIG_WCE);
     }
+    if (s->blk.num_queues > 1) {
+        features |= (1 << VIRTIO_BLK_F_MQ);
+    }
     if (bdrv_enable_write_cache(s->bs))
         features |= (1 << VIRTIO_BLK_F_WCE);
 
@@ -640,6 +750,9 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
 
     while (req) {
         qemu_put_sbyte(f, 1);
+        if (s->blk.num_queues > 1) {
+            qemu_put_be32(f, virtio_get_queue_index(req->vq));
+        }
         qemu_put_buffer(f, (unsigned char *)&req->elem,
                         sizeof(VirtQueueElement));
         req = req->next;
@@ -664,15 +777,26 @@ static int virtio_blk_load_device(VirtIODevice *vdev, QEMUFile *f,
     VirtIOBlock *s = VIRTIO_BLK(vdev);
 
     while (qemu_get_sbyte(f)) {
-        VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+        unsigned nvq = 0;
+        VirtIOBlockReq *req;
+
+        if (s->blk.num_queues > 1) {
+            nvq = qemu_get_be32(f);
+            if (nvq >= s->blk.num_queues) {
+                error_report("Invalid virtqueue index %u in request", nvq);
+                return -EINVAL;
+            }
+        }
+
+        req = virtio_blk_alloc_request(s, virtio_get_queue(vdev, nvq));
         qemu_get_buffer(f, (unsigned char *)&req->elem,
                         sizeof(VirtQueueElement));
         req->next = s->rq;
         s->rq = req;
 
-        virtqueue_map_sg(req->elem.in_sg, req->elem.in_addr,
+        virtqueue_map_sg(vdev, req->elem.in_sg, req->elem.in_addr,
             req->elem.in_num, 1);
-        virtqueue_map_sg(req->elem.out_sg, req->elem.out_addr,
+        virtqueue_map_sg(vdev, req->elem.out_sg, req->elem.out_addr,
             req->elem.out_num, 0);
     }
 
@@ -732,6 +856,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     Error *err = NULL;
 #endif
     static int virtio_blk_id;
+    int i;
 
     if (!blk->conf.bs) {
         error_setg(errp, "drive property not set");
@@ -741,6 +866,11 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "Device needs media, but drive is empty");
         return;
     }
+    if (!blk->num_queues || blk->num_queues > VIRTIO_PCI_QUEUE_MAX) {
+        error_setg(errp, "num-queues must be between 1 and %d",
+                   VIRTIO_PCI_QUEUE_MAX);
+        return;
+    }
 
     blkconf_serial(&blk->conf, &blk->serial);
     s->original_wce = bdrv_enable_write_cache(blk->conf.bs);
@@ -757,7 +887,9 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     s->rq = NULL;
     s->sector_mask = (s->conf->logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
-    s->vq = virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    for (i = 0; i < blk->num_queues; i++) {
+        virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    }
     s->complete_request = virtio_blk_complete_request;
 #ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
     virtio_blk_data_plane_create(vdev, blk, &s->dataplane, &err);
@@ -812,6 +944,9 @@ static Property virtio_blk_properties[] = {
     DEFINE_BLOCK_CHS_PROPERTIES(VirtIOBlock, blk.conf),
     DEFINE_PROP_STRING("serial", VirtIOBlock, blk.serial),
     DEFINE_PROP_BIT("config-wce", VirtIOBlock, blk.config_wce, 0, true),
+    DEFINE_PROP_UINT16("num-queues", VirtIOBlock, blk.num_queues, 1),
+    DEFINE_PROP_BIT("request-merging", VirtIOBlock, blk.request_merging, 0,
+                    true),
 #ifdef __linux__
     DEFINE_PROP_BIT("scsi", VirtIOBlock, blk.scsi, 0, true),
 #endif
@@ -29,10 +29,13 @@
 #include "hw/pci/pci.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/gso.h"
+#include "net/tap.h"
 #include "hw/loader.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/dma.h"
 #include "qemu/iov.h"
+#include "qemu/error-report.h"
 
 #include "e1000_regs.h"
 
@@ -75,6 +78,23 @@ static int debugflags = DBGBIT(TXERR) | DBGBIT(GENERAL);
  *  Others never tested
  */
 
+/* Descriptors written back to the RX ring with a single DMA */
+#define E1000_RX_WB_MAX 64
+
+/*
+ * Adaptive mitigation: below E1000_MIT_RATE_LOW packets per second the
+ * guest's own settings are used as they are; above it RX interrupts are
+ * held back to E1000_MIT_ITR_LOW per second, and to E1000_MIT_ITR_BULK
+ * above E1000_MIT_RATE_BULK.  The rate is measured over at least
+ * E1000_MIT_RATE_WINDOW ns.
+ */
+#define E1000_MIT_RATE_WINDOW   1000000
+#define E1000_MIT_RATE_LOW      10000
+#define E1000_MIT_RATE_BULK     50000
+#define E1000_MIT_ITR_LOW       20000
+#define E1000_MIT_ITR_BULK      8000
+#define E1000_MIT_ITR(ints)     (1000000000 / ((ints) * 256))
+
 typedef struct E1000State_st {
     /*< private >*/
     PCIDevice parent_obj;
@@ -84,6 +104,7 @@ typedef struct E1000State_st {
     NICConf conf;
     MemoryRegion mmio;
     MemoryRegion io;
+    bool has_vnet_hdr;      /* peer takes TSO frames, see xmit_gso() */
 
     uint32_t mac_reg[0x8000];
     uint16_t phy_reg[0x20];
@@ -130,6 +151,16 @@ typedef struct E1000State_st {
     bool mit_timer_on;         /* Mitigation timer is running. */
     bool mit_irq_level;        /* Tracks interrupt pin level. */
     uint32_t mit_ide;          /* Tracks E1000_TXD_CMD_IDE bit. */
+    bool mit_adaptive;         /* Stretch RX interrupts under load. */
+    uint32_t mit_rx_pkts;      /* Packets received since mit_rx_start. */
+    int64_t mit_rx_start;      /* Start of the RX rate window, in ns. */
+    uint32_t mit_rx_delay;     /* Adaptive delay, in 256ns units. */
+
+    /* RX descriptors not yet written back, see e1000_rx_wb_add() */
+    struct e1000_rx_desc rx_wb[E1000_RX_WB_MAX];
+    uint32_t rx_wb_head;       /* Ring index of rx_wb[0]. */
+    unsigned int rx_wb_count;
+    uint32_t rx_ics;           /* Causes to raise once they are written. */
 
 /* Compatibility flags for migration to/from qemu 1.3.0 and older */
 #define E1000_FLAG_AUTONEG_BIT 0
@@ -255,6 +286,31 @@ mit_update_delay(uint32_t *curr, uint32_t value)
     }
 }
 
+/* Pick a delay for RX interrupts from the packet rate, in 256ns units */
+static uint32_t
+mit_rx_adaptive_delay(E1000State *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t elapsed = now - s->mit_rx_start;
+    uint64_t rate;
+
+    if (elapsed < E1000_MIT_RATE_WINDOW) {
+        return s->mit_rx_delay;
+    }
+
+    rate = (uint64_t)s->mit_rx_pkts * 1000000000 / elapsed;
+    if (rate < E1000_MIT_RATE_LOW) {
+        s->mit_rx_delay = 0;
+    } else if (rate < E1000_MIT_RATE_BULK) {
+        s->mit_rx_delay = E1000_MIT_ITR(E1000_MIT_ITR_LOW);
+    } else {
+        s->mit_rx_delay = E1000_MIT_ITR(E1000_MIT_ITR_BULK);
+    }
+    s->mit_rx_pkts = 0;
+    s->mit_rx_start = now;
+    return s->mit_rx_delay;
+}
+
 static void
 set_interrupt_cause(E1000State *s, int index, uint32_t val)
 {
@@ -303,6 +359,10 @@ set_interrupt_cause(E1000State *s, int index, uint32_t val)
                 mit_update_delay(&mit_delay, s->mac_reg[RADV] * 4);
             }
             mit_update_delay(&mit_delay, s->mac_reg[ITR]);
+            /* Adaptive mode only ever lengthens the guest's delay */
+            if (s->mit_adaptive && (pending_ints & E1000_ICS_RXT0)) {
+                mit_delay = MAX(mit_delay, mit_rx_adaptive_delay(s));
+            }
 
             if (mit_delay) {
                 s->mit_timer_on = 1;
@@ -383,6 +443,11 @@ static void e1000_reset(void *opaque)
     d->mit_timer_on = 0;
     d->mit_irq_level = 0;
     d->mit_ide = 0;
+    d->mit_rx_pkts = 0;
+    d->mit_rx_start = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    d->mit_rx_delay = 0;
+    d->rx_wb_count = 0;
+    d->rx_ics = 0;
     memset(d->phy_reg, 0, sizeof d->phy_reg);
     memmove(d->phy_reg, phy_reg_init, sizeof phy_reg_init);
     d->phy_reg[PHY_ID2] = edc->phy_id2;
@@ -567,17 +632,36 @@ fcs_len(E1000State *s)
     return (s->mac_reg[RCTL] & E1000_RCTL_SECRC) ? 0 : 4;
 }
 
+static ssize_t
+e1000_receive_frame(E1000State *s, const struct iovec *iov, int iovcnt);
+
 static void
 e1000_send_packet(E1000State *s, const uint8_t *buf, int size)
 {
+    static const struct virtio_net_hdr vhdr;
     NetClientState *nc = qemu_get_queue(s->nic);
+    struct iovec iov[2] = {
+        { .iov_base = (void *)&vhdr, .iov_len = sizeof(vhdr) },
+        { .iov_base = (void *)buf, .iov_len = size },
+    };
+
     if (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) {
-        nc->info->receive(nc, buf, size);
+        e1000_receive_frame(s, &iov[1], 1);
+    } else if (s->has_vnet_hdr) {
+        qemu_sendv_packet(nc, iov, 2);
     } else {
         qemu_send_packet(nc, buf, size);
     }
 }
 
+static void
+e1000_insert_vlan(struct e1000_tx *tp)
+{
+    memmove(tp->vlan, tp->data, 4);
+    memmove(tp->data, tp->data + 4, 8);
+    memcpy(tp->data + 8, tp->vlan_header, 4);
+}
+
 static void
 xmit_seg(E1000State *s)
 {
@@ -621,9 +705,7 @@ xmit_seg(E1000State *s)
     if (tp->sum_needed & E1000_TXD_POPTS_IXSM)
         putsum(tp->data, tp->size, tp->ipcso, tp->ipcss, tp->ipcse);
     if (tp->vlan_needed) {
-        memmove(tp->vlan, tp->data, 4);
-        memmove(tp->data, tp->data + 4, 8);
-        memcpy(tp->data + 8, tp->vlan_header, 4);
+        e1000_insert_vlan(tp);
         e1000_send_packet(s, tp->vlan, tp->size + 4);
     } else
         e1000_send_packet(s, tp->data, tp->size);
@@ -634,6 +716,81 @@ xmit_seg(E1000State *s)
         s->mac_reg[TOTH]++;
 }
 
+/*
+ * TSO frames that fit in tx.data are collected whole and handed to
+ * net_gso_send(), which either passes them to a tap peer behind a
+ * virtio-net header or slices the payload into segments without copying
+ * it.  Larger ones (paylen goes up to 1MB) are still cut by xmit_seg() as
+ * the descriptors come in.
+ */
+static inline bool
+e1000_tso_whole(struct e1000_tx *tp)
+{
+    return tp->tso_frames == 0 &&
+           tp->hdr_len + tp->paylen <= sizeof(tp->data);
+}
+
+static void
+e1000_send_gso_seg(void *opaque, const struct iovec *iov, int iovcnt, int segs)
+{
+    E1000State *s = opaque;
+    struct e1000_tx *tp = &s->tx;
+    size_t size = iov_size(iov, iovcnt);
+    unsigned int n;
+
+    if (s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK) {
+        e1000_receive_frame(s, iov, iovcnt);
+    } else {
+        qemu_sendv_packet(qemu_get_queue(s->nic), iov, iovcnt);
+        if (s->has_vnet_hdr) {
+            size -= sizeof(struct virtio_net_hdr);
+        }
+    }
+
+    /* A frame passed to the peer stands for several on the wire */
+    size += (segs - 1) * (tp->hdr_len + (tp->vlan_needed ? 4 : 0));
+    s->mac_reg[TPT] += segs;
+    s->mac_reg[GPTC] += segs;
+    n = s->mac_reg[TOTL];
+    if ((s->mac_reg[TOTL] += size) < n)
+        s->mac_reg[TOTH]++;
+}
+
+static void
+xmit_gso(E1000State *s)
+{
+    struct e1000_tx *tp = &s->tx;
+    unsigned int vlan = tp->vlan_needed ? 4 : 0;
+    bool loopback = s->phy_reg[PHY_CTRL] & MII_CR_LOOPBACK;
+    struct iovec iov;
+    NetGso gso;
+
+    if (tp->vlan_needed) {
+        e1000_insert_vlan(tp);
+        iov.iov_base = tp->vlan;
+    } else {
+        iov.iov_base = tp->data;
+    }
+    iov.iov_len = tp->size + vlan;
+
+    if (!tp->tcp) {
+        gso.type = VIRTIO_NET_HDR_GSO_UDP;
+    } else if (tp->ip) {
+        gso.type = VIRTIO_NET_HDR_GSO_TCPV4;
+    } else {
+        gso.type = VIRTIO_NET_HDR_GSO_TCPV6;
+    }
+    gso.l3_off = tp->ipcss + vlan;
+    gso.l4_off = tp->tucss + vlan;
+    gso.hdr_len = tp->hdr_len + vlan;
+    gso.mss = tp->mss;
+
+    if (net_gso_send(&iov, 1, &gso, s->has_vnet_hdr && !loopback,
+                     e1000_send_gso_seg, s) < 0) {
+        DBGOUT(TXERR, "TCP segmentation error: bad headers\n");
+    }
+}
+
 static void
 process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
 {
@@ -688,7 +845,7 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
     }
         
     addr = le64_to_cpu(dp->buffer_addr);
-    if (tp->tse && tp->cptse) {
+    if (tp->tse && tp->cptse && !e1000_tso_whole(tp)) {
         msh = tp->hdr_len + tp->mss;
         do {
             bytes = split_size;
@@ -720,7 +877,9 @@ process_tx_desc(E1000State *s, struct e1000_tx_desc *dp)
 
     if (!(txd_lower & E1000_TXD_CMD_EOP))
         return;
-    if (!(tp->tse && tp->cptse && tp->size < tp->hdr_len)) {
+    if (tp->tse && tp->cptse && e1000_tso_whole(tp)) {
+        xmit_gso(s);
+    } else if (!(tp->tse && tp->cptse && tp->size < tp->hdr_len)) {
         xmit_seg(s);
     }
     tp->tso_frames = 0;
@@ -914,10 +1073,63 @@ static uint64_t rx_desc_base(E1000State *s)
     return (bah << 32) + bal;
 }
 
+/* Write the pending descriptors back to the ring in one go */
+static void
+e1000_rx_wb_flush(E1000State *s)
+{
+    if (!s->rx_wb_count) {
+        return;
+    }
+    pci_dma_write(PCI_DEVICE(s),
+                  rx_desc_base(s) + sizeof(s->rx_wb[0]) * s->rx_wb_head,
+                  s->rx_wb, sizeof(s->rx_wb[0]) * s->rx_wb_count);
+    s->rx_wb_count = 0;
+}
+
+/*
+ * Queue the descriptor at RDH for writeback.  The cache only ever holds a
+ * contiguous run of the ring; it is flushed when that run would break
+ * because RDH wrapped around or RDBA/RDLEN were changed under us.
+ */
+static void
+e1000_rx_wb_add(E1000State *s, const struct e1000_rx_desc *desc)
+{
+    if (s->rx_wb_count == E1000_RX_WB_MAX ||
+        (s->rx_wb_count &&
+         s->rx_wb_head + s->rx_wb_count != s->mac_reg[RDH])) {
+        e1000_rx_wb_flush(s);
+    }
+    if (!s->rx_wb_count) {
+        s->rx_wb_head = s->mac_reg[RDH];
+    }
+    s->rx_wb[s->rx_wb_count++] = *desc;
+}
+
+/*
+ * Make the received packets visible to the guest and raise the interrupt
+ * causes they left behind.  Descriptors go out before the interrupt, the
+ * same order a real NIC uses.
+ */
+static void
+e1000_rx_complete(E1000State *s)
+{
+    uint32_t ics = s->rx_ics;
+
+    e1000_rx_wb_flush(s);
+    if (ics) {
+        s->rx_ics = 0;
+        set_ics(s, 0, ics);
+    }
+}
+
+/*
+ * Put one frame in the RX ring.  Descriptor writeback and the interrupt
+ * are left to e1000_rx_complete(), so that a batch of frames costs one of
+ * each.
+ */
 static ssize_t
-e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
+e1000_receive_one(E1000State *s, const struct iovec *iov, int iovcnt)
 {
-    E1000State *s = qemu_get_nic_opaque(nc);
     PCIDevice *d = PCI_DEVICE(s);
     struct e1000_rx_desc desc;
     dma_addr_t base;
@@ -989,7 +1201,7 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
     desc_offset = 0;
     total_size = size + fcs_len(s);
     if (!e1000_has_rxbufs(s, total_size)) {
-            set_ics(s, 0, E1000_ICS_RXO);
+            s->rx_ics |= E1000_ICS_RXO;
             return -1;
     }
     do {
@@ -1033,7 +1245,7 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
         } else { // as per intel docs; skip descriptors with null buf addr
             DBGOUT(RX, "Null RX descriptor!!\n");
         }
-        pci_dma_write(d, base, &desc, sizeof(desc));
+        e1000_rx_wb_add(s, &desc);
 
         if (++s->mac_reg[RDH] * sizeof(desc) >= s->mac_reg[RDLEN])
             s->mac_reg[RDH] = 0;
@@ -1041,13 +1253,14 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
         if (s->mac_reg[RDH] == rdh_start) {
             DBGOUT(RXERR, "RDH wraparound @%x, RDT %x, RDLEN %x\n",
                    rdh_start, s->mac_reg[RDT], s->mac_reg[RDLEN]);
-            set_ics(s, 0, E1000_ICS_RXO);
+            s->rx_ics |= E1000_ICS_RXO;
             return -1;
         }
     } while (desc_offset < total_size);
 
     s->mac_reg[GPRC]++;
     s->mac_reg[TPR]++;
+    s->mit_rx_pkts++;
     /* TOR - Total Octets Received:
      * This register includes bytes received in a packet from the <Destination
      * Address> field through the <CRC> field, inclusively.
@@ -1064,11 +1277,80 @@ e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
         s->rxbuf_min_shift)
         n |= E1000_ICS_RXDMT0;
 
-    set_ics(s, 0, n);
+    s->rx_ics |= n;
 
     return size;
 }
 
+static ssize_t
+e1000_receive_frame(E1000State *s, const struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+
+    ret = e1000_receive_one(s, iov, iovcnt);
+    e1000_rx_complete(s);
+    return ret;
+}
+
+/* Receive a packet from the peer, which may start with a virtio-net header */
+static ssize_t
+e1000_receive_peer(E1000State *s, const struct iovec *iov, int iovcnt)
+{
+    struct iovec frame_iov[4], *p = frame_iov;
+    size_t size;
+    ssize_t ret;
+
+    if (!s->has_vnet_hdr) {
+        return e1000_receive_one(s, iov, iovcnt);
+    }
+
+    /* Receive offloads are off on the peer, so the header says nothing */
+    size = iov_size(iov, iovcnt);
+    if (size <= sizeof(struct virtio_net_hdr)) {
+        return size;
+    }
+    if (iovcnt > ARRAY_SIZE(frame_iov)) {
+        p = g_new(struct iovec, iovcnt);
+    }
+    ret = e1000_receive_one(s, p,
+                            iov_copy(p, iovcnt, iov, iovcnt,
+                                     sizeof(struct virtio_net_hdr),
+                                     size - sizeof(struct virtio_net_hdr)));
+    if (p != frame_iov) {
+        g_free(p);
+    }
+    return ret;
+}
+
+static ssize_t
+e1000_receive_iov(NetClientState *nc, const struct iovec *iov, int iovcnt)
+{
+    E1000State *s = qemu_get_nic_opaque(nc);
+    ssize_t ret;
+
+    ret = e1000_receive_peer(s, iov, iovcnt);
+    e1000_rx_complete(s);
+    return ret;
+}
+
+/*
+ * Fill the RX ring with as much of the batch as fits, then write the
+ * descriptors back and interrupt the guest once for all of it.
+ */
+static int
+e1000_receive_iov_batch(NetClientState *nc, const NetIOVPacket *pkts,
+                        int count)
+{
+    E1000State *s = qemu_get_nic_opaque(nc);
+    int i;
+
+    for (i = 0; i < count && e1000_can_receive(nc); i++) {
+        e1000_receive_peer(s, pkts[i].iov, pkts[i].iovcnt);
+    }
+    e1000_rx_complete(s);
+    return i;
+}
+
 static ssize_t
 e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
@@ -1507,6 +1789,7 @@ static NetClientInfo net_e1000_info = {
     .can_receive = e1000_can_receive,
     .receive = e1000_receive,
     .receive_iov = e1000_receive_iov,
+    .receive_iov_batch = e1000_receive_iov_batch,
     .cleanup = e1000_cleanup,
     .link_status_changed = e1000_set_link_status,
 };
@@ -1516,11 +1799,17 @@ static int pci_e1000_init(PCIDevice *pci_dev)
     DeviceState *dev = DEVICE(pci_dev);
     E1000State *d = E1000(pci_dev);
     PCIDeviceClass *pdc = PCI_DEVICE_GET_CLASS(pci_dev);
+    NetClientState *peer;
     uint8_t *pci_conf;
     uint16_t checksum = 0;
     int i;
     uint8_t *macaddr;
 
+    if (d->mit_adaptive && !(d->compat_flags & E1000_FLAG_MIT)) {
+        error_report("e1000: adaptive-mitigation=on requires mitigation=on");
+        return -1;
+    }
+
     pci_conf = pci_dev->config;
 
     /* TODO: RST# value should be 0, PCI spec 6.2.4 */
@@ -1549,6 +1838,13 @@ static int pci_e1000_init(PCIDevice *pci_dev)
     d->nic = qemu_new_nic(&net_e1000_info, &d->conf,
                           object_get_typename(OBJECT(d)), dev->id, d);
 
+    peer = qemu_get_queue(d->nic)->peer;
+    if (qemu_has_vnet_hdr(peer)) {
+        qemu_set_vnet_hdr_len(peer, sizeof(struct virtio_net_hdr));
+        qemu_using_vnet_hdr(peer, true);
+        d->has_vnet_hdr = true;
+    }
+
     qemu_format_nic_info_str(qemu_get_queue(d->nic), macaddr);
 
     add_boot_device_path(d->conf.bootindex, dev, "/ethernet-phy@0");
@@ -1571,6 +1867,7 @@ static Property e1000_properties[] = {
                     compat_flags, E1000_FLAG_AUTONEG_BIT, true),
     DEFINE_PROP_BIT("mitigation", E1000State,
                     compat_flags, E1000_FLAG_MIT_BIT, true),
+    DEFINE_PROP_BOOL("adaptive-mitigation", E1000State, mit_adaptive, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -56,6 +56,8 @@
 #include "sysemu/dma.h"
 #include "qemu/timer.h"
 #include "net/net.h"
+#include "net/gso.h"
+#include "net/tap.h"
 #include "hw/loader.h"
 #include "sysemu/sysemu.h"
 #include "qemu/iov.h"
@@ -1820,6 +1822,31 @@ static void rtl8139_transfer_frame(RTL8139State *s, uint8_t *buf, int size,
     }
 }
 
+/* Called by net_gso_send() for each segment of a C+ mode large send */
+static void rtl8139_send_gso_seg(void *opaque, const struct iovec *iov,
+                                 int iovcnt, int segs)
+{
+    RTL8139State *s = opaque;
+    size_t size;
+    uint8_t *buf;
+
+    if (TxLoopBack == (s->TxConfig & TxLoopBack))
+    {
+        size = iov_size(iov, iovcnt);
+        buf = g_malloc(size);
+        iov_to_buf(iov, iovcnt, 0, buf, size);
+
+        DPRINTF("+++ transmit loopback mode\n");
+        rtl8139_do_receive(qemu_get_queue(s->nic), buf, size, 0);
+
+        g_free(buf);
+    }
+    else
+    {
+        qemu_sendv_packet(qemu_get_queue(s->nic), iov, iovcnt);
+    }
+}
+
 static int rtl8139_transmit_one(RTL8139State *s, int descriptor)
 {
     if (!rtl8139_transmitter_enabled(s))
@@ -2219,109 +2246,52 @@ static int rtl8139_cplus_transmit_one(RTL8139State *s)
                         "frame data %d specified MSS=%d\n", ETH_MTU,
                         ip_data_len, saved_size - ETH_HLEN, large_send_mss);
 
-                    int tcp_send_offset = 0;
-                    int send_count = 0;
-
-                    /* maximum IP header length is 60 bytes */
-                    uint8_t saved_ip_header[60];
-
-                    /* save IP header template; data area is used in tcp checksum calculation */
-                    memcpy(saved_ip_header, eth_payload_data, hlen);
-
-                    /* a placeholder for checksum calculation routine in tcp case */
-                    uint8_t *data_to_checksum     = eth_payload_data + hlen - 12;
-                    //                    size_t   data_to_checksum_len = eth_payload_len  - hlen + 12;
-
                     /* pointer to TCP header */
                     tcp_header *p_tcp_hdr = (tcp_header*)(eth_payload_data + hlen);
 
                     int tcp_hlen = TCP_HEADER_DATA_OFFSET(p_tcp_hdr);
 
                     /* ETH_MTU = ip header len + tcp header len + payload */
-                    int tcp_data_len = ip_data_len - tcp_hlen;
                     int tcp_chunk_size = ETH_MTU - hlen - tcp_hlen;
 
                     DPRINTF("+++ C+ mode TSO IP data len %d TCP hlen %d TCP "
-                        "data len %d TCP chunk size %d\n", ip_data_len,
-                        tcp_hlen, tcp_data_len, tcp_chunk_size);
-
-                    /* note the cycle below overwrites IP header data,
-                       but restores it from saved_ip_header before sending packet */
-
-                    int is_last_frame = 0;
-
-                    for (tcp_send_offset = 0; tcp_send_offset < tcp_data_len; tcp_send_offset += tcp_chunk_size)
-                    {
-                        uint16_t chunk_size = tcp_chunk_size;
-
-                        /* check if this is the last frame */
-                        if (tcp_send_offset + tcp_chunk_size >= tcp_data_len)
-                        {
-                            is_last_frame = 1;
-                            chunk_size = tcp_data_len - tcp_send_offset;
-                        }
-
-                        DPRINTF("+++ C+ mode TSO TCP seqno %08x\n",
-                            be32_to_cpu(p_tcp_hdr->th_seq));
-
-                        /* add 4 TCP pseudoheader fields */
-                        /* copy IP source and destination fields */
-                        memcpy(data_to_checksum, saved_ip_header + 12, 8);
-
-                        DPRINTF("+++ C+ mode TSO calculating TCP checksum for "
-                            "packet with %d bytes data\n", tcp_hlen +
-                            chunk_size);
-
-                        if (tcp_send_offset)
-                        {
-                            memcpy((uint8_t*)p_tcp_hdr + tcp_hlen, (uint8_t*)p_tcp_hdr + tcp_hlen + tcp_send_offset, chunk_size);
-                        }
-
-                        /* keep PUSH and FIN flags only for the last frame */
-                        if (!is_last_frame)
-                        {
-                            TCP_HEADER_CLEAR_FLAGS(p_tcp_hdr, TCP_FLAG_PUSH|TCP_FLAG_FIN);
-                        }
-
-                        /* recalculate TCP checksum */
-                        ip_pseudo_header *p_tcpip_hdr = (ip_pseudo_header *)data_to_checksum;
-                        p_tcpip_hdr->zeros      = 0;
-                        p_tcpip_hdr->ip_proto   = IP_PROTO_TCP;
-                        p_tcpip_hdr->ip_payload = cpu_to_be16(tcp_hlen + chunk_size);
-
-                        p_tcp_hdr->th_sum = 0;
-
-                        int tcp_checksum = ip_checksum(data_to_checksum, tcp_hlen + chunk_size + 12);
-                        DPRINTF("+++ C+ mode TSO TCP checksum %04x\n",
-                            tcp_checksum);
-
-                        p_tcp_hdr->th_sum = tcp_checksum;
-
-                        /* restore IP header */
-                        memcpy(eth_payload_data, saved_ip_header, hlen);
-
-                        /* set IP data length and recalculate IP checksum */
-                        ip->ip_len = cpu_to_be16(hlen + tcp_hlen + chunk_size);
-
-                        /* increment IP id for subsequent frames */
-                        ip->ip_id = cpu_to_be16(tcp_send_offset/tcp_chunk_size + be16_to_cpu(ip->ip_id));
-
-                        ip->ip_sum = 0;
-                        ip->ip_sum = ip_checksum(eth_payload_data, hlen);
-                        DPRINTF("+++ C+ mode TSO IP header len=%d "
-                            "checksum=%04x\n", hlen, ip->ip_sum);
-
-                        int tso_send_size = ETH_HLEN + hlen + tcp_hlen + chunk_size;
-                        DPRINTF("+++ C+ mode TSO transferring packet size "
-                            "%d\n", tso_send_size);
-                        rtl8139_transfer_frame(s, saved_buffer, tso_send_size,
-                            0, (uint8_t *) dot1q_buffer);
-
-                        /* add transferred count to TCP sequence number */
-                        p_tcp_hdr->th_seq = cpu_to_be32(chunk_size + be32_to_cpu(p_tcp_hdr->th_seq));
-                        ++send_count;
+                        "chunk size %d\n", ip_data_len, tcp_hlen,
+                        tcp_chunk_size);
+
+                    /* the segments are sliced out of saved_buffer */
+                    size_t tso_size = MIN(saved_size,
+                                          ETH_HLEN + hlen + ip_data_len);
+                    int vlan_len = dot1q_buffer ? VLAN_HLEN : 0;
+                    struct iovec tso_iov[3];
+                    int tso_iovcnt;
+
+                    if (dot1q_buffer) {
+                        tso_iov[0].iov_base = saved_buffer;
+                        tso_iov[0].iov_len = ETHER_ADDR_LEN * 2;
+                        tso_iov[1].iov_base = dot1q_buffer;
+                        tso_iov[1].iov_len = VLAN_HLEN;
+                        tso_iov[2].iov_base = saved_buffer + ETHER_ADDR_LEN * 2;
+                        tso_iov[2].iov_len = tso_size - ETHER_ADDR_LEN * 2;
+                        tso_iovcnt = 3;
+                    } else {
+                        tso_iov[0].iov_base = saved_buffer;
+                        tso_iov[0].iov_len = tso_size;
+                        tso_iovcnt = 1;
                     }
 
+                    NetGso gso = {
+                        .type = VIRTIO_NET_HDR_GSO_TCPV4,
+                        .l3_off = ETH_HLEN + vlan_len,
+                        .l4_off = ETH_HLEN + vlan_len + hlen,
+                        .hdr_len = ETH_HLEN + vlan_len + hlen + tcp_hlen,
+                        .mss = tcp_chunk_size,
+                    };
+
+                    int send_count = net_gso_send(tso_iov, tso_iovcnt, &gso,
+                                                  false, rtl8139_send_gso_seg,
+                                                  s);
+                    DPRINTF("+++ C+ mode TSO sent %d frames\n", send_count);
+
                     /* Stop sending this frame */
                     saved_size = 0;
                 }
@@ -156,6 +156,8 @@ struct vhost_net *vhost_net_init(VhostNetOptions *options)
 
     net->dev.nvqs = 2;
     net->dev.vqs = net->vqs;
+    /* vhost-user addresses rings by their index in the whole device */
+    net->dev.vq_index = net->nc->queue_index * net->dev.nvqs;
 
     r = vhost_dev_init(&net->dev, options->opaque,
                        options->backend_type, options->force);
@@ -188,6 +190,16 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return vhost_dev_query(&net->dev, dev);
 }
 
+uint64_t vhost_net_get_max_queues(VHostNetState *net)
+{
+    return net->dev.max_queues;
+}
+
+unsigned vhost_net_get_acked_features(VHostNetState *net)
+{
+    return net->dev.acked_features;
+}
+
 static int vhost_net_start_one(struct vhost_net *net,
                                VirtIODevice *dev,
                                int vq_index)
@@ -288,6 +300,27 @@ static bool vhost_net_device_endian_ok(VirtIODevice *vdev)
 #endif
 }
 
+/*
+ * Send the features and memory tables of all queue pairs before starting
+ * them, the tables in one go; vhost_dev_start() then skips those steps.
+ */
+static int vhost_net_preload(NetClientState *ncs, int total_queues)
+{
+    struct vhost_dev **devs = g_new(struct vhost_dev *, total_queues);
+    int i, n = 0, r;
+
+    for (i = 0; i < total_queues; i++) {
+        struct vhost_net *net = get_vhost_net(ncs[i].peer);
+
+        if (!net->dev.started) {
+            devs[n++] = &net->dev;
+        }
+    }
+    r = vhost_dev_preload(devs, n);
+    g_free(devs);
+    return r;
+}
+
 int vhost_net_start(VirtIODevice *dev, NetClientState *ncs,
                     int total_queues)
 {
@@ -308,12 +341,32 @@ int vhost_net_start(VirtIODevice *dev, NetClientState *ncs,
         goto err;
     }
 
+    /*
+     * Only the SET_MEM_TABLE of the queue pairs is sent in parallel, by
+     * vhost_net_preload().  The devices were set up one by one in
+     * vhost_dev_init() when the netdev was created, and their virtqueues
+     * are still set up one queue pair after the other below.
+     */
+    r = vhost_net_preload(ncs, total_queues);
+    if (r < 0) {
+        goto err;
+    }
+
     for (i = 0; i < total_queues; i++) {
         r = vhost_net_start_one(get_vhost_net(ncs[i].peer), dev, i * 2);
 
         if (r < 0) {
             goto err;
         }
+
+        if (ncs[i].peer->vring_enable) {
+            /* restore vring enable state */
+            r = vhost_set_vring_enable(ncs[i].peer, ncs[i].peer->vring_enable);
+            if (r < 0) {
+                vhost_net_stop_one(get_vhost_net(ncs[i].peer), dev);
+                goto err;
+            }
+        }
     }
 
     r = k->set_guest_notifiers(qbus->parent, total_queues * 2, true);
@@ -328,6 +381,9 @@ err:
     while (--i >= 0) {
         vhost_net_stop_one(get_vhost_net(ncs[i].peer), dev);
     }
+    for (i = 0; i < total_queues; i++) {
+        get_vhost_net(ncs[i].peer)->dev.preloaded = false;
+    }
     return r;
 }
 
@@ -368,6 +424,25 @@ void vhost_net_virtqueue_mask(VHostNetState *net, VirtIODevice *dev,
     vhost_virtqueue_mask(&net->dev, dev, idx, mask);
 }
 
+int vhost_set_vring_enable(NetClientState *nc, int enable)
+{
+    VHostNetState *net = get_vhost_net(nc);
+    const VhostOps *vhost_ops;
+
+    nc->vring_enable = enable;
+
+    if (!net) {
+        return 0;
+    }
+
+    vhost_ops = net->dev.vhost_ops;
+    if (vhost_ops->vhost_backend_set_vring_enable) {
+        return vhost_ops->vhost_backend_set_vring_enable(&net->dev, enable);
+    }
+
+    return 0;
+}
+
 VHostNetState *get_vhost_net(NetClientState *nc)
 {
     VHostNetState *vhost_net = 0;
@@ -389,6 +464,27 @@ VHostNetState *get_vhost_net(NetClientState *nc)
 
     return vhost_net;
 }
+
+/* Whether the backend can run the rings now, whatever link state the user
+ * has set on it.
+ */
+bool vhost_net_backend_connected(NetClientState *nc)
+{
+    if (nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        return vhost_user_connected(nc);
+    }
+    return true;
+}
+
+/* The vhost-user connection under the device went away.  Whatever is still
+ * asked of the device fails from now on instead of going to the next
+ * backend that connects.
+ */
+void vhost_net_backend_lost(VHostNetState *net)
+{
+    assert(net->dev.vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+    net->dev.opaque = NULL;
+}
 #else
 struct vhost_net *vhost_net_init(VhostNetOptions *options)
 {
@@ -401,6 +497,16 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return false;
 }
 
+uint64_t vhost_net_get_max_queues(VHostNetState *net)
+{
+    return 1;
+}
+
+unsigned vhost_net_get_acked_features(VHostNetState *net)
+{
+    return 0;
+}
+
 int vhost_net_start(VirtIODevice *dev,
                     NetClientState *ncs,
                     int total_queues)
@@ -439,4 +545,18 @@ VHostNetState *get_vhost_net(NetClientState *nc)
 {
     return 0;
 }
+
+bool vhost_net_backend_connected(NetClientState *nc)
+{
+    return true;
+}
+
+void vhost_net_backend_lost(VHostNetState *net)
+{
+}
+
+int vhost_set_vring_enable(NetClientState *nc, int enable)
+{
+    return 0;
+}
 #endif
@@ -15,9 +15,11 @@
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/eth.h"
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
+#include "qemu/toeplitz.h"
 #include "hw/virtio/virtio-net.h"
 #include "net/vhost_net.h"
 #include "hw/virtio/virtio-bus.h"
@@ -59,6 +61,17 @@ static VirtIONetQueue *virtio_net_get_subqueue(NetClientState *nc)
     return &n->vqs[nc->queue_index];
 }
 
+/* With RSS all queue pairs go through the NIC's only NetClientState */
+static NetClientState *virtio_net_queue_nc(VirtIONet *n, int queue_index)
+{
+    return qemu_get_subqueue(n->nic, n->rss ? 0 : queue_index);
+}
+
+static int virtio_net_nc_count(VirtIONet *n)
+{
+    return n->rss ? 1 : n->max_queues;
+}
+
 static int vq2q(int queue_index)
 {
     return queue_index / 2;
@@ -121,7 +134,8 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 
     if (!!n->vhost_started ==
-        (virtio_net_started(n, status) && !nc->peer->link_down)) {
+        (virtio_net_started(n, status) && !nc->peer->link_down &&
+         vhost_net_backend_connected(nc->peer))) {
         return;
     }
     if (!n->vhost_started) {
@@ -369,7 +383,7 @@ static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs)
     n->guest_hdr_len = n->mergeable_rx_bufs ?
         sizeof(struct virtio_net_hdr_mrg_rxbuf) : sizeof(struct virtio_net_hdr);
 
-    for (i = 0; i < n->max_queues; i++) {
+    for (i = 0; i < virtio_net_nc_count(n); i++) {
         nc = qemu_get_subqueue(n->nic, i);
 
         if (peer_has_vnet_hdr(n) &&
@@ -388,6 +402,10 @@ static int peer_attach(VirtIONet *n, int index)
         return 0;
     }
 
+    if (nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        vhost_set_vring_enable(nc->peer, 1);
+    }
+
     if (nc->peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
         return 0;
     }
@@ -403,6 +421,10 @@ static int peer_detach(VirtIONet *n, int index)
         return 0;
     }
 
+    if (nc->peer->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        vhost_set_vring_enable(nc->peer, 0);
+    }
+
     if (nc->peer->info->type !=  NET_CLIENT_OPTIONS_KIND_TAP) {
         return 0;
     }
@@ -410,11 +432,26 @@ static int peer_detach(VirtIONet *n, int index)
     return tap_disable(nc->peer);
 }
 
+/* Spread the hash values evenly across the queue pairs in use */
+static void virtio_net_rss_update(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < VIRTIO_NET_RSS_INDIRECTION_TABLE_SIZE; i++) {
+        n->rss_indirection_table[i] = i % n->curr_queues;
+    }
+}
+
 static void virtio_net_set_queues(VirtIONet *n)
 {
     int i;
     int r;
 
+    if (n->rss) {
+        virtio_net_rss_update(n);
+        return;
+    }
+
     for (i = 0; i < n->max_queues; i++) {
         if (i < n->curr_queues) {
             r = peer_attach(n, i);
@@ -516,7 +553,7 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
         virtio_net_apply_guest_offloads(n);
     }
 
-    for (i = 0;  i < n->max_queues; i++) {
+    for (i = 0;  i < virtio_net_nc_count(n); i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
         if (!get_vhost_net(nc->peer)) {
@@ -830,7 +867,7 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
 
-    qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+    qemu_flush_queued_packets(virtio_net_queue_nc(n, queue_index));
 }
 
 static int virtio_net_can_receive(NetClientState *nc)
@@ -983,7 +1020,78 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/* Pick the RX queue pair of a packet from the Toeplitz hash of its
+ * addresses and, for unfragmented TCP and UDP, ports. */
+static VirtIONetQueue *virtio_net_rss_select_queue(VirtIONet *n,
+                                                   const uint8_t *buf,
+                                                   size_t size)
+{
+    uint8_t input[2 * sizeof(struct in6_address) + 2 * sizeof(uint16_t)];
+    const uint8_t *l4 = NULL;
+    size_t len, l2_len;
+    uint16_t proto;
+    uint32_t hash;
+    VirtIONetQueue *q;
+
+    if (size < ETH_MAX_L2_HDR_LEN) {
+        return &n->vqs[0];
+    }
+
+    l2_len = eth_get_l2_hdr_length(buf);
+    proto = eth_get_l3_proto(buf, l2_len);
+    buf += l2_len;
+    size -= l2_len;
+
+    if (proto == ETH_P_IP) {
+        const struct ip_header *ip = (const struct ip_header *)buf;
+        size_t ip_len;
+
+        if (size < sizeof(*ip)) {
+            return &n->vqs[0];
+        }
+        ip_len = IP_HDR_GET_LEN(ip);
+        len = 2 * sizeof(uint32_t);
+        memcpy(input, &ip->ip_src, len);
+        if ((ip->ip_p == IP_PROTO_TCP || ip->ip_p == IP_PROTO_UDP) &&
+            !(be16_to_cpu(ip->ip_off) & (IP_MF | IP_OFFMASK)) &&
+            ip_len >= sizeof(*ip) && size >= ip_len + 2 * sizeof(uint16_t)) {
+            l4 = buf + ip_len;
+        }
+    } else if (proto == ETH_P_IPV6) {
+        const struct ip6_header *ip6 = (const struct ip6_header *)buf;
+
+        if (size < sizeof(*ip6)) {
+            return &n->vqs[0];
+        }
+        len = 2 * sizeof(struct in6_address);
+        memcpy(input, &ip6->ip6_src, len);
+        if ((ip6->ip6_nxt == IP_PROTO_TCP || ip6->ip6_nxt == IP_PROTO_UDP) &&
+            size >= sizeof(*ip6) + 2 * sizeof(uint16_t)) {
+            l4 = buf + sizeof(*ip6);
+        }
+    } else {
+        return &n->vqs[0];
+    }
+
+    /* Source and destination port, in network byte order */
+    if (l4) {
+        memcpy(input + len, l4, 2 * sizeof(uint16_t));
+        len += 2 * sizeof(uint16_t);
+    }
+
+    hash = toeplitz_hash(toeplitz_default_key, sizeof(toeplitz_default_key),
+                         input, len);
+    q = &n->vqs[n->rss_indirection_table[hash %
+                                         VIRTIO_NET_RSS_INDIRECTION_TABLE_SIZE]];
+    if (!virtio_queue_ready(q->rx_vq)) {
+        return &n->vqs[0];
+    }
+    return q;
+}
+
+/* The guest is notified by the caller, see virtio_net_rx_notify() */
+static ssize_t virtio_net_do_receive(NetClientState *nc, const uint8_t *buf,
+                                     size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -997,6 +1105,13 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         return -1;
     }
 
+    /* When the chosen queue has no buffers the packet is queued by the net
+     * layer, and held until any queue pair of the device gets refilled. */
+    if (n->rss && n->curr_queues > 1) {
+        q = virtio_net_rss_select_queue(n, buf + n->host_hdr_len,
+                                        size - n->host_hdr_len);
+    }
+
     /* hdr_len refers to the header we supply to the guest */
     if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
         return 0;
@@ -1078,18 +1193,71 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    q->rx_notify = true;
 
     return size;
 }
 
+static void virtio_net_rx_notify(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->rx_notify) {
+            q->rx_notify = false;
+            virtio_notify(vdev, q->rx_vq);
+        }
+    }
+}
+
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    ssize_t ret;
+
+    ret = virtio_net_do_receive(nc, buf, size);
+    virtio_net_rx_notify(qemu_get_nic_opaque(nc));
+
+    return ret;
+}
+
+/* Fill the RX ring with a whole batch and notify the guest once */
+static int virtio_net_receive_iov_batch(NetClientState *nc,
+                                        const NetIOVPacket *pkts, int count)
+{
+    uint8_t buffer[NET_BUFSIZE];
+    const uint8_t *buf;
+    size_t size;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (pkts[i].iovcnt == 1) {
+            buf = pkts[i].iov[0].iov_base;
+            size = pkts[i].iov[0].iov_len;
+        } else {
+            size = iov_to_buf(pkts[i].iov, pkts[i].iovcnt, 0,
+                              buffer, sizeof(buffer));
+            buf = buffer;
+        }
+
+        if (virtio_net_do_receive(nc, buf, size) == 0) {
+            break;
+        }
+    }
+
+    virtio_net_rx_notify(qemu_get_nic_opaque(nc));
+
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
-static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
+static void virtio_net_tx_resume(VirtIONetQueue *q)
 {
-    VirtIONet *n = qemu_get_nic_opaque(nc);
-    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
 
     virtqueue_push(q->tx_vq, &q->async_tx.elem, 0);
     virtio_notify(vdev, q->tx_vq);
@@ -1100,12 +1268,75 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     virtio_net_flush_tx(q);
 }
 
+static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    int i;
+
+    if (!n->rss) {
+        virtio_net_tx_resume(virtio_net_get_subqueue(nc));
+        return;
+    }
+
+    /* All queue pairs share the peer and queued packets have been copied
+     * by the net layer, so every waiting queue can go on. */
+    for (i = 0; i < n->max_queues; i++) {
+        if (n->vqs[i].async_tx.elem.out_num) {
+            virtio_net_tx_resume(&n->vqs[i]);
+        }
+    }
+}
+
 /* TX */
+
+/* Turn a TX element into a packet for the peer, using @sg if the header
+ * has to be trimmed */
+static void virtio_net_tx_prepare(VirtIONet *n, VirtQueueElement *elem,
+                                  struct iovec *sg, NetIOVPacket *pkt)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    unsigned int out_num = elem->out_num;
+    struct iovec *out_sg = &elem->out_sg[0];
+
+    if (out_num < 1) {
+        error_report("virtio-net header not in first element");
+        exit(1);
+    }
+
+    if (n->has_vnet_hdr) {
+        if (out_sg[0].iov_len < n->guest_hdr_len) {
+            error_report("virtio-net header incorrect");
+            exit(1);
+        }
+        virtio_net_hdr_swap(vdev, (void *) out_sg[0].iov_base);
+    }
+
+    /*
+     * If host wants to see the guest header as is, we can
+     * pass it on unchanged. Otherwise, copy just the parts
+     * that host is interested in.
+     */
+    assert(n->host_hdr_len <= n->guest_hdr_len);
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        unsigned sg_num = iov_copy(sg, VIRTQUEUE_MAX_SIZE,
+                                   out_sg, out_num,
+                                   0, n->host_hdr_len);
+        sg_num += iov_copy(sg + sg_num, VIRTQUEUE_MAX_SIZE - sg_num,
+                         out_sg, out_num,
+                         n->guest_hdr_len, -1);
+        out_num = sg_num;
+        out_sg = sg;
+    }
+
+    pkt->iov = out_sg;
+    pkt->iovcnt = out_num;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement elem;
+    VirtIONetTxBatch *b;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -1119,60 +1350,51 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
-    while (virtqueue_pop(q->tx_vq, &elem)) {
-        ssize_t ret, len;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
-        struct iovec sg[VIRTQUEUE_MAX_SIZE];
+    if (!q->tx_batch) {
+        q->tx_batch = g_new(VirtIONetTxBatch, 1);
+    }
+    b = q->tx_batch;
 
-        if (out_num < 1) {
-            error_report("virtio-net header not in first element");
-            exit(1);
-        }
+    while (num_packets < n->tx_burst) {
+        int max = MIN(VIRTIO_NET_TX_BATCH, n->tx_burst - num_packets);
+        int count = 0;
+        int sent, i;
 
-        if (n->has_vnet_hdr) {
-            if (out_sg[0].iov_len < n->guest_hdr_len) {
-                error_report("virtio-net header incorrect");
-                exit(1);
-            }
-            virtio_net_hdr_swap(vdev, (void *) out_sg[0].iov_base);
+        while (count < max && virtqueue_pop(q->tx_vq, &b->elems[count])) {
+            virtio_net_tx_prepare(n, &b->elems[count], b->sg[count],
+                                  &b->pkts[count]);
+            count++;
         }
-
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
+        if (!count) {
+            break;
         }
 
-        len = n->guest_hdr_len;
+        sent = qemu_sendv_packets_async(virtio_net_queue_nc(n, queue_index),
+                                        b->pkts, count,
+                                        virtio_net_tx_complete);
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            q->async_tx.len  = len;
-            return -EBUSY;
+        for (i = 0; i < sent; i++) {
+            virtqueue_fill(q->tx_vq, &b->elems[i], 0, i);
+        }
+        if (sent) {
+            virtqueue_flush(q->tx_vq, sent);
+            virtio_notify(vdev, q->tx_vq);
+            num_packets += sent;
         }
 
-        len += ret;
-
-        virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-
-        if (++num_packets >= n->tx_burst) {
-            break;
+        if (sent < count) {
+            /* The peer queued one more packet and will call us back when it
+             * is gone; put the ones it did not look at back in the ring. */
+            for (i = count - 1; i > sent; i--) {
+                if (n->has_vnet_hdr) {
+                    virtio_net_hdr_swap(vdev, b->elems[i].out_sg[0].iov_base);
+                }
+                virtqueue_discard(q->tx_vq, &b->elems[i]);
+            }
+            virtio_queue_set_notification(q->tx_vq, 0);
+            q->async_tx.elem = b->elems[sent];
+            q->async_tx.len = n->guest_hdr_len;
+            return -EBUSY;
         }
     }
     return num_packets;
@@ -1487,7 +1709,7 @@ static int virtio_net_load_device(VirtIODevice *vdev, QEMUFile *f,
     /* nc.link_down can't be migrated, so infer link_down according
      * to link status bit in n->status */
     link_down = (n->status & VIRTIO_NET_S_LINK_UP) == 0;
-    for (i = 0; i < n->max_queues; i++) {
+    for (i = 0; i < virtio_net_nc_count(n); i++) {
         qemu_get_subqueue(n->nic, i)->link_down = link_down;
     }
 
@@ -1512,6 +1734,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_iov_batch = virtio_net_receive_iov_batch,
     .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
@@ -1568,9 +1791,30 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     NetClientState *nc;
     int i;
 
+    if (n->net_conf.rss_queues > 1) {
+        nc = n->nic_conf.peers.ncs[0];
+        if (n->nic_conf.peers.queues > 1) {
+            error_setg(errp, "virtio-net: 'rss-queues' needs a single queue "
+                       "peer");
+            return;
+        }
+        if (nc && get_vhost_net(nc)) {
+            error_setg(errp, "virtio-net: 'rss-queues' is not supported "
+                       "with vhost");
+            return;
+        }
+        if (n->net_conf.rss_queues * 2 + 1 > VIRTIO_PCI_QUEUE_MAX) {
+            error_setg(errp, "virtio-net: 'rss-queues' must be at most %d",
+                       (VIRTIO_PCI_QUEUE_MAX - 1) / 2);
+            return;
+        }
+        n->rss = true;
+    }
+
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
-    n->max_queues = MAX(n->nic_conf.peers.queues, 1);
+    n->max_queues = n->rss ? n->net_conf.rss_queues :
+                    MAX(n->nic_conf.peers.queues, 1);
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->vqs[0].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
     n->curr_queues = 1;
@@ -1615,7 +1859,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     peer_test_vnet_hdr(n);
     if (peer_has_vnet_hdr(n)) {
-        for (i = 0; i < n->max_queues; i++) {
+        for (i = 0; i < virtio_net_nc_count(n); i++) {
             qemu_using_vnet_hdr(qemu_get_subqueue(n->nic, i)->peer, true);
         }
         n->host_hdr_len = sizeof(struct virtio_net_hdr);
@@ -1663,12 +1907,14 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     g_free(n->mac_table.macs);
     g_free(n->vlans);
 
+    for (i = 0; i < virtio_net_nc_count(n); i++) {
+        qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+    }
+
     for (i = 0; i < n->max_queues; i++) {
         VirtIONetQueue *q = &n->vqs[i];
-        NetClientState *nc = qemu_get_subqueue(n->nic, i);
-
-        qemu_purge_queued_packets(nc);
 
+        g_free(q->tx_batch);
         if (q->tx_timer) {
             timer_del(q->tx_timer);
             timer_free(q->tx_timer);
@@ -1701,6 +1947,7 @@ static Property virtio_net_properties[] = {
                                                TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_UINT16("rss-queues", VirtIONet, net_conf.rss_queues, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -21,6 +21,7 @@
 #include "qemu-common.h"
 #include "qemu/iov.h"
 #include "net/checksum.h"
+#include "net/gso.h"
 #include "net/tap.h"
 #include "net/net.h"
 
@@ -535,14 +536,33 @@ static bool vmxnet_tx_pkt_do_sw_fragmentation(struct VmxnetTxPkt *pkt,
     return true;
 }
 
+static void vmxnet_tx_pkt_send_segment(void *opaque, const struct iovec *iov,
+                                       int iovcnt, int segs)
+{
+    qemu_sendv_packet(opaque, iov, iovcnt);
+}
+
+static bool vmxnet_tx_pkt_do_sw_segmentation(struct VmxnetTxPkt *pkt,
+    NetClientState *nc)
+{
+    NetGso gso;
+
+    gso.type = pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    gso.l3_off = pkt->vec[VMXNET_TX_PKT_L2HDR_FRAG].iov_len;
+    gso.l4_off = pkt->hdr_len;
+    gso.hdr_len = pkt->virt_hdr.hdr_len;
+    gso.mss = pkt->virt_hdr.gso_size;
+
+    return net_gso_send(&pkt->vec[VMXNET_TX_PKT_L2HDR_FRAG],
+                        pkt->payload_frags + VMXNET_TX_PKT_PL_START_FRAG - 1,
+                        &gso, false, vmxnet_tx_pkt_send_segment, nc) >= 0;
+}
+
 bool vmxnet_tx_pkt_send(struct VmxnetTxPkt *pkt, NetClientState *nc)
 {
-    assert(pkt);
+    uint8_t gso_type;
 
-    if (!pkt->has_virt_hdr &&
-        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
-        vmxnet_tx_pkt_do_sw_csum(pkt);
-    }
+    assert(pkt);
 
     /*
      * Since underlying infrastructure does not support IP datagrams longer
@@ -556,6 +576,18 @@ bool vmxnet_tx_pkt_send(struct VmxnetTxPkt *pkt, NetClientState *nc)
         }
     }
 
+    /* TCP segments get their own headers and checksums */
+    gso_type = pkt->virt_hdr.gso_type & ~VIRTIO_NET_HDR_GSO_ECN;
+    if (!pkt->has_virt_hdr && (gso_type == VIRTIO_NET_HDR_GSO_TCPV4 ||
+                               gso_type == VIRTIO_NET_HDR_GSO_TCPV6)) {
+        return vmxnet_tx_pkt_do_sw_segmentation(pkt, nc);
+    }
+
+    if (!pkt->has_virt_hdr &&
+        pkt->virt_hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+        vmxnet_tx_pkt_do_sw_csum(pkt);
+    }
+
     if (pkt->has_virt_hdr ||
         pkt->virt_hdr.gso_type == VIRTIO_NET_HDR_GSO_NONE) {
         qemu_sendv_packet(nc, pkt->vec,
@@ -0,0 +1,334 @@
+/*
+ * Virtio SCSI dataplane
+ *
+ * Runs the virtqueues of a virtio-scsi HBA in an IOThread.  The rings are
+ * accessed through the Vring helpers, and the block devices of all LUNs are
+ * moved to the IOThread's AioContext so that scsi-disk requests are issued
+ * and completed there without taking the global mutex.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "qemu/error-report.h"
+#include "hw/virtio/virtio-scsi.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "hw/virtio/virtio-bus.h"
+#include "hw/scsi/scsi.h"
+#include "block/scsi.h"
+#include "block/aio.h"
+#include "migration/migration.h"
+
+typedef struct VirtIOSCSIVring {
+    VirtIOSCSI *parent;
+    Vring vring;                    /* virtqueue vring */
+    EventNotifier *guest_notifier;  /* irq */
+
+    /* Assigned by value, do not call event_notifier_cleanup on it */
+    EventNotifier host_notifier;    /* doorbell */
+} VirtIOSCSIVring;
+
+VirtIOSCSIReq *virtio_scsi_pop_req_vring(VirtIOSCSI *s, int n)
+{
+    VirtIODevice *vdev = (VirtIODevice *)s;
+    VirtIOSCSIReq *req = virtio_scsi_init_req(s, virtio_get_queue(vdev, n));
+
+    if (vring_pop(vdev, &s->vrings[n].vring, &req->elem) < 0) {
+        virtio_scsi_free_req(req);
+        return NULL;
+    }
+    return req;
+}
+
+void virtio_scsi_vring_push_notify(VirtIOSCSIReq *req)
+{
+    VirtIODevice *vdev = (VirtIODevice *)req->dev;
+    VirtIOSCSIVring *r = &req->dev->vrings[virtio_get_queue_index(req->vq)];
+
+    vring_push(&r->vring, &req->elem, req->qsgl.size + req->resp_iov.size);
+    if (vring_should_notify(vdev, &r->vring)) {
+        event_notifier_set(r->guest_notifier);
+    }
+}
+
+static void virtio_scsi_iothread_handle_ctrl(EventNotifier *notifier)
+{
+    VirtIOSCSIVring *r = container_of(notifier, VirtIOSCSIVring,
+                                      host_notifier);
+    VirtIOSCSI *s = r->parent;
+    VirtIOSCSIReq *req;
+
+    event_notifier_test_and_clear(notifier);
+    while ((req = virtio_scsi_pop_req_vring(s, r - s->vrings))) {
+        virtio_scsi_handle_ctrl_req(s, req);
+    }
+}
+
+static void virtio_scsi_iothread_handle_event(EventNotifier *notifier)
+{
+    VirtIOSCSIVring *r = container_of(notifier, VirtIOSCSIVring,
+                                      host_notifier);
+    VirtIOSCSI *s = r->parent;
+
+    event_notifier_test_and_clear(notifier);
+    if (s->events_dropped) {
+        virtio_scsi_push_event(s, NULL, VIRTIO_SCSI_T_NO_EVENT, 0);
+    }
+}
+
+static void virtio_scsi_iothread_handle_cmd(EventNotifier *notifier)
+{
+    VirtIOSCSIVring *r = container_of(notifier, VirtIOSCSIVring,
+                                      host_notifier);
+    VirtIOSCSI *s = r->parent;
+    VirtIOSCSIReq *req, *next;
+    QTAILQ_HEAD(, VirtIOSCSIReq) reqs = QTAILQ_HEAD_INITIALIZER(reqs);
+
+    event_notifier_test_and_clear(notifier);
+    while ((req = virtio_scsi_pop_req_vring(s, r - s->vrings))) {
+        if (virtio_scsi_handle_cmd_req_prepare(s, req)) {
+            QTAILQ_INSERT_TAIL(&reqs, req, next);
+        }
+    }
+
+    QTAILQ_FOREACH_SAFE(req, &reqs, next, next) {
+        virtio_scsi_handle_cmd_req_submit(s, req);
+    }
+}
+
+/* Context: QEMU global mutex held */
+bool virtio_scsi_dataplane_attach(VirtIOSCSI *s, SCSIDevice *d)
+{
+    Error *local_err = NULL;
+
+    if (!d->conf.bs) {
+        return true;
+    }
+    if (bdrv_op_is_blocked(d->conf.bs, BLOCK_OP_TYPE_DATAPLANE, &local_err)) {
+        error_report("cannot start virtio-scsi dataplane: %s",
+                     error_get_pretty(local_err));
+        error_free(local_err);
+        return false;
+    }
+
+    bdrv_op_block_all(d->conf.bs, s->blocker);
+    bdrv_set_aio_context(d->conf.bs, s->ctx);
+    return true;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_detach(VirtIOSCSI *s, SCSIDevice *d)
+{
+    if (!d->conf.bs || bdrv_get_aio_context(d->conf.bs) != s->ctx) {
+        return;
+    }
+
+    /* Drain and switch bs back to the QEMU main loop */
+    aio_context_acquire(s->ctx);
+    bdrv_set_aio_context(d->conf.bs, qemu_get_aio_context());
+    aio_context_release(s->ctx);
+
+    bdrv_op_unblock_all(d->conf.bs, s->blocker);
+}
+
+static void virtio_scsi_dataplane_detach_all(VirtIOSCSI *s)
+{
+    BusChild *kid;
+
+    QTAILQ_FOREACH(kid, &s->bus.qbus.children, sibling) {
+        virtio_scsi_dataplane_detach(s, SCSI_DEVICE(kid->child));
+    }
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_start(VirtIOSCSI *s)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = vs->conf.num_queues + 2;
+    VirtIOSCSIVring *r;
+    VirtQueue *vq;
+    BusChild *kid;
+    int i;
+
+    if (s->dataplane_started || s->dataplane_starting ||
+        s->dataplane_fenced || s->dataplane_disabled) {
+        return;
+    }
+
+    s->dataplane_starting = true;
+
+    QTAILQ_FOREACH(kid, &s->bus.qbus.children, sibling) {
+        if (!virtio_scsi_dataplane_attach(s, SCSI_DEVICE(kid->child))) {
+            goto fail_attach;
+        }
+    }
+
+    for (i = 0; i < nvqs; i++) {
+        if (!vring_setup(&s->vrings[i].vring, vdev, i)) {
+            error_report("virtio-scsi: vring setup failed");
+            goto fail_vrings;
+        }
+    }
+
+    /* Set up guest notifiers (irq) */
+    if (k->set_guest_notifiers(qbus->parent, nvqs, true) != 0) {
+        error_report("virtio-scsi: failed to set guest notifiers, "
+                     "ensure -enable-kvm is set");
+        goto fail_vrings;
+    }
+
+    /* Set up virtqueue notify */
+    for (i = 0; i < nvqs; i++) {
+        r = &s->vrings[i];
+        vq = virtio_get_queue(vdev, i);
+        if (k->set_host_notifier(qbus->parent, i, true) != 0) {
+            fprintf(stderr, "virtio-scsi failed to set host notifier\n");
+            exit(1);
+        }
+        r->host_notifier = *virtio_queue_get_host_notifier(vq);
+        r->guest_notifier = virtio_queue_get_guest_notifier(vq);
+    }
+
+    s->dataplane_starting = false;
+    s->dataplane_started = true;
+    trace_virtio_scsi_dataplane_start(s);
+
+    /* Get this show started by hooking up our callbacks */
+    aio_context_acquire(s->ctx);
+    aio_set_event_notifier(s->ctx, &s->vrings[0].host_notifier,
+                           virtio_scsi_iothread_handle_ctrl);
+    aio_set_event_notifier(s->ctx, &s->vrings[1].host_notifier,
+                           virtio_scsi_iothread_handle_event);
+    for (i = 2; i < nvqs; i++) {
+        aio_set_event_notifier(s->ctx, &s->vrings[i].host_notifier,
+                               virtio_scsi_iothread_handle_cmd);
+    }
+    aio_context_release(s->ctx);
+
+    /* Kick right away to begin processing requests already in the vrings */
+    for (i = 0; i < nvqs; i++) {
+        event_notifier_set(virtio_queue_get_host_notifier(
+                               virtio_get_queue(vdev, i)));
+    }
+    return;
+
+fail_vrings:
+    while (--i >= 0) {
+        vring_teardown(&s->vrings[i].vring, vdev, i);
+    }
+fail_attach:
+    virtio_scsi_dataplane_detach_all(s);
+    /* Do not retry on every kick, serve the queues from the main loop */
+    s->dataplane_fenced = true;
+    s->dataplane_starting = false;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_stop(VirtIOSCSI *s)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = vs->conf.num_queues + 2;
+    int i;
+
+    if (!s->dataplane_started || s->dataplane_stopping) {
+        return;
+    }
+    s->dataplane_stopping = true;
+    trace_virtio_scsi_dataplane_stop(s);
+
+    /* Stop notifications for new requests from guest */
+    aio_context_acquire(s->ctx);
+    for (i = 0; i < nvqs; i++) {
+        aio_set_event_notifier(s->ctx, &s->vrings[i].host_notifier, NULL);
+    }
+    aio_context_release(s->ctx);
+
+    /* Complete in-flight requests and move the LUNs back to the main loop */
+    virtio_scsi_dataplane_detach_all(s);
+
+    /* Sync vring state back to virtqueue so that non-dataplane request
+     * processing can continue when we disable the host notifiers below.
+     */
+    for (i = 0; i < nvqs; i++) {
+        vring_teardown(&s->vrings[i].vring, vdev, i);
+        k->set_host_notifier(qbus->parent, i, false);
+    }
+
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+
+    s->dataplane_started = false;
+    s->dataplane_stopping = false;
+}
+
+/* Disable dataplane thread during live migration since it does not
+ * update the dirty memory bitmap yet.
+ */
+static void virtio_scsi_migration_state_changed(Notifier *notifier, void *data)
+{
+    VirtIOSCSI *s = container_of(notifier, VirtIOSCSI,
+                                 migration_state_notifier);
+    MigrationState *mig = data;
+
+    if (migration_in_setup(mig)) {
+        virtio_scsi_dataplane_stop(s);
+        s->dataplane_disabled = true;
+    } else if (migration_has_finished(mig) ||
+               migration_has_failed(mig)) {
+        /* The next guest kick restarts the dataplane */
+        s->dataplane_disabled = false;
+    }
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_init(VirtIOSCSI *s, Error **errp)
+{
+    VirtIOSCSICommon *vs = VIRTIO_SCSI_COMMON(s);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int i;
+
+    if (!vs->conf.iothread) {
+        return;
+    }
+
+    /* Don't try if transport does not support notifiers. */
+    if (!k->set_guest_notifiers || !k->set_host_notifier) {
+        error_setg(errp, "device is incompatible with iothread "
+                   "(transport does not support notifiers)");
+        return;
+    }
+
+    s->ctx = iothread_get_aio_context(vs->conf.iothread);
+    s->vrings = g_new0(VirtIOSCSIVring, vs->conf.num_queues + 2);
+    for (i = 0; i < vs->conf.num_queues + 2; i++) {
+        s->vrings[i].parent = s;
+    }
+
+    error_setg(&s->blocker, "block device is in use by data plane");
+    s->migration_state_notifier.notify = virtio_scsi_migration_state_changed;
+    add_migration_state_change_notifier(&s->migration_state_notifier);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_scsi_dataplane_cleanup(VirtIOSCSI *s)
+{
+    if (!s->ctx) {
+        return;
+    }
+
+    virtio_scsi_dataplane_stop(s);
+    remove_migration_state_change_notifier(&s->migration_state_notifier);
+    error_free(s->blocker);
+    g_free(s->vrings);
+    s->vrings = NULL;
+    s->ctx = NULL;
+}
@@ -24,6 +24,10 @@
 #include <linux/vhost.h>
 
 #define VHOST_MEMORY_MAX_NREGIONS    8
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+
+#define VHOST_USER_PROTOCOL_F_MQ    0
+#define VHOST_USER_PROTOCOL_FEATURE_MASK (1ULL << VHOST_USER_PROTOCOL_F_MQ)
 
 typedef enum VhostUserRequest {
     VHOST_USER_NONE = 0,
@@ -41,6 +45,10 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_VRING_KICK = 12,
     VHOST_USER_SET_VRING_CALL = 13,
     VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -104,7 +112,11 @@ static unsigned long int ioctl_to_vhost_user_request[VHOST_USER_MAX] = {
     VHOST_GET_VRING_BASE,   /* VHOST_USER_GET_VRING_BASE */
     VHOST_SET_VRING_KICK,   /* VHOST_USER_SET_VRING_KICK */
     VHOST_SET_VRING_CALL,   /* VHOST_USER_SET_VRING_CALL */
-    VHOST_SET_VRING_ERR     /* VHOST_USER_SET_VRING_ERR */
+    VHOST_SET_VRING_ERR,    /* VHOST_USER_SET_VRING_ERR */
+    -1,                     /* VHOST_USER_GET_PROTOCOL_FEATURES */
+    -1,                     /* VHOST_USER_SET_PROTOCOL_FEATURES */
+    -1,                     /* VHOST_USER_GET_QUEUE_NUM */
+    -1                      /* VHOST_USER_SET_VRING_ENABLE */
 };
 
 static VhostUserRequest vhost_user_request_translate(unsigned long int request)
@@ -120,12 +132,33 @@ static VhostUserRequest vhost_user_request_translate(unsigned long int request)
     return (idx == VHOST_USER_MAX) ? VHOST_USER_NONE : idx;
 }
 
+/* With multiqueue, every queue pair has its own vhost_dev on the same
+ * connection; requests about the whole device are only sent by the first.
+ */
+static bool vhost_user_one_time_request(VhostUserRequest request)
+{
+    switch (request) {
+    case VHOST_USER_SET_OWNER:
+    case VHOST_USER_RESET_OWNER:
+    case VHOST_USER_SET_MEM_TABLE:
+    case VHOST_USER_GET_QUEUE_NUM:
+        return true;
+    default:
+        return false;
+    }
+}
+
 static int vhost_user_read(struct vhost_dev *dev, VhostUserMsg *msg)
 {
     CharDriverState *chr = dev->opaque;
     uint8_t *p = (uint8_t *) msg;
     int r, size = VHOST_USER_HDR_SIZE;
 
+    if (!chr) {
+        /* The connection this device was set up on is gone */
+        return -1;
+    }
+
     r = qemu_chr_fe_read_all(chr, p, size);
     if (r != size) {
         error_report("Failed to read msg header. Read %d instead of %d.\n", r,
@@ -172,6 +205,10 @@ static int vhost_user_write(struct vhost_dev *dev, VhostUserMsg *msg,
     CharDriverState *chr = dev->opaque;
     int size = VHOST_USER_HDR_SIZE + msg->size;
 
+    if (!chr) {
+        return -1;
+    }
+
     if (fd_num) {
         qemu_chr_fe_set_msgfds(chr, fds, fd_num);
     }
@@ -194,6 +231,10 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
     msg_request = vhost_user_request_translate(request);
+    if (vhost_user_one_time_request(msg_request) && dev->vq_index != 0) {
+        return 0;
+    }
+
     msg.request = msg_request;
     msg.flags = VHOST_USER_VERSION;
     msg.size = 0;
@@ -204,6 +245,12 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
         break;
 
     case VHOST_SET_FEATURES:
+        msg.u64 = *((__u64 *) arg);
+        msg.u64 |= dev->backend_features &
+                   (1ULL << VHOST_USER_F_PROTOCOL_FEATURES);
+        msg.size = sizeof(m.u64);
+        break;
+
     case VHOST_SET_LOG_BASE:
         msg.u64 = *((__u64 *) arg);
         msg.size = sizeof(m.u64);
@@ -285,13 +332,16 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
         break;
     }
 
+    /* A backend that went away is noticed through CHR_EVENT_CLOSED; until
+     * then only requests that need an answer fail.
+     */
     if (vhost_user_write(dev, &msg, fds, fd_num) < 0) {
-        return 0;
+        return need_reply ? -1 : 0;
     }
 
     if (need_reply) {
         if (vhost_user_read(dev, &msg) < 0) {
-            return 0;
+            return -1;
         }
 
         if (msg_request != msg.request) {
@@ -325,11 +375,118 @@ static int vhost_user_call(struct vhost_dev *dev, unsigned long int request,
     return 0;
 }
 
+static int vhost_user_get_u64(struct vhost_dev *dev, VhostUserRequest request,
+                              uint64_t *u64)
+{
+    VhostUserMsg msg = {
+        .request = request,
+        .flags = VHOST_USER_VERSION,
+    };
+
+    if (vhost_user_one_time_request(request) && dev->vq_index != 0) {
+        return 0;
+    }
+
+    if (vhost_user_write(dev, &msg, NULL, 0) < 0 ||
+        vhost_user_read(dev, &msg) < 0) {
+        return -1;
+    }
+
+    if (msg.request != request) {
+        error_report("Received unexpected msg type."
+                     " Expected %d received %d\n", request, msg.request);
+        return -1;
+    }
+
+    if (msg.size != sizeof(m.u64)) {
+        error_report("Received bad msg size.\n");
+        return -1;
+    }
+
+    *u64 = msg.u64;
+    return 0;
+}
+
+static int vhost_user_set_u64(struct vhost_dev *dev, VhostUserRequest request,
+                              uint64_t u64)
+{
+    VhostUserMsg msg = {
+        .request = request,
+        .flags = VHOST_USER_VERSION,
+        .u64 = u64,
+        .size = sizeof(m.u64),
+    };
+
+    return vhost_user_write(dev, &msg, NULL, 0);
+}
+
+static int vhost_user_set_vring_enable(struct vhost_dev *dev, int enable)
+{
+    VhostUserMsg msg = {
+        .request = VHOST_USER_SET_VRING_ENABLE,
+        .flags = VHOST_USER_VERSION,
+        .size = sizeof(m.state),
+    };
+    int i;
+
+    assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
+
+    /* Without protocol features the rings are enabled once started */
+    if (!(dev->backend_features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES))) {
+        return 0;
+    }
+
+    for (i = 0; i < dev->nvqs; i++) {
+        msg.state.index = dev->vq_index + i;
+        msg.state.num = enable;
+        if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static int vhost_user_init(struct vhost_dev *dev, void *opaque)
 {
+    uint64_t features;
+    int err;
+
     assert(dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER);
 
     dev->opaque = opaque;
+    dev->protocol_features = 0;
+    dev->max_queues = 1;
+
+    err = vhost_user_get_u64(dev, VHOST_USER_GET_FEATURES, &features);
+    if (err < 0) {
+        return err;
+    }
+
+    if (features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) {
+        dev->backend_features |= 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+
+        err = vhost_user_get_u64(dev, VHOST_USER_GET_PROTOCOL_FEATURES,
+                                 &features);
+        if (err < 0) {
+            return err;
+        }
+
+        dev->protocol_features = features & VHOST_USER_PROTOCOL_FEATURE_MASK;
+        err = vhost_user_set_u64(dev, VHOST_USER_SET_PROTOCOL_FEATURES,
+                                 dev->protocol_features);
+        if (err < 0) {
+            return err;
+        }
+
+        if (dev->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_MQ)) {
+            err = vhost_user_get_u64(dev, VHOST_USER_GET_QUEUE_NUM,
+                                     &dev->max_queues);
+            if (err < 0) {
+                return err;
+            }
+        }
+    }
 
     return 0;
 }
@@ -343,9 +500,19 @@ static int vhost_user_cleanup(struct vhost_dev *dev)
     return 0;
 }
 
+/* All queue pairs share one connection, so indices are device-wide */
+static int vhost_user_get_vq_index(struct vhost_dev *dev, int idx)
+{
+    assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
+
+    return idx;
+}
+
 const VhostOps user_ops = {
         .backend_type = VHOST_BACKEND_TYPE_USER,
         .vhost_call = vhost_user_call,
         .vhost_backend_init = vhost_user_init,
-        .vhost_backend_cleanup = vhost_user_cleanup
+        .vhost_backend_cleanup = vhost_user_cleanup,
+        .vhost_backend_get_vq_index = vhost_user_get_vq_index,
+        .vhost_backend_set_vring_enable = vhost_user_set_vring_enable,
         };
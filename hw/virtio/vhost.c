@@ -17,11 +17,16 @@
 #include "hw/hw.h"
 #include "qemu/atomic.h"
 #include "qemu/range.h"
+#include "qemu/thread.h"
 #include <linux/vhost.h>
 #include "exec/address-spaces.h"
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 
+/* All initialized devices, for the memory table pass in vhost_mem_commit() */
+static QLIST_HEAD(, vhost_dev) vhost_devices =
+    QLIST_HEAD_INITIALIZER(vhost_devices);
+
 static void vhost_dev_sync_region(struct vhost_dev *dev,
                                   MemoryRegionSection *section,
                                   uint64_t mfirst, uint64_t mlast,
@@ -415,6 +420,7 @@ static void vhost_set_memory(MemoryListener *listener,
     dev->mem_changed_start_addr = MIN(dev->mem_changed_start_addr, start_addr);
     dev->mem_changed_end_addr = MAX(dev->mem_changed_end_addr, start_addr + size - 1);
     dev->memory_changed = true;
+    dev->preloaded = false;
 }
 
 static bool vhost_section(MemoryRegionSection *section)
@@ -436,7 +442,6 @@ static void vhost_commit(MemoryListener *listener)
                                          memory_listener);
     hwaddr start_addr = 0;
     ram_addr_t size = 0;
-    uint64_t log_size;
     int r;
 
     if (!dev->memory_changed) {
@@ -457,29 +462,237 @@ static void vhost_commit(MemoryListener *listener)
         assert(r >= 0);
     }
 
-    if (!dev->log_enabled) {
-        r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
-        assert(r >= 0);
-        dev->memory_changed = false;
+    /* The table is sent by vhost_mem_commit(), for all devices at once */
+    dev->mem_table_pending = true;
+}
+
+/* Most threads a memory table pass uses besides the caller */
+#define VHOST_MEM_THREADS_MAX   15
+
+typedef struct VhostMemTableJob {
+    struct vhost_dev *dev;
+    int ret;
+} VhostMemTableJob;
+
+/*
+ * Threads that make the VHOST_SET_MEM_TABLE calls of one pass overlap.
+ * They are started the first time a pass has several kernel devices to
+ * serve, kept for later passes, and stopped with the last vhost device.
+ */
+static struct {
+    QemuMutex lock;
+    QemuCond work_cond;         /* jobs were posted, or quit was set */
+    QemuCond done_cond;         /* the last job of the pass finished */
+    QemuThread threads[VHOST_MEM_THREADS_MAX];
+    int nr_threads;
+    VhostMemTableJob *jobs;
+    int next_job;
+    int nr_jobs;
+    int pending;
+    bool quit;
+} vhost_mem_pool;
+
+static void vhost_set_mem_table_job(VhostMemTableJob *job)
+{
+    struct vhost_dev *dev = job->dev;
+
+    job->ret = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
+    if (job->ret < 0) {
+        job->ret = -errno;
+    }
+}
+
+/* Run jobs of the current pass until none is left; called with the lock */
+static void vhost_mem_pool_run(void)
+{
+    VhostMemTableJob *job;
+
+    while (vhost_mem_pool.next_job < vhost_mem_pool.nr_jobs) {
+        job = &vhost_mem_pool.jobs[vhost_mem_pool.next_job++];
+        qemu_mutex_unlock(&vhost_mem_pool.lock);
+        vhost_set_mem_table_job(job);
+        qemu_mutex_lock(&vhost_mem_pool.lock);
+        if (--vhost_mem_pool.pending == 0) {
+            qemu_cond_signal(&vhost_mem_pool.done_cond);
+        }
+    }
+}
+
+static void *vhost_mem_pool_thread(void *opaque)
+{
+    qemu_mutex_lock(&vhost_mem_pool.lock);
+    while (!vhost_mem_pool.quit) {
+        vhost_mem_pool_run();
+        qemu_cond_wait(&vhost_mem_pool.work_cond, &vhost_mem_pool.lock);
+    }
+    qemu_mutex_unlock(&vhost_mem_pool.lock);
+    return NULL;
+}
+
+static void vhost_mem_pool_grow(int nr_threads)
+{
+    nr_threads = MIN(nr_threads, VHOST_MEM_THREADS_MAX);
+    if (!vhost_mem_pool.nr_threads && nr_threads) {
+        qemu_mutex_init(&vhost_mem_pool.lock);
+        qemu_cond_init(&vhost_mem_pool.work_cond);
+        qemu_cond_init(&vhost_mem_pool.done_cond);
+        vhost_mem_pool.quit = false;
+    }
+    while (vhost_mem_pool.nr_threads < nr_threads) {
+        qemu_thread_create(&vhost_mem_pool.threads[vhost_mem_pool.nr_threads++],
+                           "vhost-mem", vhost_mem_pool_thread, NULL,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void vhost_mem_pool_stop(void)
+{
+    int i;
+
+    if (!vhost_mem_pool.nr_threads) {
         return;
     }
-    log_size = vhost_get_log_size(dev);
-    /* We allocate an extra 4K bytes to log,
-     * to reduce the * number of reallocations. */
-#define VHOST_LOG_BUFFER (0x1000 / sizeof *dev->log)
-    /* To log more, must increase log size before table update. */
-    if (dev->log_size < log_size) {
-        vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
+    qemu_mutex_lock(&vhost_mem_pool.lock);
+    vhost_mem_pool.quit = true;
+    qemu_cond_broadcast(&vhost_mem_pool.work_cond);
+    qemu_mutex_unlock(&vhost_mem_pool.lock);
+    for (i = 0; i < vhost_mem_pool.nr_threads; i++) {
+        qemu_thread_join(&vhost_mem_pool.threads[i]);
+    }
+    vhost_mem_pool.nr_threads = 0;
+    qemu_cond_destroy(&vhost_mem_pool.done_cond);
+    qemu_cond_destroy(&vhost_mem_pool.work_cond);
+    qemu_mutex_destroy(&vhost_mem_pool.lock);
+}
+
+/* Run @n jobs on the pool and in the caller, return once all are done */
+static void vhost_mem_pool_submit(VhostMemTableJob *jobs, int n)
+{
+    vhost_mem_pool_grow(n - 1);
+
+    qemu_mutex_lock(&vhost_mem_pool.lock);
+    vhost_mem_pool.jobs = jobs;
+    vhost_mem_pool.next_job = 0;
+    vhost_mem_pool.nr_jobs = n;
+    vhost_mem_pool.pending = n;
+    qemu_cond_broadcast(&vhost_mem_pool.work_cond);
+    vhost_mem_pool_run();
+    while (vhost_mem_pool.pending) {
+        qemu_cond_wait(&vhost_mem_pool.done_cond, &vhost_mem_pool.lock);
+    }
+    vhost_mem_pool.jobs = NULL;
+    vhost_mem_pool.next_job = vhost_mem_pool.nr_jobs = 0;
+    qemu_mutex_unlock(&vhost_mem_pool.lock);
+}
+
+/*
+ * Send each device its memory table.  With the kernel backend every
+ * VHOST_SET_MEM_TABLE waits for an RCU grace period, which adds up for a
+ * multiqueue NIC with one vhost device per queue pair; when there are
+ * several kernel devices their calls are spread over vhost_mem_pool so
+ * that they overlap.  Other backends share one channel between their
+ * devices and are served in order, in the caller.
+ *
+ * The caller must hold the iothread lock, the devices' tables are only
+ * read while it waits.  Returns 0 or the first error.
+ */
+int vhost_dev_set_mem_tables(struct vhost_dev **devs, int n)
+{
+    VhostMemTableJob *jobs = g_new0(VhostMemTableJob, n);
+    int i, j, nr_kernel = 0, r = 0;
+
+    for (i = 0; i < n; i++) {
+        if (devs[i]->vhost_ops->backend_type == VHOST_BACKEND_TYPE_KERNEL) {
+            jobs[nr_kernel++].dev = devs[i];
+        }
+    }
+    for (i = 0, j = nr_kernel; i < n; i++) {
+        if (devs[i]->vhost_ops->backend_type != VHOST_BACKEND_TYPE_KERNEL) {
+            jobs[j++].dev = devs[i];
+        }
+    }
+
+    if (nr_kernel > 1) {
+        vhost_mem_pool_submit(jobs, nr_kernel);
+    } else if (nr_kernel) {
+        vhost_set_mem_table_job(&jobs[0]);
+    }
+    for (i = nr_kernel; i < n; i++) {
+        vhost_set_mem_table_job(&jobs[i]);
     }
-    r = dev->vhost_ops->vhost_call(dev, VHOST_SET_MEM_TABLE, dev->mem);
+
+    for (i = 0; i < n; i++) {
+        if (jobs[i].ret < 0) {
+            r = jobs[i].ret;
+            break;
+        }
+    }
+    g_free(jobs);
+    return r;
+}
+
+/* We allocate an extra 4K bytes to log,
+ * to reduce the * number of reallocations. */
+#define VHOST_LOG_BUFFER (0x1000 / sizeof(vhost_log_chunk_t))
+
+/*
+ * Runs after the commit callbacks of all devices (it has a higher
+ * priority) and sends the new tables in one pass.
+ */
+static void vhost_mem_commit(MemoryListener *listener)
+{
+    struct vhost_dev *dev, **devs;
+    uint64_t log_size;
+    int n = 0, r;
+
+    QLIST_FOREACH(dev, &vhost_devices, entry) {
+        if (dev->mem_table_pending) {
+            n++;
+        }
+    }
+    if (!n) {
+        return;
+    }
+
+    devs = g_new(struct vhost_dev *, n);
+    n = 0;
+    QLIST_FOREACH(dev, &vhost_devices, entry) {
+        if (!dev->mem_table_pending) {
+            continue;
+        }
+        if (dev->log_enabled) {
+            log_size = vhost_get_log_size(dev);
+            /* To log more, must increase log size before table update. */
+            if (dev->log_size < log_size) {
+                vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
+            }
+        }
+        devs[n++] = dev;
+    }
+
+    r = vhost_dev_set_mem_tables(devs, n);
     assert(r >= 0);
-    /* To log less, can only decrease log size after table update. */
-    if (dev->log_size > log_size + VHOST_LOG_BUFFER) {
-        vhost_dev_log_resize(dev, log_size);
+
+    while (n-- > 0) {
+        dev = devs[n];
+        if (dev->log_enabled) {
+            log_size = vhost_get_log_size(dev);
+            /* To log less, can only decrease log size after table update. */
+            if (dev->log_size > log_size + VHOST_LOG_BUFFER) {
+                vhost_dev_log_resize(dev, log_size);
+            }
+        }
+        dev->mem_table_pending = false;
+        dev->memory_changed = false;
     }
-    dev->memory_changed = false;
+    g_free(devs);
 }
 
+static MemoryListener vhost_mem_listener = {
+    .commit = vhost_mem_commit,
+    .priority = 11,
+};
+
 static void vhost_region_add(MemoryListener *listener,
                              MemoryRegionSection *section)
 {
@@ -559,13 +772,15 @@ static int vhost_dev_set_features(struct vhost_dev *dev, bool enable_log)
 
 static int vhost_dev_set_log(struct vhost_dev *dev, bool enable_log)
 {
-    int r, t, i;
+    int r, t, i, idx;
     r = vhost_dev_set_features(dev, enable_log);
     if (r < 0) {
         goto err_features;
     }
     for (i = 0; i < dev->nvqs; ++i) {
-        r = vhost_virtqueue_set_addr(dev, dev->vqs + i, i,
+        idx = dev->vhost_ops->vhost_backend_get_vq_index(dev,
+                                                         dev->vq_index + i);
+        r = vhost_virtqueue_set_addr(dev, dev->vqs + i, idx,
                                      enable_log);
         if (r < 0) {
             goto err_vq;
@@ -574,7 +789,9 @@ static int vhost_dev_set_log(struct vhost_dev *dev, bool enable_log)
     return 0;
 err_vq:
     for (; i >= 0; --i) {
-        t = vhost_virtqueue_set_addr(dev, dev->vqs + i, i,
+        idx = dev->vhost_ops->vhost_backend_get_vq_index(dev,
+                                                         dev->vq_index + i);
+        t = vhost_virtqueue_set_addr(dev, dev->vqs + i, idx,
                                      dev->log_enabled);
         assert(t >= 0);
     }
@@ -654,7 +871,8 @@ static int vhost_virtqueue_start(struct vhost_dev *dev,
 {
     hwaddr s, l, a;
     int r;
-    int vhost_vq_index = idx - dev->vq_index;
+    int vhost_vq_index =
+        dev->vhost_ops->vhost_backend_get_vq_index(dev, idx);
     struct vhost_vring_file file = {
         .index = vhost_vq_index
     };
@@ -747,17 +965,28 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
                                     struct vhost_virtqueue *vq,
                                     unsigned idx)
 {
+    int vhost_vq_index =
+        dev->vhost_ops->vhost_backend_get_vq_index(dev, idx);
     struct vhost_vring_state state = {
-        .index = idx - dev->vq_index
+        .index = vhost_vq_index,
     };
     int r;
     assert(idx >= dev->vq_index && idx < dev->vq_index + dev->nvqs);
     r = dev->vhost_ops->vhost_call(dev, VHOST_GET_VRING_BASE, &state);
-    if (r < 0) {
-        fprintf(stderr, "vhost VQ %d ring restore failed: %d\n", idx, r);
-        fflush(stderr);
+    if (r < 0 && dev->vhost_ops->backend_type == VHOST_BACKEND_TYPE_USER) {
+        /* A vhost-user backend that went away cannot tell us where it
+         * stopped.  Resume from what it last marked as used; requests that
+         * were in flight are made available again and redone.
+         */
+        virtio_queue_restore_last_avail_idx(vdev, idx);
+        r = 0;
+    } else {
+        if (r < 0) {
+            fprintf(stderr, "vhost VQ %d ring restore failed: %d\n", idx, r);
+            fflush(stderr);
+        }
+        virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     }
-    virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     virtio_queue_invalidate_signalled_used(vdev, idx);
     assert (r >= 0);
     cpu_physical_memory_unmap(vq->ring, virtio_queue_get_ring_size(vdev, idx),
@@ -785,8 +1014,10 @@ static void vhost_eventfd_del(MemoryListener *listener,
 static int vhost_virtqueue_init(struct vhost_dev *dev,
                                 struct vhost_virtqueue *vq, int n)
 {
+    int vhost_vq_index =
+        dev->vhost_ops->vhost_backend_get_vq_index(dev, dev->vq_index + n);
     struct vhost_vring_file file = {
-        .index = n,
+        .index = vhost_vq_index,
     };
     int r = event_notifier_init(&vq->masked_notifier, 0);
     if (r < 0) {
@@ -871,6 +1102,12 @@ int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
     hdev->log_enabled = false;
     hdev->started = false;
     hdev->memory_changed = false;
+    hdev->mem_table_pending = false;
+    hdev->preloaded = false;
+    if (QLIST_EMPTY(&vhost_devices)) {
+        memory_listener_register(&vhost_mem_listener, &address_space_memory);
+    }
+    QLIST_INSERT_HEAD(&vhost_devices, hdev, entry);
     memory_listener_register(&hdev->memory_listener, &address_space_memory);
     hdev->force = force;
     return 0;
@@ -891,6 +1128,11 @@ void vhost_dev_cleanup(struct vhost_dev *hdev)
         vhost_virtqueue_cleanup(hdev->vqs + i);
     }
     memory_listener_unregister(&hdev->memory_listener);
+    QLIST_REMOVE(hdev, entry);
+    if (QLIST_EMPTY(&vhost_devices)) {
+        memory_listener_unregister(&vhost_mem_listener);
+        vhost_mem_pool_stop();
+    }
     if (hdev->migration_blocker) {
         migrate_del_blocker(hdev->migration_blocker);
         error_free(hdev->migration_blocker);
@@ -992,7 +1234,7 @@ void vhost_virtqueue_mask(struct vhost_dev *hdev, VirtIODevice *vdev, int n,
     assert(n >= hdev->vq_index && n < hdev->vq_index + hdev->nvqs);
 
     struct vhost_vring_file file = {
-        .index = index
+        .index = hdev->vhost_ops->vhost_backend_get_vq_index(hdev, n),
     };
     if (mask) {
         file.fd = event_notifier_get_fd(&hdev->vqs[index].masked_notifier);
@@ -1030,6 +1272,32 @@ void vhost_ack_features(struct vhost_dev *hdev, const int *feature_bits,
     }
 }
 
+/*
+ * Send the features and then the memory table to devices that are about
+ * to be started, the tables of all of them in one vhost_dev_set_mem_tables()
+ * pass; vhost_dev_start() skips both steps for these devices.  Each backend
+ * still sees SET_FEATURES before SET_MEM_TABLE, as from vhost_dev_start().
+ */
+int vhost_dev_preload(struct vhost_dev **devs, int n)
+{
+    int i, r;
+
+    for (i = 0; i < n; i++) {
+        r = vhost_dev_set_features(devs[i], devs[i]->log_enabled);
+        if (r < 0) {
+            return r;
+        }
+    }
+    r = vhost_dev_set_mem_tables(devs, n);
+    if (r < 0) {
+        return r;
+    }
+    for (i = 0; i < n; i++) {
+        devs[i]->preloaded = true;
+    }
+    return 0;
+}
+
 /* Host notifiers must be enabled at this point. */
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
 {
@@ -1037,15 +1305,19 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
 
     hdev->started = true;
 
-    r = vhost_dev_set_features(hdev, hdev->log_enabled);
-    if (r < 0) {
-        goto fail_features;
-    }
-    r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_MEM_TABLE, hdev->mem);
-    if (r < 0) {
-        r = -errno;
-        goto fail_mem;
+    /* vhost_dev_preload() may have done this already */
+    if (!hdev->preloaded) {
+        r = vhost_dev_set_features(hdev, hdev->log_enabled);
+        if (r < 0) {
+            goto fail_features;
+        }
+        r = hdev->vhost_ops->vhost_call(hdev, VHOST_SET_MEM_TABLE, hdev->mem);
+        if (r < 0) {
+            r = -errno;
+            goto fail_mem;
+        }
     }
+    hdev->preloaded = false;
     for (i = 0; i < hdev->nvqs; ++i) {
         r = vhost_virtqueue_start(hdev,
                                   vdev,
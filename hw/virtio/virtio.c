@@ -21,6 +21,7 @@
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
+#include "hw/xen/xen.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -71,6 +72,14 @@ struct VirtQueue
     VRing vring;
     hwaddr pa;
     uint16_t last_avail_idx;
+
+    /* Last avail_idx read from VQ, avoids touching the avail ring while
+     * requests that are already known to be pending are popped. */
+    uint16_t shadow_avail_idx;
+
+    /* The device owns used->idx, keep a copy instead of reading it back */
+    uint16_t used_idx;
+
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -103,35 +112,16 @@ static void virtqueue_init(VirtQueue *vq)
                                  vq->vring.align);
 }
 
-static inline uint64_t vring_desc_addr(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
-{
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return virtio_ldq_phys(vdev, pa);
-}
-
-static inline uint32_t vring_desc_len(VirtIODevice *vdev, hwaddr desc_pa, int i)
-{
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return virtio_ldl_phys(vdev, pa);
-}
-
-static inline uint16_t vring_desc_flags(VirtIODevice *vdev, hwaddr desc_pa,
-                                        int i)
-{
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return virtio_lduw_phys(vdev, pa);
-}
-
-static inline uint16_t vring_desc_next(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+/* Read a whole descriptor with a single guest memory access */
+static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
+                            hwaddr desc_pa, int i)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return virtio_lduw_phys(vdev, pa);
+    cpu_physical_memory_read(desc_pa + i * sizeof(VRingDesc),
+                             desc, sizeof(VRingDesc));
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->flags);
+    virtio_tswap16s(vdev, &desc->next);
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
@@ -145,7 +135,8 @@ static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
     hwaddr pa;
     pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    vq->shadow_avail_idx = virtio_lduw_phys(vq->vdev, pa);
+    return vq->shadow_avail_idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
@@ -160,18 +151,15 @@ static inline uint16_t vring_used_event(VirtQueue *vq)
     return vring_avail_ring(vq, vq->vring.num);
 }
 
-static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
-{
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    virtio_stl_phys(vq->vdev, pa, val);
-}
-
-static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
+/* Write id and len of a used element with a single guest memory access */
+static inline void vring_used_write(VirtQueue *vq, VRingUsedElem *uelem,
+                                    int i)
 {
     hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    virtio_stl_phys(vq->vdev, pa, val);
+    virtio_tswap32s(vq->vdev, &uelem->id);
+    virtio_tswap32s(vq->vdev, &uelem->len);
+    pa = vq->vring.used + offsetof(VRingUsed, ring[i]);
+    cpu_physical_memory_write(pa, uelem, sizeof(VRingUsedElem));
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
@@ -186,6 +174,7 @@ static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
     hwaddr pa;
     pa = vq->vring.used + offsetof(VRingUsed, idx);
     virtio_stw_phys(vq->vdev, pa, val);
+    vq->used_idx = val;
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
@@ -235,19 +224,11 @@ int virtio_queue_ready(VirtQueue *vq)
     return vq->vring.avail != 0;
 }
 
-int virtio_queue_empty(VirtQueue *vq)
-{
-    return vring_avail_idx(vq) == vq->last_avail_idx;
-}
-
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_unmap_sg(const VirtQueueElement *elem, unsigned int len)
 {
     unsigned int offset;
     int i;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
-
     offset = 0;
     for (i = 0; i < elem->in_num; i++) {
         size_t size = MIN(len - offset, elem->in_sg[i].iov_len);
@@ -263,12 +244,35 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
         cpu_physical_memory_unmap(elem->out_sg[i].iov_base,
                                   elem->out_sg[i].iov_len,
                                   0, elem->out_sg[i].iov_len);
+}
+
+/* Give back an element that virtqueue_pop() returned but that the device
+ * will not use, so that it is popped again later.  When several elements
+ * are given back, this must happen in the reverse order they were popped.
+ */
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem)
+{
+    trace_virtqueue_discard(vq, elem);
+    vq->last_avail_idx--;
+    vq->inuse--;
+    virtqueue_unmap_sg(elem, 0);
+}
+
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    VRingUsedElem uelem;
+
+    trace_virtqueue_fill(vq, elem, len, idx);
+
+    virtqueue_unmap_sg(elem, len);
 
-    idx = (idx + vring_used_idx(vq)) % vq->vring.num;
+    idx = (idx + vq->used_idx) % vq->vring.num;
 
     /* Get a pointer to the next entry in the used ring. */
-    vring_used_ring_id(vq, idx, elem->index);
-    vring_used_ring_len(vq, idx, len);
+    uelem.id = elem->index;
+    uelem.len = len;
+    vring_used_write(vq, &uelem, idx);
 }
 
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
@@ -277,7 +281,7 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
-    old = vring_used_idx(vq);
+    old = vq->used_idx;
     new = old + count;
     vring_used_idx_set(vq, new);
     vq->inuse -= count;
@@ -311,6 +315,19 @@ static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
     return num_heads;
 }
 
+int virtio_queue_empty(VirtQueue *vq)
+{
+    uint16_t num_heads = vq->shadow_avail_idx - vq->last_avail_idx;
+
+    /* The cached index says there is work without a read of guest memory,
+     * but only a sane one can be trusted; a fresh read is checked below. */
+    if (num_heads && num_heads <= vq->vring.num) {
+        return 0;
+    }
+
+    return virtqueue_num_heads(vq, vq->last_avail_idx) == 0;
+}
+
 static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
 {
     unsigned int head;
@@ -328,18 +345,19 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
-                                    unsigned int i, unsigned int max)
+/* Advance to the next descriptor of a chain and read it into *desc */
+static unsigned virtqueue_next_desc(VirtIODevice *vdev, VRingDesc *desc,
+                                    hwaddr desc_pa, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_NEXT)) {
+    if (!(desc->flags & VRING_DESC_F_NEXT)) {
         return max;
     }
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(vdev, desc_pa, i);
+    next = desc->next;
     /* Make sure compiler knows to grab that: we don't want it changing! */
     smp_wmb();
 
@@ -348,6 +366,7 @@ static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
         exit(1);
     }
 
+    vring_desc_read(vdev, desc, desc_pa, next);
     return next;
 }
 
@@ -364,6 +383,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     while (virtqueue_num_heads(vq, idx)) {
         VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
+        VRingDesc desc;
         hwaddr desc_pa;
         int i;
 
@@ -371,9 +391,10 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        vring_desc_read(vdev, &desc, desc_pa, i);
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -386,9 +407,10 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(vdev, desc_pa, i);
+            max = desc.len / sizeof(VRingDesc);
+            desc_pa = desc.addr;
             num_bufs = i = 0;
+            vring_desc_read(vdev, &desc, desc_pa, i);
         }
 
         do {
@@ -398,15 +420,15 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(vdev, desc_pa, i);
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
             } else {
-                out_total += vring_desc_len(vdev, desc_pa, i);
+                out_total += desc.len;
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+        } while (virtqueue_next_desc(vdev, &desc, desc_pa, max) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -431,7 +453,36 @@ int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
     return in_bytes <= in_total && out_bytes <= out_total;
 }
 
-void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
+/* Translate a guest physical range through the cached RAM layout.  Like
+ * cpu_physical_memory_map(), a reference to the MemoryRegion is taken so
+ * that cpu_physical_memory_unmap() can be used on the result. */
+static void *virtio_mem_map(VirtIODevice *vdev, hwaddr addr, hwaddr len,
+                            int is_write)
+{
+    VirtIOMemRegion *reg;
+    unsigned int lo = 0, hi = vdev->n_mem_regions;
+
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        reg = &vdev->mem_regions[mid];
+        if (addr < reg->guest_addr) {
+            hi = mid;
+        } else if (addr - reg->guest_addr >= reg->size) {
+            lo = mid + 1;
+        } else {
+            if (len > reg->size - (addr - reg->guest_addr) ||
+                (is_write && reg->readonly)) {
+                return NULL;
+            }
+            memory_region_ref(reg->mr);
+            return reg->host + (addr - reg->guest_addr);
+        }
+    }
+    return NULL;
+}
+
+void virtqueue_map_sg(VirtIODevice *vdev, struct iovec *sg, hwaddr *addr,
     size_t num_sg, int is_write)
 {
     unsigned int i;
@@ -445,6 +496,10 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
 
     for (i = 0; i < num_sg; i++) {
         len = sg[i].iov_len;
+        sg[i].iov_base = virtio_mem_map(vdev, addr[i], len, is_write);
+        if (sg[i].iov_base) {
+            continue;
+        }
         sg[i].iov_base = cpu_physical_memory_map(addr[i], &len, is_write);
         if (sg[i].iov_base == NULL || len != sg[i].iov_len) {
             error_report("virtio: error trying to map MMIO memory");
@@ -458,9 +513,14 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     unsigned int i, head, max;
     hwaddr desc_pa = vq->vring.desc;
     VirtIODevice *vdev = vq->vdev;
+    VRingDesc desc;
 
-    if (!virtqueue_num_heads(vq, vq->last_avail_idx))
+    if (virtio_queue_empty(vq)) {
         return 0;
+    }
+    /* Needed after virtio_queue_empty(), see comment in
+     * virtqueue_num_heads(). */
+    smp_rmb();
 
     /* When we start there are none of either input nor output. */
     elem->out_num = elem->in_num = 0;
@@ -469,53 +529,55 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
     if (vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
-        vring_avail_event(vq, vring_avail_idx(vq));
+        vring_avail_event(vq, vq->last_avail_idx);
     }
 
-    if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+    vring_desc_read(vdev, &desc, desc_pa, i);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(vdev, desc_pa, i);
+        max = desc.len / sizeof(VRingDesc);
+        desc_pa = desc.addr;
         i = 0;
+        vring_desc_read(vdev, &desc, desc_pa, i);
     }
 
     /* Collect all the descriptors */
     do {
         struct iovec *sg;
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
+        if (desc.flags & VRING_DESC_F_WRITE) {
             if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
                 error_report("Too many write descriptors in indirect table");
                 exit(1);
             }
-            elem->in_addr[elem->in_num] = vring_desc_addr(vdev, desc_pa, i);
+            elem->in_addr[elem->in_num] = desc.addr;
             sg = &elem->in_sg[elem->in_num++];
         } else {
             if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
                 error_report("Too many read descriptors in indirect table");
                 exit(1);
             }
-            elem->out_addr[elem->out_num] = vring_desc_addr(vdev, desc_pa, i);
+            elem->out_addr[elem->out_num] = desc.addr;
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(vdev, desc_pa, i);
+        sg->iov_len = desc.len;
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+    } while (virtqueue_next_desc(vdev, &desc, desc_pa, max) != max);
 
     /* Now map what we have collected */
-    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
-    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+    virtqueue_map_sg(vdev, elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(vdev, elem->out_sg, elem->out_addr, elem->out_num, 0);
 
     elem->index = head;
 
@@ -604,6 +666,8 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].shadow_avail_idx = 0;
+        vdev->vq[i].used_idx = 0;
         vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].signalled_used = 0;
@@ -851,7 +915,7 @@ static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
     v = vq->signalled_used_valid;
     vq->signalled_used_valid = true;
     old = vq->signalled_used;
-    new = vq->signalled_used = vring_used_idx(vq);
+    new = vq->signalled_used = vq->used_idx;
     return !v || vring_need_event(vring_used_event(vq), new, old);
 }
 
@@ -1039,11 +1103,13 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
         }
         vdev->vq[i].pa = qemu_get_be64(f);
         qemu_get_be16s(f, &vdev->vq[i].last_avail_idx);
+        vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
 
         if (vdev->vq[i].pa) {
             virtqueue_init(&vdev->vq[i]);
+            vdev->vq[i].used_idx = vring_used_idx(&vdev->vq[i]);
         } else if (vdev->vq[i].last_avail_idx) {
             error_report("VQ %d address 0x0 "
                          "inconsistent with Host index 0x%x",
@@ -1202,7 +1268,28 @@ uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
 
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
 {
-    vdev->vq[n].last_avail_idx = idx;
+    VirtQueue *vq = &vdev->vq[n];
+
+    vq->last_avail_idx = idx;
+    vq->shadow_avail_idx = idx;
+
+    /* vhost and dataplane fill the used ring without going through the
+     * VirtQueue, pick up where they left off. */
+    if (vq->vring.used) {
+        vq->used_idx = vring_used_idx(vq);
+    }
+}
+
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (!vq->vring.used) {
+        return;
+    }
+    vq->used_idx = vring_used_idx(vq);
+    vq->last_avail_idx = vq->used_idx;
+    vq->shadow_avail_idx = vq->used_idx;
 }
 
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
@@ -1284,6 +1371,68 @@ void virtio_device_set_child_bus_name(VirtIODevice *vdev, char *bus_name)
     vdev->bus_name = g_strdup(bus_name);
 }
 
+static void virtio_mem_regions_free(VirtIOMemRegion *regions, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        memory_region_unref(regions[i].mr);
+    }
+    g_free(regions);
+}
+
+static void virtio_memory_begin(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, mem_listener);
+
+    virtio_mem_regions_free(vdev->new_mem_regions, vdev->n_new_mem_regions);
+    vdev->new_mem_regions = NULL;
+    vdev->n_new_mem_regions = 0;
+}
+
+static void virtio_memory_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, mem_listener);
+
+    virtio_mem_regions_free(vdev->mem_regions, vdev->n_mem_regions);
+    vdev->mem_regions = vdev->new_mem_regions;
+    vdev->n_mem_regions = vdev->n_new_mem_regions;
+    vdev->new_mem_regions = NULL;
+    vdev->n_new_mem_regions = 0;
+}
+
+/* Called for every section of the new memory map, in ascending address
+ * order, so the table ends up sorted for virtio_mem_map(). */
+static void virtio_memory_region_add(MemoryListener *listener,
+                                     MemoryRegionSection *section)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, mem_listener);
+    VirtIOMemRegion *reg;
+
+    if (!memory_region_is_ram(section->mr)) {
+        return;
+    }
+
+    vdev->new_mem_regions = g_renew(VirtIOMemRegion, vdev->new_mem_regions,
+                                    vdev->n_new_mem_regions + 1);
+    reg = &vdev->new_mem_regions[vdev->n_new_mem_regions++];
+    reg->guest_addr = section->offset_within_address_space;
+    reg->size = int128_get64(section->size);
+    reg->host = (uint8_t *)memory_region_get_ram_ptr(section->mr) +
+                section->offset_within_region;
+    reg->mr = section->mr;
+    reg->readonly = section->readonly || memory_region_is_rom(section->mr);
+    memory_region_ref(reg->mr);
+}
+
+static const MemoryListener virtio_memory_listener = {
+    .begin = virtio_memory_begin,
+    .commit = virtio_memory_commit,
+    .region_add = virtio_memory_region_add,
+    .region_nop = virtio_memory_region_add,
+    .priority = 10,
+};
+
 static void virtio_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -1298,6 +1447,14 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         }
     }
     virtio_bus_device_plugged(vdev);
+
+    /* Xen maps guest memory on demand, keep using its map cache there */
+    if (!xen_enabled()) {
+        vdev->mem_listener = virtio_memory_listener;
+        memory_listener_register(&vdev->mem_listener, &address_space_memory);
+        /* Registration only calls region_add, publish what it collected */
+        virtio_memory_commit(&vdev->mem_listener);
+    }
 }
 
 static void virtio_device_unrealize(DeviceState *dev, Error **errp)
@@ -1306,6 +1463,13 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     VirtioDeviceClass *vdc = VIRTIO_DEVICE_GET_CLASS(dev);
     Error *err = NULL;
 
+    if (!xen_enabled()) {
+        memory_listener_unregister(&vdev->mem_listener);
+        virtio_mem_regions_free(vdev->mem_regions, vdev->n_mem_regions);
+        vdev->mem_regions = NULL;
+        vdev->n_mem_regions = 0;
+    }
+
     virtio_bus_device_unplugged(vdev);
 
     if (vdc->unrealize != NULL) {
@@ -44,6 +44,8 @@ void qemu_aio_release(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+/* Busy-wait check for work; processes it and returns true on progress */
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -79,6 +81,18 @@ struct AioContext {
     /* Used for aio_notify.  */
     EventNotifier notifier;
 
+    /* Set by aio_notify, lets aio_poll() stop busy-waiting early */
+    bool notified;
+
+    /* epoll(7) state used when there are many handlers, see aio-posix.c */
+    int epollfd;
+    bool epoll_enabled;
+    bool epoll_available;
+
+    /* Adaptive busy-polling window, see aio_poll() */
+    int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
+    int64_t poll_ns;        /* current polling time in nanoseconds */
+
     /* GPollFDs for aio_poll() */
     GArray *pollfds;
 
@@ -92,6 +106,12 @@ struct AioContext {
 /* Used internally to synchronize aio_poll against qemu_bh_schedule.  */
 void aio_set_dispatching(AioContext *ctx, bool dispatching);
 
+/* Used internally to set up and tear down the host-specific parts of an
+ * AioContext, implemented in aio-posix.c and aio-win32.c.
+ */
+void aio_context_setup(AioContext *ctx);
+void aio_context_destroy(AioContext *ctx);
+
 /**
  * aio_context_new: Allocate a new AioContext.
  *
@@ -252,6 +272,27 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Register a busy-wait poll handler for an event notifier that already has
+ * a handler registered with aio_set_event_notifier.  Before blocking,
+ * aio_poll() calls @io_poll in a loop for up to the context's polling
+ * window, so that work such as new virtqueue buffers or AIO completions is
+ * picked up without waiting for the notifier.  Pass NULL to unregister.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds
+ *
+ * Poll mode can be disabled by setting @max_ns to 0.  The polling window
+ * then adapts between 0 and @max_ns depending on how long the context
+ * actually ends up blocking.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -309,6 +309,8 @@ typedef struct RAMBlock {
      */
     QTAILQ_ENTRY(RAMBlock) next;
     int fd;
+    /* Offset of the block's pages in a mapped-ram migration file */
+    int64_t mapped_offset;
 } RAMBlock;
 
 typedef struct RAMList {
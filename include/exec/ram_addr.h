@@ -151,5 +151,57 @@ static inline void cpu_physical_memory_clear_dirty_range(ram_addr_t start,
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t length,
                                      unsigned client);
 
+/*
+ * Move the DIRTY_MEMORY_MIGRATION bits of [start, start + length) into
+ * @dest and return the number of pages that were not already set there.
+ *
+ * The source bits are consumed a word at a time with an atomic exchange,
+ * so this does not need the iothread lock: a concurrent writer can at most
+ * cause a page to be reported again by the next call.  TCG callers must
+ * still reset the TLB dirty state with cpu_physical_memory_reset_dirty().
+ */
+static inline uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
+                                                             ram_addr_t start,
+                                                             ram_addr_t length)
+{
+    unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long nr_pages = length >> TARGET_PAGE_BITS;
+    uint64_t num_dirty = 0;
+
+    /* start address is aligned at the start of a word? */
+    if ((page & (BITS_PER_LONG - 1)) == 0) {
+        unsigned long k;
+        unsigned long first = BIT_WORD(page);
+        unsigned long last = first + BITS_TO_LONGS(nr_pages);
+
+        for (k = first; k < last; k++) {
+            if (src[k]) {
+                unsigned long bits = atomic_xchg(&src[k], 0);
+                unsigned long new_dirty = bits & ~dest[k];
+
+                if (new_dirty) {
+                    dest[k] |= new_dirty;
+                    num_dirty += ctpopl(new_dirty);
+                }
+            }
+        }
+    } else {
+        unsigned long end = page + nr_pages;
+
+        for (page = find_next_bit(src, end, page); page < end;
+             page = find_next_bit(src, end, page + 1)) {
+            unsigned long mask = BIT_MASK(page);
+            unsigned long old = atomic_fetch_and(&src[BIT_WORD(page)], ~mask);
+
+            if ((old & mask) && !test_and_set_bit(page, dest)) {
+                num_dirty++;
+            }
+        }
+    }
+
+    return num_dirty;
+}
+
 #endif
 #endif
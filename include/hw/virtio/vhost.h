@@ -41,6 +41,9 @@ struct vhost_dev {
     unsigned long long features;
     unsigned long long acked_features;
     unsigned long long backend_features;
+    /* vhost-user protocol features acked by both sides */
+    uint64_t protocol_features;
+    uint64_t max_queues;
     bool started;
     bool log_enabled;
     vhost_log_chunk_t *log;
@@ -48,10 +51,13 @@ struct vhost_dev {
     Error *migration_blocker;
     bool force;
     bool memory_changed;
+    bool mem_table_pending;     /* changed since the last commit */
+    bool preloaded;             /* features and table sent ahead of start */
     hwaddr mem_changed_start_addr;
     hwaddr mem_changed_end_addr;
     const VhostOps *vhost_ops;
     void *opaque;
+    QLIST_ENTRY(vhost_dev) entry;
 };
 
 int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
@@ -60,6 +66,8 @@ void vhost_dev_cleanup(struct vhost_dev *hdev);
 bool vhost_dev_query(struct vhost_dev *hdev, VirtIODevice *vdev);
 int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev);
 void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev);
+int vhost_dev_set_mem_tables(struct vhost_dev **devs, int n);
+int vhost_dev_preload(struct vhost_dev **devs, int n);
 int vhost_dev_enable_notifiers(struct vhost_dev *hdev, VirtIODevice *vdev);
 void vhost_dev_disable_notifiers(struct vhost_dev *hdev, VirtIODevice *vdev);
 
@@ -40,6 +40,7 @@
 #define VIRTIO_BLK_F_WCE        9       /* write cache enabled */
 #define VIRTIO_BLK_F_TOPOLOGY   10      /* Topology information is available */
 #define VIRTIO_BLK_F_CONFIG_WCE 11      /* write cache configurable */
+#define VIRTIO_BLK_F_MQ         12      /* support more than one vq */
 
 #define VIRTIO_BLK_ID_BYTES     20      /* ID string length */
 
@@ -57,6 +58,8 @@ struct virtio_blk_config
     uint16_t min_io_size;
     uint32_t opt_io_size;
     uint8_t wce;
+    uint8_t unused;
+    uint16_t num_queues;
 } QEMU_PACKED;
 
 /* These two define direction. */
@@ -113,6 +116,8 @@ struct VirtIOBlkConf
     uint32_t scsi;
     uint32_t config_wce;
     uint32_t data_plane;
+    uint16_t num_queues;
+    uint32_t request_merging;
 };
 
 struct VirtIOBlockDataPlane;
@@ -121,7 +126,6 @@ struct VirtIOBlockReq;
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockDriverState *bs;
-    VirtQueue *vq;
     void *rq;
     QEMUBH *bh;
     BlockConf *conf;
@@ -137,22 +141,29 @@ typedef struct VirtIOBlock {
 #endif
 } VirtIOBlock;
 
+#define VIRTIO_BLK_MAX_MERGE_REQS 32
+
 typedef struct MultiReqBuffer {
-    BlockRequest        blkreq[32];
-    unsigned int        num_writes;
+    struct VirtIOBlockReq *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int        num_reqs;
+    bool                is_write;
 } MultiReqBuffer;
 
 typedef struct VirtIOBlockReq {
     VirtIOBlock *dev;
+    VirtQueue *vq;
     VirtQueueElement elem;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr out;
     QEMUIOVector qiov;
+    size_t in_len;
+    int64_t sector_num;
     struct VirtIOBlockReq *next;
+    struct VirtIOBlockReq *mr_next;     /* next request merged with this one */
     BlockAcctCookie acct;
 } VirtIOBlockReq;
 
-VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s);
+VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s, VirtQueue *vq);
 
 void virtio_blk_free_request(VirtIOBlockReq *req);
 
@@ -161,6 +172,6 @@ int virtio_blk_handle_scsi_req(VirtIOBlock *blk,
 
 void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb);
 
-void virtio_submit_multiwrite(BlockDriverState *bs, MultiReqBuffer *mrb);
+void virtio_blk_submit_multireq(BlockDriverState *bs, MultiReqBuffer *mrb);
 
 #endif
@@ -67,11 +67,15 @@
  * and latency. */
 #define TX_BURST 256
 
+/* Entries in the table mapping RSS hash values to queue pairs */
+#define VIRTIO_NET_RSS_INDIRECTION_TABLE_SIZE 128
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    uint16_t rss_queues;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -143,6 +147,15 @@ struct virtio_net_ctrl_mac {
     uint8_t macs[][ETH_ALEN];
 };
 
+/* Packets popped from a TX queue and handed to the peer in one call */
+#define VIRTIO_NET_TX_BATCH 16
+
+typedef struct VirtIONetTxBatch {
+    VirtQueueElement elems[VIRTIO_NET_TX_BATCH];
+    struct iovec sg[VIRTIO_NET_TX_BATCH][VIRTQUEUE_MAX_SIZE];
+    NetIOVPacket pkts[VIRTIO_NET_TX_BATCH];
+} VirtIONetTxBatch;
+
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
@@ -153,6 +166,8 @@ typedef struct VirtIONetQueue {
         VirtQueueElement elem;
         ssize_t len;
     } async_tx;
+    VirtIONetTxBatch *tx_batch;
+    bool rx_notify;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -197,6 +212,9 @@ typedef struct VirtIONet {
     uint64_t curr_guest_offloads;
     QEMUTimer *announce_timer;
     int announce_counter;
+    /* Queue pairs share a single queue peer and RX is steered by flow hash */
+    bool rss;
+    uint16_t rss_indirection_table[VIRTIO_NET_RSS_INDIRECTION_TABLE_SIZE];
 } VirtIONet;
 
 #define VIRTIO_NET_CTRL_MAC    1
@@ -284,7 +302,8 @@ struct virtio_net_ctrl_mq {
 #define DEFINE_VIRTIO_NET_PROPERTIES(_state, _field)                           \
     DEFINE_PROP_UINT32("x-txtimer", _state, _field.txtimer, TX_TIMER_INTERVAL),\
     DEFINE_PROP_INT32("x-txburst", _state, _field.txburst, TX_BURST),          \
-    DEFINE_PROP_STRING("tx", _state, _field.tx)
+    DEFINE_PROP_STRING("tx", _state, _field.tx),                              \
+    DEFINE_PROP_UINT16("rss-queues", _state, _field.rss_queues, 0)
 
 void virtio_net_set_config_size(VirtIONet *n, uint32_t host_features);
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
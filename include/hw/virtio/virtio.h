@@ -15,6 +15,7 @@
 #define _QEMU_VIRTIO_H
 
 #include "hw/hw.h"
+#include "exec/memory.h"
 #include "net/net.h"
 #include "hw/qdev.h"
 #include "sysemu/sysemu.h"
@@ -110,6 +111,16 @@ enum virtio_device_endian {
     VIRTIO_DEVICE_ENDIAN_BIG,
 };
 
+/* A guest RAM range that virtqueue_map_sg() can translate without going
+ * through the address space dispatch. */
+typedef struct VirtIOMemRegion {
+    hwaddr guest_addr;
+    hwaddr size;
+    uint8_t *host;
+    MemoryRegion *mr;
+    bool readonly;
+} VirtIOMemRegion;
+
 struct VirtIODevice
 {
     DeviceState parent_obj;
@@ -128,6 +139,12 @@ struct VirtIODevice
     VMChangeStateEntry *vmstate;
     char *bus_name;
     uint8_t device_endian;
+    MemoryListener mem_listener;
+    VirtIOMemRegion *mem_regions;
+    unsigned int n_mem_regions;
+    /* Built between begin and commit of a memory topology update */
+    VirtIOMemRegion *new_mem_regions;
+    unsigned int n_new_mem_regions;
 };
 
 typedef struct VirtioDeviceClass {
@@ -179,8 +196,9 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_flush(VirtQueue *vq, unsigned int count);
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx);
+void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem);
 
-void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
+void virtqueue_map_sg(VirtIODevice *vdev, struct iovec *sg, hwaddr *addr,
     size_t num_sg, int is_write);
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem);
 int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
@@ -250,6 +268,7 @@ hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_ring_size(VirtIODevice *vdev, int n);
 uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n);
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx);
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n);
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n);
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n);
 uint16_t virtio_get_queue_index(VirtQueue *vq);
@@ -48,6 +48,14 @@ typedef int (QEMUFileGetBufferFunc)(void *opaque, uint8_t *buf,
  */
 typedef int (QEMUFileCloseFunc)(void *opaque);
 
+/* Write out everything that is still in flight and make it stable.
+ * Called once by the migration thread when it is done with the file, so
+ * that close() does not have to wait for the disk.
+ *
+ * Return negative error number on error, 0 on success.
+ */
+typedef int (QEMUFileFinishFunc)(void *opaque);
+
 /* Called to return the OS file descriptor associated to the QEMUFile.
  */
 typedef int (QEMUFileGetFD)(void *opaque);
@@ -88,20 +96,31 @@ typedef struct QEMUFileOps {
     QEMUFileCloseFunc *close;
     QEMUFileGetFD *get_fd;
     QEMUFileWritevBufferFunc *writev_buffer;
+    /* Optional; used for guest RAM queued by qemu_put_buffer_async, which
+     * stays mapped and may be transmitted without copying.  */
+    QEMUFileWritevBufferFunc *writev_buffer_zerocopy;
     QEMURamHookFunc *before_ram_iterate;
     QEMURamHookFunc *after_ram_iterate;
     QEMURamHookFunc *hook_ram_load;
     QEMURamSaveFunc *save_page;
+    QEMUFileFinishFunc *finish;
+    /* writev_buffer and get_buffer honour their pos argument, so the file
+     * can be used with qemu_put_buffer_at() and qemu_get_buffer_at() */
+    bool seekable;
 } QEMUFileOps;
 
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops);
 QEMUFile *qemu_fopen(const char *filename, const char *mode);
 QEMUFile *qemu_fdopen(int fd, const char *mode);
 QEMUFile *qemu_fopen_socket(int fd, const char *mode);
+QEMUFile *qemu_fopen_socket_zerocopy(int fd);
 QEMUFile *qemu_popen_cmd(const char *command, const char *mode);
 int qemu_get_fd(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
+int qemu_file_finish(QEMUFile *f);
 int64_t qemu_ftell(QEMUFile *f);
+int64_t qemu_file_total_transferred(QEMUFile *f);
+bool qemu_file_is_seekable(QEMUFile *f);
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size);
 void qemu_put_byte(QEMUFile *f, int v);
 /*
@@ -109,6 +128,16 @@ void qemu_put_byte(QEMUFile *f, int v);
  * The buffer should be available till it is sent asynchronously.
  */
 void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
+/*
+ * Access a seekable migration file at an absolute offset, outside of the
+ * sequential stream.  Other files fail with -ENOTSUP.  Like qemu_put_buffer_async(), the
+ * buffer is not copied and must stay available until the next flush.
+ */
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                        int64_t pos);
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size, int64_t pos);
+/* Continue the sequential stream at absolute offset pos */
+void qemu_file_set_pos(QEMUFile *f, int64_t pos);
 bool qemu_file_mode_is_not_valid(const char *mode);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
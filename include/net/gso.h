@@ -0,0 +1,63 @@
+/*
+ * Software segmentation of TCP and UDP super-packets for emulated NICs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_NET_GSO_H
+#define QEMU_NET_GSO_H
+
+#include "qemu-common.h"
+
+/* Largest header block (L2 + L3 + L4) that the segmenter copies */
+#define NET_GSO_MAX_HDR_LEN 256
+
+/*
+ * A super-packet handed over by a NIC that offers TCP segmentation.
+ *
+ * @type is VIRTIO_NET_HDR_GSO_TCPV4, VIRTIO_NET_HDR_GSO_TCPV6 or
+ * VIRTIO_NET_HDR_GSO_UDP.  UDP super-packets are cut into independent
+ * datagrams, each with its own UDP header, the way e1000 does it; that is
+ * not what VIRTIO_NET_HDR_GSO_UDP (IP fragmentation) means to the peer, so
+ * they are always segmented in software.
+ */
+typedef struct NetGso {
+    uint8_t type;
+    uint16_t l3_off;    /* start of the IPv4 or IPv6 header */
+    uint16_t l4_off;    /* start of the TCP or UDP header */
+    uint16_t hdr_len;   /* length of all headers; the payload follows */
+    uint16_t mss;       /* largest payload of a segment */
+} NetGso;
+
+/*
+ * Called for each packet that leaves the segmenter.  @segs is the number
+ * of frames that the packet stands for on the wire: more than one when the
+ * super-packet was passed to the peer behind a virtio-net header.
+ */
+typedef void NetGsoSendFunc(void *opaque, const struct iovec *iov, int iovcnt,
+                            int segs);
+
+/**
+ * net_gso_send: transmit a super-packet
+ *
+ * @iov: the frame, starting with the Ethernet header
+ * @iovcnt: number of elements in @iov
+ * @gso: where the headers are and how to cut the payload
+ * @vnet_hdr: the peer expects a struct virtio_net_hdr in front of each
+ *            packet (see qemu_using_vnet_hdr())
+ * @send: called for each resulting packet
+ * @opaque: passed to @send
+ *
+ * With @vnet_hdr, TCP super-packets are passed through in one piece and the
+ * peer segments them.  Otherwise the payload is sliced into segments of at
+ * most @gso->mss bytes without copying it; only the headers are rewritten
+ * and checksummed for each segment.
+ *
+ * Returns the number of frames sent, or -1 if the headers are malformed.
+ */
+int net_gso_send(const struct iovec *iov, int iovcnt, const NetGso *gso,
+                 bool vnet_hdr, NetGsoSendFunc *send, void *opaque);
+
+#endif /* QEMU_NET_GSO_H */
@@ -46,6 +46,7 @@ typedef void (NetPoll)(NetClientState *, bool enable);
 typedef int (NetCanReceive)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef int (NetReceiveIOVBatch)(NetClientState *, const NetIOVPacket *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
@@ -63,6 +64,9 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    /* Returns how many of the packets were consumed; a short count means
+     * the client is full, like a zero return from receive_iov */
+    NetReceiveIOVBatch *receive_iov_batch;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
@@ -76,6 +80,15 @@ typedef struct NetClientInfo {
     SetVnetHdrLen *set_vnet_hdr_len;
 } NetClientInfo;
 
+/* Packets and bytes passed between a client and its peer */
+typedef struct NetClientStats {
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t dropped;
+} NetClientStats;
+
 struct NetClientState {
     NetClientInfo *info;
     int link_down;
@@ -89,6 +102,8 @@ struct NetClientState {
     NetClientDestructor *destructor;
     unsigned int queue_index;
     unsigned rxfilter_notify_enabled:1;
+    int vring_enable;
+    NetClientStats stats;
 };
 
 typedef struct NICState {
@@ -125,6 +140,10 @@ ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
                           int iovcnt);
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
+int qemu_sendv_packets_async(NetClientState *nc, const NetIOVPacket *pkts,
+                             int count, NetPacketSent *sent_cb);
+ssize_t qemu_sendv_packet_shared(NetClientState *nc, const struct iovec *iov,
+                                 int iovcnt, NetPacketBuf **shared);
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
@@ -155,6 +174,11 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
                             const struct iovec *iov,
                             int iovcnt,
                             void *opaque);
+int qemu_deliver_packet_iov_batch(NetClientState *sender,
+                                  unsigned flags,
+                                  const NetIOVPacket *pkts,
+                                  int count,
+                                  void *opaque);
 
 void print_net_client(Monitor *mon, NetClientState *nc);
 void do_info_network(Monitor *mon, const QDict *qdict);
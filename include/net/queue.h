@@ -28,9 +28,34 @@
 
 typedef struct NetPacket NetPacket;
 typedef struct NetQueue NetQueue;
+typedef struct NetPacketBuf NetPacketBuf;
 
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
+/* One packet of a batch, see qemu_sendv_packets_async() */
+typedef struct NetIOVPacket {
+    const struct iovec *iov;
+    int iovcnt;
+} NetIOVPacket;
+
+/* Buckets of the queueing delay histogram, see NetQueueStats */
+#define NET_QUEUE_LATENCY_BUCKETS 20
+
+/*
+ * Counters of a queue since its creation.  Bucket i of @latency counts
+ * packets that waited less than 2^i microseconds (the last bucket counts
+ * all the others) before they were delivered from the queue.  @len and
+ * @slots are the packets queued and the data slots allocated right now.
+ */
+typedef struct NetQueueStats {
+    uint64_t queued;
+    uint64_t dropped;
+    uint64_t purged;
+    uint32_t len;
+    uint32_t slots;
+    uint64_t latency[NET_QUEUE_LATENCY_BUCKETS];
+} NetQueueStats;
+
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
 
@@ -52,7 +77,25 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+ssize_t qemu_net_queue_send_shared(NetQueue *queue,
+                                   NetClientState *sender,
+                                   unsigned flags,
+                                   const struct iovec *iov,
+                                   int iovcnt,
+                                   NetPacketBuf **shared,
+                                   NetPacketSent *sent_cb);
+
+void qemu_net_packet_buf_unref(NetPacketBuf *buf);
+
+int qemu_net_queue_send_iov_batch(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const NetIOVPacket *pkts,
+                                  int count,
+                                  NetPacketSent *sent_cb);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats);
 
 #endif /* QEMU_NET_QUEUE_H */
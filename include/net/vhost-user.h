@@ -13,5 +13,6 @@
 
 struct vhost_net;
 struct vhost_net *vhost_user_get_vhost_net(NetClientState *nc);
+bool vhost_user_connected(NetClientState *nc);
 
 #endif /* VHOST_USER_H_ */
@@ -17,6 +17,7 @@ typedef struct VhostNetOptions {
 struct vhost_net *vhost_net_init(VhostNetOptions *options);
 
 bool vhost_net_query(VHostNetState *net, VirtIODevice *dev);
+uint64_t vhost_net_get_max_queues(VHostNetState *net);
 int vhost_net_start(VirtIODevice *dev, NetClientState *ncs, int total_queues);
 void vhost_net_stop(VirtIODevice *dev, NetClientState *ncs, int total_queues);
 
@@ -24,9 +25,14 @@ void vhost_net_cleanup(VHostNetState *net);
 
 unsigned vhost_net_get_features(VHostNetState *net, unsigned features);
 void vhost_net_ack_features(VHostNetState *net, unsigned features);
+unsigned vhost_net_get_acked_features(VHostNetState *net);
 
 bool vhost_net_virtqueue_pending(VHostNetState *net, int n);
 void vhost_net_virtqueue_mask(VHostNetState *net, VirtIODevice *dev,
                               int idx, bool mask);
 VHostNetState *get_vhost_net(NetClientState *nc);
+bool vhost_net_backend_connected(NetClientState *nc);
+void vhost_net_backend_lost(VHostNetState *net);
+
+int vhost_set_vring_enable(NetClientState *nc, int enable);
 #endif
@@ -0,0 +1,24 @@
+/*
+ * Toeplitz hash, as used for receive side scaling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_TOEPLITZ_H
+#define QEMU_TOEPLITZ_H
+
+#include "qemu-common.h"
+
+/* The key used by most NIC drivers, from Microsoft's RSS specification */
+#define TOEPLITZ_DEFAULT_KEY_SIZE 40
+extern const uint8_t toeplitz_default_key[TOEPLITZ_DEFAULT_KEY_SIZE];
+
+/*
+ * Hash @len bytes of @data with the secret @key.  Key bits past @key_len
+ * are taken as zero, so the key should be at least @len + 4 bytes long.
+ */
+uint32_t toeplitz_hash(const uint8_t *key, size_t key_len,
+                       const uint8_t *data, size_t len);
+
+#endif
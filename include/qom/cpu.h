@@ -211,6 +211,11 @@ struct kvm_run;
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @dirty_pages: Number of guest pages this CPU turned from clean to dirty
+ *           (only accounted by TCG, which traps the first write to a page).
+ * @throttle_exempt: Set by the migration code to skip this CPU when the
+ *           guest is being throttled.
+ * @throttle_thread_scheduled: A throttle sleep is queued on this CPU.
  *
  * State of one CPU core or thread.
  */
@@ -272,6 +277,10 @@ struct CPUState {
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
 
+    uint64_t dirty_pages;
+    bool throttle_exempt;
+    bool throttle_thread_scheduled;
+
     /* TODO Move common fields from CPUArchState here. */
     int cpu_index; /* used by alpha TCG */
     uint32_t halted; /* used by alpha, cris, ppc TCG */
@@ -505,6 +514,44 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
  */
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * cpu_throttle_set:
+ * @new_throttle_pct: Percent of sleep time. Valid range is 1 to 99.
+ *
+ * Throttles all vCPUs that are not idle and not marked with
+ * @throttle_exempt by forcing them to sleep for the given percentage
+ * of time. A throttle_percentage of 25 corresponds to a 75% duty cycle
+ * (example: 10ms sleep for every 30ms awake).
+ *
+ * cpu_throttle_set can be called as needed to adjust new_throttle_pct.
+ * Once the throttling starts, it will remain in effect until
+ * cpu_throttle_stop is called.
+ */
+void cpu_throttle_set(int new_throttle_pct);
+
+/**
+ * cpu_throttle_stop:
+ *
+ * Stops the vCPU throttling started by cpu_throttle_set.
+ */
+void cpu_throttle_stop(void);
+
+/**
+ * cpu_throttle_active:
+ *
+ * Returns: %true if the vCPUs are currently being throttled, %false otherwise.
+ */
+bool cpu_throttle_active(void);
+
+/**
+ * cpu_throttle_get_percentage:
+ *
+ * Returns the vCPU throttle percentage. See cpu_throttle_set for details.
+ *
+ * Returns: The throttle percentage in range 1 to 99, or 0 when inactive.
+ */
+int cpu_throttle_get_percentage(void);
+
 /**
  * qemu_get_cpu:
  * @index: The CPUState@cpu_index value of the CPU to obtain.
@@ -74,6 +74,7 @@ struct CharDriverState {
     void (*chr_set_echo)(struct CharDriverState *chr, bool echo);
     void (*chr_set_fe_open)(struct CharDriverState *chr, int fe_open);
     void (*chr_fe_event)(struct CharDriverState *chr, int event);
+    void (*chr_disconnect)(struct CharDriverState *chr);
     void *opaque;
     char *label;
     char *filename;
@@ -174,6 +175,14 @@ void qemu_chr_fe_printf(CharDriverState *s, const char *fmt, ...)
 int qemu_chr_fe_add_watch(CharDriverState *s, GIOCondition cond,
                           GIOFunc func, void *user_data);
 
+/**
+ * @qemu_chr_disconnect:
+ *
+ * Close the current connection of a socket backend.  A server socket goes
+ * back to listening for a new client.
+ */
+void qemu_chr_disconnect(CharDriverState *chr);
+
 /**
  * @qemu_chr_fe_write:
  *
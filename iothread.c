@@ -17,9 +17,15 @@
 #include "block/aio.h"
 #include "sysemu/iothread.h"
 #include "qmp-commands.h"
+#include "qapi/visitor.h"
 
 #define IOTHREADS_PATH "/objects"
 
+/* On NVMe drives, polling for up to 16-32 microseconds improves IOPS for
+ * both iodepth=1 and iodepth=32 workloads.
+ */
+#define IOTHREAD_POLL_MAX_NS_DEFAULT 32768ULL
+
 typedef ObjectClass IOThreadClass;
 
 #define IOTHREAD_GET_CLASS(obj) \
@@ -49,6 +55,50 @@ static void *iothread_run(void *opaque)
     return NULL;
 }
 
+static void iothread_get_poll_max_ns(Object *obj, Visitor *v, void *opaque,
+                                     const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    int64_t value = iothread->poll_max_ns;
+
+    visit_type_int(v, &value, name, errp);
+}
+
+static void iothread_set_poll_max_ns(Object *obj, Visitor *v, void *opaque,
+                                     const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int(v, &value, name, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (value < 0) {
+        error_setg(&local_err, "Property '%s.%s' doesn't take value '%"
+                   PRId64 "'", object_get_typename(obj), name, value);
+        goto out;
+    }
+    iothread->poll_max_ns = value;
+
+    if (iothread->ctx) {
+        aio_context_set_poll_params(iothread->ctx, value);
+    }
+out:
+    error_propagate(errp, local_err);
+}
+
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    object_property_add(obj, "poll-max-ns", "int",
+                        iothread_get_poll_max_ns,
+                        iothread_set_poll_max_ns, NULL, NULL, NULL);
+}
+
 static void iothread_instance_finalize(Object *obj)
 {
     IOThread *iothread = IOTHREAD(obj);
@@ -69,6 +119,8 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
     iothread->ctx = aio_context_new();
     iothread->thread_id = -1;
 
+    aio_context_set_poll_params(iothread->ctx, iothread->poll_max_ns);
+
     qemu_mutex_init(&iothread->init_done_lock);
     qemu_cond_init(&iothread->init_done_cond);
 
@@ -98,6 +150,7 @@ static const TypeInfo iothread_info = {
     .parent = TYPE_OBJECT,
     .class_init = iothread_class_init,
     .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
     .instance_finalize = iothread_instance_finalize,
     .interfaces = (InterfaceInfo[]) {
         {TYPE_USER_CREATABLE},
@@ -0,0 +1,378 @@
+/*
+ * QEMU live migration to and from a regular file
+ *
+ * The outgoing side stages the stream into large chunks that a small pool
+ * of threads writes out with pwrite(), so that several chunks are in flight
+ * towards the page cache and the disk while the migration thread keeps
+ * producing the stream.
+ *
+ * Writes honour the position they are given, so that with the mapped-ram
+ * capability guest pages land at a fixed offset of their RAMBlock's region
+ * and the incoming side can read whole regions back.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "qemu/iov.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "trace.h"
+
+#define FILE_CHUNK_SIZE    (4 * 1024 * 1024)
+#define FILE_WRITERS       4
+#define FILE_CHUNKS        (FILE_WRITERS * 2)
+
+typedef struct FileChunk {
+    uint8_t *buf;
+    size_t len;
+    int64_t offset;
+    QSIMPLEQ_ENTRY(FileChunk) next;
+} FileChunk;
+
+typedef struct QEMUFileParallel {
+    int fd;
+    QEMUFile *file;
+
+    /* Only used by the producer */
+    FileChunk *cur;
+    bool seeked;
+
+    /* Protected by lock */
+    QemuMutex lock;
+    QemuCond cond;
+    QSIMPLEQ_HEAD(, FileChunk) free_chunks;
+    QSIMPLEQ_HEAD(, FileChunk) pending_chunks;
+    int in_flight;
+    bool quit;
+    int error;
+
+    FileChunk chunks[FILE_CHUNKS];
+    QemuThread threads[FILE_WRITERS];
+} QEMUFileParallel;
+
+static ssize_t file_pwrite_all(int fd, const uint8_t *buf, size_t len,
+                               int64_t offset)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t ret = pwrite(fd, buf + done, len - done, offset + done);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+static void *file_writer_thread(void *opaque)
+{
+    QEMUFileParallel *s = opaque;
+    FileChunk *c;
+    ssize_t ret;
+
+    qemu_mutex_lock(&s->lock);
+    for (;;) {
+        while (QSIMPLEQ_EMPTY(&s->pending_chunks) && !s->quit) {
+            qemu_cond_wait(&s->cond, &s->lock);
+        }
+        c = QSIMPLEQ_FIRST(&s->pending_chunks);
+        if (!c) {
+            break;
+        }
+        QSIMPLEQ_REMOVE_HEAD(&s->pending_chunks, next);
+        qemu_mutex_unlock(&s->lock);
+
+        ret = file_pwrite_all(s->fd, c->buf, c->len, c->offset);
+        trace_migration_file_chunk_written(c->offset, c->len, ret);
+
+        qemu_mutex_lock(&s->lock);
+        if (ret < 0 && !s->error) {
+            s->error = ret;
+        }
+        c->len = 0;
+        s->in_flight--;
+        QSIMPLEQ_INSERT_TAIL(&s->free_chunks, c, next);
+        qemu_cond_broadcast(&s->cond);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+/* Hand the current chunk to the writers and grab an empty one */
+static int file_submit_chunk(QEMUFileParallel *s)
+{
+    FileChunk *c = s->cur;
+    int error;
+
+    qemu_mutex_lock(&s->lock);
+    s->in_flight++;
+    QSIMPLEQ_INSERT_TAIL(&s->pending_chunks, c, next);
+    qemu_cond_broadcast(&s->cond);
+
+    while (QSIMPLEQ_EMPTY(&s->free_chunks)) {
+        qemu_cond_wait(&s->cond, &s->lock);
+    }
+    s->cur = QSIMPLEQ_FIRST(&s->free_chunks);
+    QSIMPLEQ_REMOVE_HEAD(&s->free_chunks, next);
+    error = s->error;
+    qemu_mutex_unlock(&s->lock);
+
+    return error;
+}
+
+static ssize_t file_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
+                                  int64_t pos)
+{
+    QEMUFileParallel *s = opaque;
+    ssize_t size = iov_size(iov, iovcnt);
+    size_t done = 0;
+    size_t len;
+    int ret;
+
+    if (s->cur->len && pos != s->cur->offset + s->cur->len) {
+        /* A chunk only covers a contiguous range of the file */
+        s->seeked = true;
+        ret = file_submit_chunk(s);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    while (done < size) {
+        if (!s->cur->len) {
+            s->cur->offset = pos + done;
+        }
+        len = MIN(FILE_CHUNK_SIZE - s->cur->len, size - done);
+
+        iov_to_buf(iov, iovcnt, done, s->cur->buf + s->cur->len, len);
+        s->cur->len += len;
+        done += len;
+        if (s->cur->len == FILE_CHUNK_SIZE) {
+            ret = file_submit_chunk(s);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    return size;
+}
+
+/*
+ * Once the stream seeks, the same page may be written again by the next RAM
+ * iteration; wait for the writers so that two chunks covering it are never
+ * in flight at the same time.
+ */
+static int file_after_ram_iterate(QEMUFile *f, void *opaque, uint64_t flags)
+{
+    QEMUFileParallel *s = opaque;
+    int ret;
+
+    if (!s->seeked) {
+        return 0;
+    }
+
+    qemu_fflush(f);
+    if (s->cur->len) {
+        ret = file_submit_chunk(s);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    qemu_mutex_lock(&s->lock);
+    while (s->in_flight) {
+        qemu_cond_wait(&s->cond, &s->lock);
+    }
+    ret = s->error;
+    qemu_mutex_unlock(&s->lock);
+
+    return ret;
+}
+
+static int file_get_fd(void *opaque)
+{
+    QEMUFileParallel *s = opaque;
+
+    return s->fd;
+}
+
+/* The writers drain the pending chunks before they exit */
+static int file_finish(void *opaque)
+{
+    QEMUFileParallel *s = opaque;
+    int i;
+
+    if (s->cur->len) {
+        file_submit_chunk(s);
+    }
+
+    qemu_mutex_lock(&s->lock);
+    s->quit = true;
+    qemu_cond_broadcast(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+
+    for (i = 0; i < FILE_WRITERS; i++) {
+        qemu_thread_join(&s->threads[i]);
+    }
+
+    if (s->error) {
+        return s->error;
+    }
+    if (qemu_fdatasync(s->fd) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+
+static int file_close(void *opaque)
+{
+    QEMUFileParallel *s = opaque;
+    int ret = 0;
+    int i;
+
+    assert(s->quit);
+    if (close(s->fd) < 0) {
+        ret = -errno;
+    }
+
+    for (i = 0; i < FILE_CHUNKS; i++) {
+        qemu_vfree(s->chunks[i].buf);
+    }
+    qemu_cond_destroy(&s->cond);
+    qemu_mutex_destroy(&s->lock);
+    g_free(s);
+    return ret;
+}
+
+static const QEMUFileOps file_write_ops = {
+    .get_fd =            file_get_fd,
+    .writev_buffer =     file_writev_buffer,
+    .after_ram_iterate = file_after_ram_iterate,
+    .finish =            file_finish,
+    .close =             file_close,
+    .seekable =          true,
+};
+
+typedef struct QEMUFileReader {
+    int fd;
+    QEMUFile *file;
+} QEMUFileReader;
+
+static int file_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileReader *s = opaque;
+    ssize_t len;
+
+    do {
+        len = pread(s->fd, buf, size, pos);
+    } while (len < 0 && errno == EINTR);
+
+    return len < 0 ? -errno : len;
+}
+
+static int file_read_get_fd(void *opaque)
+{
+    QEMUFileReader *s = opaque;
+
+    return s->fd;
+}
+
+static int file_read_close(void *opaque)
+{
+    QEMUFileReader *s = opaque;
+    int ret = 0;
+
+    if (close(s->fd) < 0) {
+        ret = -errno;
+    }
+    g_free(s);
+    return ret;
+}
+
+static const QEMUFileOps file_read_ops = {
+    .get_fd =     file_read_get_fd,
+    .get_buffer = file_get_buffer,
+    .close =      file_read_close,
+    .seekable =   true,
+};
+
+static QEMUFile *qemu_fopen_parallel(int fd)
+{
+    QEMUFileParallel *s = g_malloc0(sizeof(*s));
+    int i;
+
+    s->fd = fd;
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->cond);
+    QSIMPLEQ_INIT(&s->free_chunks);
+    QSIMPLEQ_INIT(&s->pending_chunks);
+
+    for (i = 0; i < FILE_CHUNKS; i++) {
+        s->chunks[i].buf = qemu_memalign(getpagesize(), FILE_CHUNK_SIZE);
+        QSIMPLEQ_INSERT_TAIL(&s->free_chunks, &s->chunks[i], next);
+    }
+    s->cur = QSIMPLEQ_FIRST(&s->free_chunks);
+    QSIMPLEQ_REMOVE_HEAD(&s->free_chunks, next);
+
+    for (i = 0; i < FILE_WRITERS; i++) {
+        qemu_thread_create(&s->threads[i], "migration-file",
+                           file_writer_thread, s, QEMU_THREAD_JOINABLE);
+    }
+
+    s->file = qemu_fopen_ops(s, &file_write_ops);
+    return s->file;
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    int fd;
+
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    s->file = qemu_fopen_parallel(fd);
+    migrate_fd_connect(s);
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler2(qemu_get_fd(f), NULL, NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+void file_start_incoming_migration(const char *path, Error **errp)
+{
+    QEMUFileReader *s;
+    int fd;
+
+    fd = qemu_open(path, O_RDONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    s = g_malloc0(sizeof(*s));
+    s->fd = fd;
+    s->file = qemu_fopen_ops(s, &file_read_ops);
+
+    qemu_set_fd_handler2(fd, NULL, file_accept_incoming_migration, NULL,
+                         s->file);
+}
@@ -43,7 +43,11 @@ static void tcp_wait_for_connect(int fd, void *opaque)
         migrate_fd_error(s);
     } else {
         DPRINTF("migrate connect success\n");
-        s->file = qemu_fopen_socket(fd, "wb");
+        if (migrate_zero_copy_send()) {
+            s->file = qemu_fopen_socket_zerocopy(fd);
+        } else {
+            s->file = qemu_fopen_socket(fd, "wb");
+        }
         migrate_fd_connect(s);
     }
 }
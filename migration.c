@@ -23,6 +23,7 @@
 #include "qemu/sockets.h"
 #include "migration/block.h"
 #include "qemu/thread.h"
+#include "qom/cpu.h"
 #include "qmp-commands.h"
 #include "trace.h"
 
@@ -82,6 +83,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     else if (strstart(uri, "fd:", &p))
         fd_start_incoming_migration(p, errp);
+    else if (strstart(uri, "file:", &p))
+        file_start_incoming_migration(p, errp);
 #endif
     else {
         error_setg(errp, "unknown migration protocol: %s", uri);
@@ -217,6 +220,12 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->dirty_pages_rate = s->dirty_pages_rate;
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->dirty_sync_duration = s->dirty_sync_duration;
+
+        if (cpu_throttle_active()) {
+            info->has_cpu_throttle_percentage = true;
+            info->cpu_throttle_percentage = cpu_throttle_get_percentage();
+        }
 
         if (blk_mig_active()) {
             info->has_disk = true;
@@ -251,6 +260,7 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         info->ram->normal_bytes = norm_mig_bytes_transferred();
         info->ram->mbps = s->mbps;
         info->ram->dirty_sync_count = s->dirty_sync_count;
+        info->ram->dirty_sync_duration = s->dirty_sync_duration;
         break;
     case MIG_STATE_ERROR:
         info->has_status = true;
@@ -303,7 +313,10 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_thread_join(&s->thread);
         qemu_mutex_lock_iothread();
 
-        qemu_fclose(s->file);
+        if (qemu_fclose(s->file) < 0 && s->state == MIG_STATE_COMPLETED) {
+            /* Buffered data could not be written out */
+            migrate_set_state(s, MIG_STATE_COMPLETED, MIG_STATE_ERROR);
+        }
         s->file = NULL;
     }
 
@@ -340,6 +353,11 @@ static void migrate_fd_cancel(MigrationState *s)
         }
         migrate_set_state(s, old_state, MIG_STATE_CANCELLING);
     } while (s->state != MIG_STATE_CANCELLING);
+
+    /* Wake a migration thread waiting for its zero-copy sends to finish */
+    if (s->state == MIG_STATE_CANCELLING && s->file) {
+        qemu_file_set_error(s->file, -ECANCELED);
+    }
 }
 
 void add_migration_state_change_notifier(Notifier *notify)
@@ -357,6 +375,13 @@ bool migration_in_setup(MigrationState *s)
     return s->state == MIG_STATE_SETUP;
 }
 
+bool migration_is_active(MigrationState *s)
+{
+    return (s->state == MIG_STATE_SETUP ||
+            s->state == MIG_STATE_ACTIVE ||
+            s->state == MIG_STATE_CANCELLING);
+}
+
 bool migration_has_finished(MigrationState *s)
 {
     return s->state == MIG_STATE_COMPLETED;
@@ -427,6 +452,13 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    /* The measurement would clear dirty bits that migration still needs */
+    if (dirty_rate_is_measuring()) {
+        error_setg(errp, "Cannot migrate while the dirty page rate is "
+                   "being measured");
+        return;
+    }
+
     if (qemu_savevm_state_blocked(errp)) {
         return;
     }
@@ -436,6 +468,25 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    /* The source resumes the guest at the end, which only a file can take */
+    if (migrate_background_snapshot() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "Capability 'background-snapshot' requires a "
+                   "file: URI");
+        return;
+    }
+
+    if (migrate_mapped_ram()) {
+        if (!strstart(uri, "file:", NULL)) {
+            error_setg(errp, "Capability 'mapped-ram' requires a file: URI");
+            return;
+        }
+        if (migrate_use_xbzrle()) {
+            error_setg(errp, "Capability 'mapped-ram' is incompatible "
+                       "with 'xbzrle'");
+            return;
+        }
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -451,6 +502,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
 #endif
     } else {
         error_set(errp, QERR_INVALID_PARAMETER_VALUE, "uri", "a valid migration protocol");
@@ -547,6 +600,33 @@ bool migrate_auto_converge(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
+bool migrate_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+
 bool migrate_zero_blocks(void)
 {
     MigrationState *s;
@@ -584,7 +664,10 @@ static void *migration_thread(void *opaque)
     int64_t initial_bytes = 0;
     int64_t max_size = 0;
     int64_t start_time = initial_time;
+    int64_t end_time = 0;
     bool old_vm_running = false;
+    bool completed = false;
+    bool resumed = false;
 
     qemu_savevm_state_begin(s->file, &s->params);
 
@@ -621,7 +704,7 @@ static void *migration_thread(void *opaque)
                 }
 
                 if (!qemu_file_get_error(s->file)) {
-                    migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_COMPLETED);
+                    completed = true;
                     break;
                 }
             }
@@ -633,7 +716,8 @@ static void *migration_thread(void *opaque)
         }
         current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         if (current_time >= initial_time + BUFFER_DELAY) {
-            uint64_t transferred_bytes = qemu_ftell(s->file) - initial_bytes;
+            uint64_t transferred_bytes =
+                qemu_file_total_transferred(s->file) - initial_bytes;
             uint64_t time_spent = current_time - initial_time;
             double bandwidth = transferred_bytes / time_spent;
             max_size = bandwidth * migrate_max_downtime() / 1000000;
@@ -651,7 +735,7 @@ static void *migration_thread(void *opaque)
 
             qemu_file_reset_rate_limit(s->file);
             initial_time = current_time;
-            initial_bytes = qemu_ftell(s->file);
+            initial_bytes = qemu_file_total_transferred(s->file);
         }
         if (qemu_file_rate_limit(s->file)) {
             /* usleep expects microseconds */
@@ -659,19 +743,42 @@ static void *migration_thread(void *opaque)
         }
     }
 
+    if (completed) {
+        end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        if (migrate_background_snapshot() && old_vm_running) {
+            /* The snapshot has been taken, let the guest go on */
+            qemu_mutex_lock_iothread();
+            vm_start();
+            qemu_mutex_unlock_iothread();
+            resumed = true;
+        }
+    }
+
+    /* Whatever the file still has in flight is written out here rather than
+     * in the cleanup BH, so that the main loop never waits for the disk.
+     */
+    if (qemu_file_finish(s->file) < 0) {
+        migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
+    } else if (completed) {
+        migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_COMPLETED);
+    }
+
     qemu_mutex_lock_iothread();
     if (s->state == MIG_STATE_COMPLETED) {
-        int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-        uint64_t transferred_bytes = qemu_ftell(s->file);
+        uint64_t transferred_bytes = qemu_file_total_transferred(s->file);
         s->total_time = end_time - s->total_time;
         s->downtime = end_time - start_time;
         if (s->total_time) {
             s->mbps = (((double) transferred_bytes * 8.0) /
                        ((double) s->total_time)) / 1000;
         }
-        runstate_set(RUN_STATE_POSTMIGRATE);
+        if (!migrate_background_snapshot()) {
+            runstate_set(RUN_STATE_POSTMIGRATE);
+        } else if (!old_vm_running) {
+            runstate_set(RUN_STATE_PAUSED);
+        }
     } else {
-        if (old_vm_running) {
+        if (old_vm_running && !resumed) {
             vm_start();
         }
     }
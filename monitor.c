@@ -2868,6 +2868,13 @@ static mon_cmd_t info_cmds[] = {
         .help       = "show current migration xbzrle cache size",
         .mhandler.cmd = hmp_info_migrate_cache_size,
     },
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the guest dirty page rate measurement",
+        .mhandler.cmd = hmp_info_dirty_rate,
+    },
     {
         .name       = "balloon",
         .args_type  = "",
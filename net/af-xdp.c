@@ -0,0 +1,468 @@
+/*
+ * AF_XDP network backend
+ *
+ * Binds each queue of the netdev to one queue of a host NIC through an
+ * AF_XDP socket.  The UMEM that the kernel and the driver DMA into is
+ * allocated by QEMU; when the driver supports it the socket runs in
+ * zero-copy mode, otherwise the kernel copies (e.g. veth, or with
+ * force-copy=on).
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/if_link.h>
+#include <xdp/xsk.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "sysemu/sysemu.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+
+/* Packets moved between the rings and the peer in one go */
+#define AF_XDP_BATCH_SIZE 64
+
+typedef struct AFXDPState {
+    NetClientState      nc;
+
+    struct xsk_socket   *xsk;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    struct xsk_ring_cons cq;
+    struct xsk_ring_prod fq;
+
+    char                ifname[IFNAMSIZ];
+    int                 ifindex;
+    bool                read_poll;
+    bool                write_poll;
+    uint32_t            outstanding_tx;
+
+    /* Free UMEM frames, used as a stack */
+    uint64_t            *pool;
+    uint32_t            n_pool;
+    char                *buffer;
+    struct xsk_umem     *umem;
+
+    uint32_t            xdp_flags;
+} AFXDPState;
+
+static int af_xdp_can_send(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    return qemu_can_send_packet(&s->nc);
+}
+
+static void af_xdp_send(void *opaque);
+static void af_xdp_writable(void *opaque);
+
+static void af_xdp_update_fd_handler(AFXDPState *s)
+{
+    qemu_set_fd_handler2(xsk_socket__fd(s->xsk),
+                         s->read_poll  ? af_xdp_can_send : NULL,
+                         s->read_poll  ? af_xdp_send     : NULL,
+                         s->write_poll ? af_xdp_writable : NULL,
+                         s);
+}
+
+static void af_xdp_read_poll(AFXDPState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_write_poll(AFXDPState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_poll(NetClientState *nc, bool enable)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    if (s->read_poll != enable || s->write_poll != enable) {
+        s->write_poll = enable;
+        s->read_poll  = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+/* Take back the UMEM frames of packets that the NIC has sent */
+static void af_xdp_complete_tx(AFXDPState *s)
+{
+    uint32_t idx = 0;
+    uint32_t done, i;
+
+    done = xsk_ring_cons__peek(&s->cq, XSK_RING_CONS__DEFAULT_NUM_DESCS, &idx);
+    for (i = 0; i < done; i++) {
+        s->pool[s->n_pool++] = *xsk_ring_cons__comp_addr(&s->cq, idx++);
+    }
+
+    if (done) {
+        xsk_ring_cons__release(&s->cq, done);
+        s->outstanding_tx -= done;
+    }
+}
+
+/*
+ * The fd_write() callback, invoked when the TX ring has room again.
+ * Reclaim the frames that were sent and flush the queued packets.
+ */
+static void af_xdp_writable(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    af_xdp_complete_tx(s);
+    af_xdp_write_poll(s, false);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static void af_xdp_kick_tx(AFXDPState *s)
+{
+    if (xsk_ring_prod__needs_wakeup(&s->tx)) {
+        sendto(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+}
+
+/* Copy a packet into a free frame and put it on the TX ring */
+static bool af_xdp_tx_fill(AFXDPState *s, const struct iovec *iov,
+                           int iovcnt)
+{
+    struct xdp_desc *desc;
+    uint32_t idx = 0;
+    uint64_t addr;
+
+    if (!s->n_pool) {
+        af_xdp_complete_tx(s);
+    }
+    if (!s->n_pool || !xsk_ring_prod__reserve(&s->tx, 1, &idx)) {
+        return false;
+    }
+
+    addr = s->pool[--s->n_pool];
+    desc = xsk_ring_prod__tx_desc(&s->tx, idx);
+    desc->addr = addr;
+    desc->len = iov_to_buf(iov, iovcnt, 0, xsk_umem__get_data(s->buffer, addr),
+                           XSK_UMEM__DEFAULT_FRAME_SIZE);
+    xsk_ring_prod__submit(&s->tx, 1);
+    s->outstanding_tx++;
+
+    return true;
+}
+
+static ssize_t af_xdp_receive_iov(NetClientState *nc,
+                                  const struct iovec *iov, int iovcnt)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
+
+    if (size > XSK_UMEM__DEFAULT_FRAME_SIZE) {
+        /* Drop, it does not fit in a frame. */
+        return size;
+    }
+
+    if (!af_xdp_tx_fill(s, iov, iovcnt)) {
+        /* Out of frames or TX ring space, wait until the NIC catches up. */
+        af_xdp_write_poll(s, true);
+        return 0;
+    }
+
+    af_xdp_kick_tx(s);
+    return size;
+}
+
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_xdp_receive_iov(nc, &iov, 1);
+}
+
+/* Fill the TX ring with as many packets as fit, then kick once */
+static int af_xdp_receive_iov_batch(NetClientState *nc,
+                                    const NetIOVPacket *pkts, int count)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    int done;
+
+    for (done = 0; done < count; done++) {
+        if (iov_size(pkts[done].iov, pkts[done].iovcnt) >
+            XSK_UMEM__DEFAULT_FRAME_SIZE) {
+            continue;
+        }
+        if (!af_xdp_tx_fill(s, pkts[done].iov, pkts[done].iovcnt)) {
+            af_xdp_write_poll(s, true);
+            break;
+        }
+    }
+
+    if (done) {
+        af_xdp_kick_tx(s);
+    }
+
+    return done;
+}
+
+/* Give free frames to the fill ring, so that the NIC can receive into them */
+static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
+{
+    uint32_t i, idx = 0;
+
+    /* Keep one frame for TX, so that sending is never starved. */
+    if (s->n_pool <= n) {
+        n = s->n_pool ? s->n_pool - 1 : 0;
+    }
+
+    if (!n || !xsk_ring_prod__reserve(&s->fq, n, &idx)) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        *xsk_ring_prod__fill_addr(&s->fq, idx++) = s->pool[--s->n_pool];
+    }
+    xsk_ring_prod__submit(&s->fq, n);
+
+    if (xsk_ring_prod__needs_wakeup(&s->fq)) {
+        recvfrom(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+
+static void af_xdp_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    af_xdp_read_poll(s, true);
+}
+
+static void af_xdp_send(void *opaque)
+{
+    AFXDPState *s = opaque;
+    struct iovec iov[AF_XDP_BATCH_SIZE];
+    NetIOVPacket pkts[AF_XDP_BATCH_SIZE];
+    const struct xdp_desc *desc;
+    uint32_t idx = 0;
+    uint32_t n, i;
+    int sent;
+
+    n = xsk_ring_cons__peek(&s->rx, AF_XDP_BATCH_SIZE, &idx);
+    if (!n) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        desc = xsk_ring_cons__rx_desc(&s->rx, idx + i);
+        iov[i].iov_base = xsk_umem__get_data(s->buffer, desc->addr);
+        iov[i].iov_len = desc->len;
+        pkts[i].iov = &iov[i];
+        pkts[i].iovcnt = 1;
+    }
+
+    sent = qemu_sendv_packets_async(&s->nc, pkts, n, af_xdp_send_completed);
+    if (sent < n) {
+        /* pkts[sent] was queued (the queue copies it); leave the packets
+         * after it on the ring until the peer drains. */
+        xsk_ring_cons__cancel(&s->rx, n - sent - 1);
+        n = sent + 1;
+        af_xdp_read_poll(s, false);
+    }
+
+    /* Everything up to n has been copied out, recycle the frames. */
+    for (i = 0; i < n; i++) {
+        desc = xsk_ring_cons__rx_desc(&s->rx, idx + i);
+        s->pool[s->n_pool++] = xsk_umem__extract_addr(desc->addr);
+    }
+    xsk_ring_cons__release(&s->rx, n);
+    af_xdp_fq_refill(s, n);
+}
+
+static void af_xdp_cleanup(NetClientState *nc)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    if (s->xsk) {
+        af_xdp_poll(nc, false);
+        xsk_socket__delete(s->xsk);
+        s->xsk = NULL;
+    }
+    if (s->umem) {
+        xsk_umem__delete(s->umem);
+        s->umem = NULL;
+    }
+    g_free(s->pool);
+    s->pool = NULL;
+    qemu_vfree(s->buffer);
+    s->buffer = NULL;
+}
+
+static int af_xdp_umem_create(AFXDPState *s)
+{
+    struct xsk_umem_config config = {
+        .fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE,
+        .frame_headroom = 0,
+    };
+    uint64_t n_descs;
+    uint64_t size;
+    int64_t i;
+    int ret;
+
+    /* Enough frames for all four rings, twice over */
+    n_descs = (XSK_RING_PROD__DEFAULT_NUM_DESCS
+               + XSK_RING_CONS__DEFAULT_NUM_DESCS) * 2;
+    size = n_descs * XSK_UMEM__DEFAULT_FRAME_SIZE;
+
+    s->buffer = qemu_memalign(getpagesize(), size);
+    memset(s->buffer, 0, size);
+
+    ret = xsk_umem__create(&s->umem, s->buffer, size, &s->fq, &s->cq,
+                           &config);
+    if (ret) {
+        error_report("af-xdp: failed to create umem for '%s': %s",
+                     s->ifname, strerror(-ret));
+        s->umem = NULL;
+        return -1;
+    }
+
+    s->pool = g_new(uint64_t, n_descs);
+    /* Fill the pool in reverse, it is popped from the end. */
+    for (i = n_descs - 1; i >= 0; i--) {
+        s->pool[i] = i * XSK_UMEM__DEFAULT_FRAME_SIZE;
+    }
+    s->n_pool = n_descs;
+
+    return 0;
+}
+
+static int af_xdp_socket_create(AFXDPState *s,
+                                const NetdevAFXDPOptions *opts)
+{
+    struct xsk_socket_config cfg = {
+        .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .libxdp_flags = 0,
+        .bind_flags = XDP_USE_NEED_WAKEUP,
+        .xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST,
+    };
+    int queue_id = s->nc.queue_index;
+    int ret;
+
+    if (opts->has_force_copy && opts->force_copy) {
+        cfg.bind_flags |= XDP_COPY;
+    }
+    if (opts->has_start_queue) {
+        queue_id += opts->start_queue;
+    }
+
+    if (opts->has_mode) {
+        cfg.xdp_flags |= opts->mode == AFXDP_MODE_NATIVE ? XDP_FLAGS_DRV_MODE
+                                                         : XDP_FLAGS_SKB_MODE;
+        ret = xsk_socket__create(&s->xsk, s->ifname, queue_id, s->umem,
+                                 &s->rx, &s->tx, &cfg);
+    } else {
+        /* Prefer native mode, which can do zero-copy; fall back to skb. */
+        cfg.xdp_flags |= XDP_FLAGS_DRV_MODE;
+        ret = xsk_socket__create(&s->xsk, s->ifname, queue_id, s->umem,
+                                 &s->rx, &s->tx, &cfg);
+        if (ret) {
+            cfg.xdp_flags &= ~XDP_FLAGS_DRV_MODE;
+            cfg.xdp_flags |= XDP_FLAGS_SKB_MODE;
+            ret = xsk_socket__create(&s->xsk, s->ifname, queue_id, s->umem,
+                                     &s->rx, &s->tx, &cfg);
+        }
+    }
+
+    if (ret) {
+        error_report("af-xdp: failed to create socket for '%s' queue %d: %s",
+                     s->ifname, queue_id, strerror(-ret));
+        s->xsk = NULL;
+        return -1;
+    }
+
+    s->xdp_flags = cfg.xdp_flags;
+    return 0;
+}
+
+static NetClientInfo net_af_xdp_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_AF_XDP,
+    .size = sizeof(AFXDPState),
+    .receive = af_xdp_receive,
+    .receive_iov = af_xdp_receive_iov,
+    .receive_iov_batch = af_xdp_receive_iov_batch,
+    .poll = af_xdp_poll,
+    .cleanup = af_xdp_cleanup,
+};
+
+/* The exported init function
+ *
+ * ... -netdev af-xdp,id=...,ifname="..."[,queues=n][,start-queue=m]
+ */
+int net_init_af_xdp(const NetClientOptions *opts,
+                    const char *name, NetClientState *peer)
+{
+    const NetdevAFXDPOptions *xdp_opts = opts->af_xdp;
+    NetClientState *nc, *nc0 = NULL;
+    unsigned int ifindex;
+    int64_t queues, i;
+    AFXDPState *s;
+
+    ifindex = if_nametoindex(xdp_opts->ifname);
+    if (!ifindex) {
+        error_report("af-xdp: no such interface '%s'", xdp_opts->ifname);
+        return -1;
+    }
+
+    queues = xdp_opts->has_queues ? xdp_opts->queues : 1;
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_report("af-xdp: invalid number of queues %" PRId64, queues);
+        return -1;
+    }
+    if (xdp_opts->has_start_queue && xdp_opts->start_queue < 0) {
+        error_report("af-xdp: invalid start queue %" PRId64,
+                     xdp_opts->start_queue);
+        return -1;
+    }
+
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_af_xdp_info, peer, "af-xdp", name);
+        nc->queue_index = i;
+        if (!nc0) {
+            nc0 = nc;
+        }
+
+        s = DO_UPCAST(AFXDPState, nc, nc);
+        pstrcpy(s->ifname, sizeof(s->ifname), xdp_opts->ifname);
+        s->ifindex = ifindex;
+
+        if (af_xdp_umem_create(s) || af_xdp_socket_create(s, xdp_opts)) {
+            qemu_del_net_client(nc0);
+            return -1;
+        }
+        af_xdp_fq_refill(s, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+
+        snprintf(nc->info_str, sizeof(nc->info_str),
+                 "af-xdp: ifname=%s queue=%d mode=%s", s->ifname,
+                 (int)(i + (xdp_opts->has_start_queue ?
+                            xdp_opts->start_queue : 0)),
+                 s->xdp_flags & XDP_FLAGS_DRV_MODE ? "native" : "skb");
+
+        af_xdp_read_poll(s, true);
+    }
+
+    return 0;
+}
@@ -16,26 +16,135 @@
  */
 
 #include "qemu-common.h"
+#include "qemu/bswap.h"
 #include "net/checksum.h"
 
 #define PROTO_TCP  6
 #define PROTO_UDP 17
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+/*
+ * The Internet checksum does not depend on byte order (RFC 1071), so the
+ * helpers below add up the buffer in host order, 32 bits at a time, into a
+ * 64-bit accumulator.  The result is folded and converted back to the
+ * big-endian 16-bit words of the protocol at the end.
+ */
+static uint64_t net_checksum_sum_generic(const uint8_t *buf, size_t len)
 {
-    uint32_t sum = 0;
-    int i;
+    uint64_t sum = 0;
+
+    while (len >= 16) {
+        sum += (uint32_t)ldl_he_p(buf);
+        sum += (uint32_t)ldl_he_p(buf + 4);
+        sum += (uint32_t)ldl_he_p(buf + 8);
+        sum += (uint32_t)ldl_he_p(buf + 12);
+        buf += 16;
+        len -= 16;
+    }
+    while (len >= 4) {
+        sum += (uint32_t)ldl_he_p(buf);
+        buf += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        sum += (uint16_t)lduw_he_p(buf);
+        buf += 2;
+        len -= 2;
+    }
+    if (len) {
+        uint16_t last = 0;
 
-    for (i = seq; i < seq + len; i++) {
-        if (i & 1) {
-            sum += (uint32_t)buf[i - seq];
-        } else {
-            sum += (uint32_t)buf[i - seq] << 8;
-        }
+        /* the odd byte is the first half of a zero padded word */
+        memcpy(&last, buf, 1);
+        sum += last;
     }
     return sum;
 }
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static uint64_t net_checksum_sum_sse2(const uint8_t *buf, size_t len)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    uint64_t lanes[2];
+    size_t i, n = len & ~(size_t)15;
+
+    /* Widen each 32-bit word to 64 bits so the lanes cannot overflow */
+    for (i = 0; i < n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+    }
+    _mm_storeu_si128((__m128i *)lanes, acc);
+
+    return lanes[0] + lanes[1] + net_checksum_sum_generic(buf + n, len - n);
+}
+
+static uint64_t (*net_checksum_sum)(const uint8_t *buf, size_t len) =
+    net_checksum_sum_sse2;
+#else
+static uint64_t (*net_checksum_sum)(const uint8_t *buf, size_t len) =
+    net_checksum_sum_generic;
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static uint64_t net_checksum_sum_avx2(const uint8_t *buf, size_t len)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    uint64_t lanes[4];
+    size_t i, n = len & ~(size_t)31;
+
+    for (i = 0; i < n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(v, zero));
+        acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(v, zero));
+    }
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           net_checksum_sum_generic(buf + n, len - n);
+}
+#pragma GCC pop_options
+
+static void __attribute__((constructor)) net_checksum_init(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        net_checksum_sum = net_checksum_sum_avx2;
+    }
+}
+#endif
+
+/* Fold a host order sum into a big-endian 16-bit partial checksum */
+static uint32_t net_checksum_fold(uint64_t sum, int seq)
+{
+    uint16_t res;
+
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    res = be16_to_cpu(sum);
+
+    /* data starting at an odd offset has its bytes in the other halves */
+    return (seq & 1) ? bswap16(res) : res;
+}
+
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    if (len <= 0) {
+        return 0;
+    }
+    return net_checksum_fold(net_checksum_sum(buf, len), seq);
+}
+
 uint16_t net_checksum_finish(uint32_t sum)
 {
     while (sum>>16)
@@ -90,22 +199,21 @@ uint32_t
 net_checksum_add_iov(const struct iovec *iov, const unsigned int iov_cnt,
                      uint32_t iov_off, uint32_t size)
 {
-    size_t iovec_off, buf_off;
+    size_t iovec_off;
     unsigned int i;
     uint32_t res = 0;
     uint32_t seq = 0;
 
+    /* Each chunk is summed in place, whatever its alignment in the packet */
     iovec_off = 0;
-    buf_off = 0;
     for (i = 0; i < iov_cnt && size; i++) {
         if (iov_off < (iovec_off + iov[i].iov_len)) {
             size_t len = MIN((iovec_off + iov[i].iov_len) - iov_off , size);
             void *chunk_buf = iov[i].iov_base + (iov_off - iovec_off);
 
-            res += net_checksum_add_cont(len, chunk_buf, seq);
+            res += net_checksum_fold(net_checksum_sum(chunk_buf, len), seq);
             seq += len;
 
-            buf_off += len;
             iov_off += len;
             size -= len;
         }
@@ -59,6 +59,11 @@ int net_init_netmap(const NetClientOptions *opts, const char *name,
                     NetClientState *peer);
 #endif
 
+#ifdef CONFIG_AF_XDP
+int net_init_af_xdp(const NetClientOptions *opts, const char *name,
+                    NetClientState *peer);
+#endif
+
 int net_init_vhost_user(const NetClientOptions *opts, const char *name,
                         NetClientState *peer);
 
@@ -0,0 +1,237 @@
+/*
+ * Software segmentation of TCP and UDP super-packets for emulated NICs
+ *
+ * e1000, rtl8139 and vmxnet3 all let the guest hand over one large TCP
+ * packet plus a segment size.  This is the code that turns it into wire
+ * frames for them: either by passing it on to a peer that understands
+ * struct virtio_net_hdr (tap with vnet_hdr=on), or by cutting the payload
+ * into iovec slices that are sent behind a rewritten copy of the headers.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "net/checksum.h"
+#include "net/eth.h"
+#include "net/gso.h"
+#include "net/tap.h"
+
+#define GSO_IP4_LEN_OFF     2
+#define GSO_IP4_ID_OFF      4
+#define GSO_IP4_CSUM_OFF    10
+#define GSO_IP4_ADDR_OFF    12
+#define GSO_IP6_PLEN_OFF    4
+#define GSO_IP6_ADDR_OFF    8
+#define GSO_IP6_HDR_LEN     40
+
+#define GSO_TCP_SEQ_OFF     4
+#define GSO_TCP_FLAGS_OFF   13
+#define GSO_TCP_CSUM_OFF    16
+#define GSO_TCP_HDR_LEN     20
+#define GSO_TCP_FIN         0x01
+#define GSO_TCP_PSH         0x08
+
+#define GSO_UDP_LEN_OFF     4
+#define GSO_UDP_CSUM_OFF    6
+#define GSO_UDP_HDR_LEN     8
+
+static bool net_gso_is_udp(const NetGso *gso)
+{
+    return gso->type == VIRTIO_NET_HDR_GSO_UDP;
+}
+
+static bool net_gso_is_ipv4(const uint8_t *hdr, const NetGso *gso)
+{
+    return (hdr[gso->l3_off] >> 4) == IP_HEADER_VERSION_4;
+}
+
+static bool net_gso_check(const uint8_t *hdr, const NetGso *gso, size_t size)
+{
+    unsigned int l3_len = gso->l4_off - gso->l3_off;
+    unsigned int l4_min = net_gso_is_udp(gso) ? GSO_UDP_HDR_LEN
+                                              : GSO_TCP_HDR_LEN;
+
+    if (gso->hdr_len > NET_GSO_MAX_HDR_LEN || gso->hdr_len > size ||
+        gso->l4_off <= gso->l3_off || gso->l4_off + l4_min > gso->hdr_len ||
+        !gso->mss) {
+        return false;
+    }
+    if (net_gso_is_ipv4(hdr, gso)) {
+        return l3_len >= sizeof(struct ip_header);
+    }
+    return (hdr[gso->l3_off] >> 4) == IP_HEADER_VERSION_6 &&
+           l3_len >= GSO_IP6_HDR_LEN;
+}
+
+/* Partial sum of the pseudo header for @l4_len bytes of TCP or UDP */
+static uint32_t net_gso_pseudo_sum(uint8_t *hdr, const NetGso *gso,
+                                   uint32_t l4_len)
+{
+    uint8_t *ip = hdr + gso->l3_off;
+    uint32_t sum;
+
+    if (net_gso_is_ipv4(hdr, gso)) {
+        sum = net_checksum_add(8, ip + GSO_IP4_ADDR_OFF);
+    } else {
+        sum = net_checksum_add(32, ip + GSO_IP6_ADDR_OFF);
+    }
+    sum += net_gso_is_udp(gso) ? IP_PROTO_UDP : IP_PROTO_TCP;
+    sum += (l4_len >> 16) + (l4_len & 0xffff);
+    return sum;
+}
+
+/* Set up the IP header for @payload bytes after the headers */
+static void net_gso_fix_ip(uint8_t *hdr, const NetGso *gso, uint32_t payload,
+                           uint16_t id_inc)
+{
+    uint8_t *ip = hdr + gso->l3_off;
+    uint32_t len = gso->hdr_len - gso->l3_off + payload;
+
+    if (net_gso_is_ipv4(hdr, gso)) {
+        stw_be_p(ip + GSO_IP4_LEN_OFF, len);
+        stw_be_p(ip + GSO_IP4_ID_OFF,
+                 lduw_be_p(ip + GSO_IP4_ID_OFF) + id_inc);
+        stw_be_p(ip + GSO_IP4_CSUM_OFF, 0);
+        stw_be_p(ip + GSO_IP4_CSUM_OFF,
+                 net_raw_checksum(ip, gso->l4_off - gso->l3_off));
+    } else {
+        stw_be_p(ip + GSO_IP6_PLEN_OFF, len - GSO_IP6_HDR_LEN);
+    }
+}
+
+/*
+ * Hand the whole super-packet to the peer.  The checksum field gets the
+ * pseudo header sum, as with VIRTIO_NET_HDR_F_NEEDS_CSUM from a guest.
+ */
+static int net_gso_pass(uint8_t *hdr, const struct iovec *iov, int iovcnt,
+                        const NetGso *gso, uint32_t payload, struct iovec *out,
+                        NetGsoSendFunc *send, void *opaque)
+{
+    struct virtio_net_hdr vhdr;
+    uint32_t l4_len = gso->hdr_len - gso->l4_off + payload;
+    int segs = DIV_ROUND_UP(payload, gso->mss);
+    int cnt;
+
+    net_gso_fix_ip(hdr, gso, payload, 0);
+    stw_be_p(hdr + gso->l4_off + GSO_TCP_CSUM_OFF,
+             ~net_checksum_finish(net_gso_pseudo_sum(hdr, gso, l4_len)));
+
+    memset(&vhdr, 0, sizeof(vhdr));
+    vhdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    vhdr.gso_type = gso->type;
+    vhdr.hdr_len = gso->hdr_len;
+    vhdr.gso_size = gso->mss;
+    vhdr.csum_start = gso->l4_off;
+    vhdr.csum_offset = GSO_TCP_CSUM_OFF;
+
+    out[0].iov_base = &vhdr;
+    out[0].iov_len = sizeof(vhdr);
+    out[1].iov_base = hdr;
+    out[1].iov_len = gso->hdr_len;
+    cnt = iov_copy(out + 2, iovcnt, iov, iovcnt, gso->hdr_len, payload);
+
+    send(opaque, out, cnt + 2, segs);
+    return segs;
+}
+
+static int net_gso_segment(uint8_t *hdr, const struct iovec *iov, int iovcnt,
+                           const NetGso *gso, uint32_t payload, bool vnet_hdr,
+                           struct iovec *out, NetGsoSendFunc *send,
+                           void *opaque)
+{
+    static const struct virtio_net_hdr zero_vhdr;
+    uint8_t seg_hdr[NET_GSO_MAX_HDR_LEN];
+    uint8_t *l4 = seg_hdr + gso->l4_off;
+    unsigned int l4_hdr_len = gso->hdr_len - gso->l4_off;
+    unsigned int csum_off;
+    uint32_t off, seg_len, l4_len, sum;
+    uint16_t csum;
+    int first = 0, segs = 0;
+    int cnt;
+
+    if (vnet_hdr) {
+        out[0].iov_base = (void *)&zero_vhdr;
+        out[0].iov_len = sizeof(zero_vhdr);
+        first = 1;
+    }
+    out[first].iov_base = seg_hdr;
+    out[first].iov_len = gso->hdr_len;
+
+    off = 0;
+    do {
+        seg_len = MIN(gso->mss, payload - off);
+        l4_len = l4_hdr_len + seg_len;
+
+        memcpy(seg_hdr, hdr, gso->hdr_len);
+        net_gso_fix_ip(seg_hdr, gso, seg_len, segs);
+
+        if (net_gso_is_udp(gso)) {
+            stw_be_p(l4 + GSO_UDP_LEN_OFF, l4_len);
+            csum_off = GSO_UDP_CSUM_OFF;
+        } else {
+            stl_be_p(l4 + GSO_TCP_SEQ_OFF,
+                     ldl_be_p(l4 + GSO_TCP_SEQ_OFF) + off);
+            if (off + seg_len < payload) {
+                l4[GSO_TCP_FLAGS_OFF] &= ~(GSO_TCP_FIN | GSO_TCP_PSH);
+            }
+            csum_off = GSO_TCP_CSUM_OFF;
+        }
+
+        /* The payload is summed where it lies, like it is sent */
+        stw_be_p(l4 + csum_off, 0);
+        sum = net_gso_pseudo_sum(seg_hdr, gso, l4_len);
+        sum += net_checksum_add(l4_hdr_len, l4);
+        sum += net_checksum_add_iov(iov, iovcnt, gso->hdr_len + off, seg_len);
+        csum = net_checksum_finish(sum);
+        if (net_gso_is_udp(gso) && !csum) {
+            csum = 0xffff;
+        }
+        stw_be_p(l4 + csum_off, csum);
+
+        cnt = iov_copy(out + first + 1, iovcnt, iov, iovcnt,
+                       gso->hdr_len + off, seg_len);
+        send(opaque, out, first + 1 + cnt, 1);
+
+        off += seg_len;
+        segs++;
+    } while (off < payload);
+
+    return segs;
+}
+
+int net_gso_send(const struct iovec *iov, int iovcnt, const NetGso *gso,
+                 bool vnet_hdr, NetGsoSendFunc *send, void *opaque)
+{
+    uint8_t hdr[NET_GSO_MAX_HDR_LEN];
+    size_t size = iov_size(iov, iovcnt);
+    uint32_t payload;
+    struct iovec *out;
+    int segs;
+
+    if (gso->hdr_len > MIN(size, sizeof(hdr))) {
+        return -1;
+    }
+    iov_to_buf(iov, iovcnt, 0, hdr, gso->hdr_len);
+    if (!net_gso_check(hdr, gso, size)) {
+        return -1;
+    }
+    payload = size - gso->hdr_len;
+
+    /* A slice never needs more elements than the whole frame */
+    out = g_new(struct iovec, iovcnt + 2);
+
+    if (vnet_hdr && !net_gso_is_udp(gso) && payload > gso->mss &&
+        size - gso->l3_off <= ETH_MAX_IP_DGRAM_LEN) {
+        segs = net_gso_pass(hdr, iov, iovcnt, gso, payload, out, send, opaque);
+    } else {
+        segs = net_gso_segment(hdr, iov, iovcnt, gso, payload, vnet_hdr, out,
+                               send, opaque);
+    }
+
+    g_free(out);
+    return segs;
+}
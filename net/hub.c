@@ -42,35 +42,40 @@ struct NetHub {
 
 static QLIST_HEAD(, NetHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
 
-static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
-                               const uint8_t *buf, size_t len)
+/*
+ * Every port gets the same packet.  Ports whose peer takes it right away
+ * read it where it is; for the others it is queued once and the copy is
+ * shared between their queues.
+ */
+static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
+                                   const struct iovec *iov, int iovcnt)
 {
     NetHubPort *port;
+    NetPacketBuf *shared = NULL;
+    ssize_t len = iov_size(iov, iovcnt);
 
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
             continue;
         }
 
-        qemu_send_packet(&port->nc, buf, len);
+        qemu_sendv_packet_shared(&port->nc, iov, iovcnt, &shared);
+    }
+    if (shared) {
+        qemu_net_packet_buf_unref(shared);
     }
     return len;
 }
 
-static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
-                                   const struct iovec *iov, int iovcnt)
+static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
+                               const uint8_t *buf, size_t len)
 {
-    NetHubPort *port;
-    ssize_t len = iov_size(iov, iovcnt);
-
-    QLIST_FOREACH(port, &hub->ports, next) {
-        if (port == source_port) {
-            continue;
-        }
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = len,
+    };
 
-        qemu_sendv_packet(&port->nc, iov, iovcnt);
-    }
-    return len;
+    return net_hub_receive_iov(hub, source_port, &iov, 1);
 }
 
 static NetHub *net_hub_new(int id)
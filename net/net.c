@@ -465,6 +465,23 @@ int qemu_can_send_packet(NetClientState *sender)
     return 1;
 }
 
+/*
+ * Count a packet that @sender handed to @nc.  Like the rest of the net
+ * layer this runs under the iothread lock, so plain increments will do.
+ */
+static void qemu_net_account(NetClientState *sender, NetClientState *nc,
+                             ssize_t ret)
+{
+    if (ret < 0) {
+        nc->stats.dropped++;
+    } else if (ret > 0) {
+        sender->stats.tx_packets++;
+        sender->stats.tx_bytes += ret;
+        nc->stats.rx_packets++;
+        nc->stats.rx_bytes += ret;
+    }
+}
+
 ssize_t qemu_deliver_packet(NetClientState *sender,
                             unsigned flags,
                             const uint8_t *data,
@@ -475,6 +492,7 @@ ssize_t qemu_deliver_packet(NetClientState *sender,
     ssize_t ret;
 
     if (nc->link_down) {
+        nc->stats.dropped++;
         return size;
     }
 
@@ -491,6 +509,7 @@ ssize_t qemu_deliver_packet(NetClientState *sender,
     if (ret == 0) {
         nc->receive_disabled = 1;
     }
+    qemu_net_account(sender, nc, ret);
 
     return ret;
 }
@@ -534,6 +553,7 @@ static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
 #endif
 
     if (sender->link_down || !sender->peer) {
+        sender->stats.dropped++;
         return size;
     }
 
@@ -582,6 +602,7 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     int ret;
 
     if (nc->link_down) {
+        nc->stats.dropped++;
         return iov_size(iov, iovcnt);
     }
 
@@ -598,10 +619,50 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     if (ret == 0) {
         nc->receive_disabled = 1;
     }
+    qemu_net_account(sender, nc, ret);
 
     return ret;
 }
 
+int qemu_deliver_packet_iov_batch(NetClientState *sender,
+                                  unsigned flags,
+                                  const NetIOVPacket *pkts,
+                                  int count,
+                                  void *opaque)
+{
+    NetClientState *nc = opaque;
+    int done, i;
+
+    if (nc->link_down) {
+        nc->stats.dropped += count;
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    if (!nc->info->receive_iov_batch) {
+        for (done = 0; done < count; done++) {
+            if (qemu_deliver_packet_iov(sender, flags, pkts[done].iov,
+                                        pkts[done].iovcnt, opaque) == 0) {
+                break;
+            }
+        }
+        return done;
+    }
+
+    done = nc->info->receive_iov_batch(nc, pkts, count);
+    if (done < count) {
+        nc->receive_disabled = 1;
+    }
+    for (i = 0; i < done; i++) {
+        qemu_net_account(sender, nc, iov_size(pkts[i].iov, pkts[i].iovcnt));
+    }
+
+    return done;
+}
+
 ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                 const struct iovec *iov, int iovcnt,
                                 NetPacketSent *sent_cb)
@@ -609,6 +670,7 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
     NetQueue *queue;
 
     if (sender->link_down || !sender->peer) {
+        sender->stats.dropped++;
         return iov_size(iov, iovcnt);
     }
 
@@ -619,12 +681,61 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                    iov, iovcnt, sent_cb);
 }
 
+/*
+ * Send @count packets at once, letting the peer take them in a single call
+ * when it implements receive_iov_batch.
+ *
+ * Returns how many packets were sent.  When that is less than @count, the
+ * next packet was queued and @sent_cb will be called for it; the caller
+ * must not send the remaining ones until then.
+ */
+int qemu_sendv_packets_async(NetClientState *sender,
+                             const NetIOVPacket *pkts, int count,
+                             NetPacketSent *sent_cb)
+{
+    NetQueue *queue;
+
+    if (sender->link_down || !sender->peer) {
+        sender->stats.dropped += count;
+        return count;
+    }
+
+    queue = sender->peer->incoming_queue;
+
+    return qemu_net_queue_send_iov_batch(queue, sender,
+                                         QEMU_NET_PACKET_FLAG_NONE,
+                                         pkts, count, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
     return qemu_sendv_packet_async(nc, iov, iovcnt, NULL);
 }
 
+/*
+ * Send the same packet from several clients in turn.  A copy is only made
+ * when the packet has to be queued, and it is shared by all the queues;
+ * see qemu_net_queue_send_shared().
+ */
+ssize_t qemu_sendv_packet_shared(NetClientState *sender,
+                                 const struct iovec *iov, int iovcnt,
+                                 NetPacketBuf **shared)
+{
+    NetQueue *queue;
+
+    if (sender->link_down || !sender->peer) {
+        sender->stats.dropped++;
+        return iov_size(iov, iovcnt);
+    }
+
+    queue = sender->peer->incoming_queue;
+
+    return qemu_net_queue_send_shared(queue, sender,
+                                      QEMU_NET_PACKET_FLAG_NONE,
+                                      iov, iovcnt, shared, NULL);
+}
+
 NetClientState *qemu_find_netdev(const char *id)
 {
     NetClientState *nc;
@@ -797,6 +908,9 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
 #endif
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_OPTIONS_KIND_NETMAP]    = net_init_netmap,
+#endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_OPTIONS_KIND_AF_XDP]    = net_init_af_xdp,
 #endif
         [NET_CLIENT_OPTIONS_KIND_DUMP]      = net_init_dump,
 #ifdef CONFIG_NET_BRIDGE
@@ -838,6 +952,9 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
 #ifdef CONFIG_NETMAP
         case NET_CLIENT_OPTIONS_KIND_NETMAP:
 #endif
+#ifdef CONFIG_AF_XDP
+        case NET_CLIENT_OPTIONS_KIND_AF_XDP:
+#endif
 #ifdef CONFIG_NET_BRIDGE
         case NET_CLIENT_OPTIONS_KIND_BRIDGE:
 #endif
@@ -1098,6 +1215,69 @@ RxFilterInfoList *qmp_query_rx_filter(bool has_name, const char *name,
     return filter_list;
 }
 
+static NetdevStats *net_client_get_stats(NetClientState *nc, bool histogram)
+{
+    NetdevStats *info = g_malloc0(sizeof(*info));
+    NetQueueStats qstats;
+    intList *bucket, **last;
+    int i;
+
+    qemu_net_queue_get_stats(nc->incoming_queue, &qstats);
+
+    info->name = g_strdup(nc->name);
+    info->tx_packets = nc->stats.tx_packets;
+    info->tx_bytes = nc->stats.tx_bytes;
+    info->rx_packets = nc->stats.rx_packets;
+    info->rx_bytes = nc->stats.rx_bytes;
+    info->queued = qstats.queued;
+    info->dropped = nc->stats.dropped + qstats.dropped;
+    info->purged = qstats.purged;
+    info->queue_len = qstats.len;
+
+    if (histogram) {
+        info->has_queue_latency = true;
+        last = &info->queue_latency;
+        for (i = 0; i < NET_QUEUE_LATENCY_BUCKETS; i++) {
+            bucket = g_malloc0(sizeof(*bucket));
+            bucket->value = qstats.latency[i];
+            *last = bucket;
+            last = &bucket->next;
+        }
+    }
+    return info;
+}
+
+NetdevStatsList *qmp_query_netdev_stats(bool has_name, const char *name,
+                                        bool has_histogram, bool histogram,
+                                        Error **errp)
+{
+    NetClientState *nc;
+    NetdevStatsList *stats_list = NULL, **last = &stats_list;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        NetdevStatsList *entry;
+
+        if (has_name && strcmp(nc->name, name) != 0) {
+            continue;
+        }
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = net_client_get_stats(nc, has_histogram && histogram);
+        *last = entry;
+        last = &entry->next;
+
+        if (has_name) {
+            break;
+        }
+    }
+
+    if (stats_list == NULL && has_name) {
+        error_setg(errp, "invalid net client name: %s", name);
+    }
+
+    return stats_list;
+}
+
 void do_info_network(Monitor *mon, const QDict *qdict)
 {
     NetClientState *nc, *peer;
@@ -235,28 +235,23 @@ static ssize_t netmap_receive(NetClientState *nc,
     return size;
 }
 
-static ssize_t netmap_receive_iov(NetClientState *nc,
-                    const struct iovec *iov, int iovcnt)
+/* Copy a packet into the TX ring, splitting it over as many slots as
+ * needed.  The kernel is not told about it until NIOCTXSYNC.  Returns
+ * false if the ring has not enough free slots. */
+static bool netmap_tx_fill(struct netmap_ring *ring,
+                           const struct iovec *iov, int iovcnt)
 {
-    NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
-    struct netmap_ring *ring = s->me.tx;
     uint32_t last;
     uint32_t idx;
     uint8_t *dst;
     int j;
     uint32_t i;
 
-    if (unlikely(!ring)) {
-        /* Drop the packet. */
-        return iov_size(iov, iovcnt);
-    }
-
     last = i = ring->cur;
 
     if (nm_ring_space(ring) < iovcnt) {
         /* Not enough netmap slots. */
-        netmap_write_poll(s, true);
-        return 0;
+        return false;
     }
 
     for (j = 0; j < iovcnt; j++) {
@@ -269,11 +264,10 @@ static ssize_t netmap_receive_iov(NetClientState *nc,
         while (iov_frag_size) {
             nm_frag_size = MIN(iov_frag_size, ring->nr_buf_size);
 
-            if (unlikely(nm_ring_empty(ring))) {
+            if (unlikely(i == ring->tail)) {
                 /* We run out of netmap slots while splitting the
                    iovec fragments. */
-                netmap_write_poll(s, true);
-                return 0;
+                return false;
             }
 
             idx = ring->slot[i].buf_idx;
@@ -296,11 +290,57 @@ static ssize_t netmap_receive_iov(NetClientState *nc,
     /* Now update ring->cur and ring->head. */
     ring->cur = ring->head = i;
 
+    return true;
+}
+
+static ssize_t netmap_receive_iov(NetClientState *nc,
+                    const struct iovec *iov, int iovcnt)
+{
+    NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
+    struct netmap_ring *ring = s->me.tx;
+
+    if (unlikely(!ring)) {
+        /* Drop the packet. */
+        return iov_size(iov, iovcnt);
+    }
+
+    if (!netmap_tx_fill(ring, iov, iovcnt)) {
+        netmap_write_poll(s, true);
+        return 0;
+    }
+
     ioctl(s->me.fd, NIOCTXSYNC, NULL);
 
     return iov_size(iov, iovcnt);
 }
 
+/* Fill the TX ring with as many packets as fit, then sync once */
+static int netmap_receive_iov_batch(NetClientState *nc,
+                                    const NetIOVPacket *pkts, int count)
+{
+    NetmapState *s = DO_UPCAST(NetmapState, nc, nc);
+    struct netmap_ring *ring = s->me.tx;
+    int done;
+
+    if (unlikely(!ring)) {
+        /* Drop the packets. */
+        return count;
+    }
+
+    for (done = 0; done < count; done++) {
+        if (!netmap_tx_fill(ring, pkts[done].iov, pkts[done].iovcnt)) {
+            netmap_write_poll(s, true);
+            break;
+        }
+    }
+
+    if (done) {
+        ioctl(s->me.fd, NIOCTXSYNC, NULL);
+    }
+
+    return done;
+}
+
 /* Complete a previous send (backend --> guest) and enable the
    fd_read callback. */
 static void netmap_send_completed(NetClientState *nc, ssize_t len)
@@ -431,6 +471,7 @@ static NetClientInfo net_netmap_info = {
     .size = sizeof(NetmapState),
     .receive = netmap_receive,
     .receive_iov = netmap_receive_iov,
+    .receive_iov_batch = netmap_receive_iov_batch,
     .poll = netmap_poll,
     .cleanup = netmap_cleanup,
     .has_ufo = netmap_has_ufo,
@@ -22,8 +22,9 @@
  */
 
 #include "net/queue.h"
-#include "qemu/queue.h"
 #include "net/net.h"
+#include "qemu/iov.h"
+#include "qemu/timer.h"
 
 /* The delivery handler may only return zero if it will call
  * qemu_net_queue_flush() when it determines that it is once again able
@@ -36,24 +37,71 @@
  * the packet.
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
- * unbounded queueing.
+ * unbounded queueing: that happens once the queue holds nq_maxlen packets
+ * or NET_QUEUE_MAX_SLOTS slots of data.
  */
 
+/* Packet contents that several queues hold on to, e.g. the hub's ports */
+struct NetPacketBuf {
+    unsigned int refcnt;
+    size_t size;
+    uint8_t data[0];
+};
+
+/*
+ * Queued packets are copied into fixed-size slots, which are carved out of
+ * slabs that the queue allocates as it first needs them.  Once a flush has
+ * drained the queue, slabs beyond the first NET_QUEUE_IDLE_SLABS are given
+ * back, so a burst does not pin its memory for the life of the queue.
+ * A frame of up to NET_QUEUE_SLOT_SIZE bytes takes one slot; larger ones
+ * are spread over a chain of slots and are delivered as an iovec, so they
+ * are never linearized.
+ */
+#define NET_QUEUE_SLOT_SIZE     2048
+#define NET_QUEUE_SLAB_SLOTS    64
+/* Slabs kept when the queue is idle, 256 KB */
+#define NET_QUEUE_IDLE_SLABS    2
+/* Slots that packets without a sent callback may use, 8 MB */
+#define NET_QUEUE_MAX_SLOTS     4096
+/* Longest chain; anything bigger goes to a NetPacketBuf */
+#define NET_QUEUE_PACKET_SLOTS  DIV_ROUND_UP(NET_BUFSIZE, NET_QUEUE_SLOT_SIZE)
+
+/* Packets and iovec elements handed to the receiver by one flush step */
+#define NET_QUEUE_BATCH         32
+#define NET_QUEUE_BATCH_IOV     (2 * NET_QUEUE_PACKET_SLOTS)
+
+typedef struct NetQueueSlot NetQueueSlot;
+
+struct NetQueueSlot {
+    NetQueueSlot *next;     /* next slot of the packet or of the free list */
+    uint8_t data[NET_QUEUE_SLOT_SIZE];
+};
+
 struct NetPacket {
-    QTAILQ_ENTRY(NetPacket) entry;
     NetClientState *sender;
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
-    uint8_t data[0];
+    NetQueueSlot *slots;        /* the contents, unless shared is set */
+    NetPacketBuf *shared;
+    int64_t queued_at;          /* get_clock() at append time */
 };
 
 struct NetQueue {
     void *opaque;
     uint32_t nq_maxlen;
     uint32_t nq_count;
+    NetQueueStats stats;
 
-    QTAILQ_HEAD(packets, NetPacket) packets;
+    /* Ring of nq_count packets starting at ring[head] */
+    NetPacket *ring;
+    uint32_t ring_size;         /* a power of two */
+    uint32_t head;
+
+    NetQueueSlot *free_slots;
+    NetQueueSlot **slabs;
+    uint32_t nr_slabs;
+    uint32_t nr_free_slots;
 
     unsigned delivering : 1;
 };
@@ -68,46 +116,230 @@ NetQueue *qemu_new_net_queue(void *opaque)
     queue->nq_maxlen = 10000;
     queue->nq_count = 0;
 
-    QTAILQ_INIT(&queue->packets);
+    queue->ring_size = 16;
+    queue->ring = g_new(NetPacket, queue->ring_size);
+    queue->head = 0;
 
     queue->delivering = 0;
 
     return queue;
 }
 
-void qemu_del_net_queue(NetQueue *queue)
+static NetPacketBuf *qemu_net_packet_buf_new(const struct iovec *iov,
+                                             int iovcnt)
+{
+    size_t size = iov_size(iov, iovcnt);
+    NetPacketBuf *buf;
+
+    buf = g_malloc(sizeof(NetPacketBuf) + size);
+    buf->refcnt = 1;
+    buf->size = iov_to_buf(iov, iovcnt, 0, buf->data, size);
+    return buf;
+}
+
+void qemu_net_packet_buf_unref(NetPacketBuf *buf)
+{
+    if (--buf->refcnt == 0) {
+        g_free(buf);
+    }
+}
+
+/* Take @n slots off the free list, allocating slabs as needed */
+static NetQueueSlot *qemu_net_queue_get_slots(NetQueue *queue, int n,
+                                              bool may_grow)
+{
+    NetQueueSlot *first, *last;
+    int i;
+
+    while (queue->nr_free_slots < n) {
+        NetQueueSlot *slab;
+
+        if (!may_grow && (queue->nr_slabs + 1) * NET_QUEUE_SLAB_SLOTS >
+                         NET_QUEUE_MAX_SLOTS) {
+            return NULL;
+        }
+        slab = g_new(NetQueueSlot, NET_QUEUE_SLAB_SLOTS);
+        queue->slabs = g_renew(NetQueueSlot *, queue->slabs,
+                               queue->nr_slabs + 1);
+        queue->slabs[queue->nr_slabs++] = slab;
+        for (i = 0; i < NET_QUEUE_SLAB_SLOTS; i++) {
+            slab[i].next = queue->free_slots;
+            queue->free_slots = &slab[i];
+        }
+        queue->nr_free_slots += NET_QUEUE_SLAB_SLOTS;
+    }
+
+    first = last = queue->free_slots;
+    for (i = 1; i < n; i++) {
+        last = last->next;
+    }
+    queue->free_slots = last->next;
+    queue->nr_free_slots -= n;
+    last->next = NULL;
+    return first;
+}
+
+/* Free the slabs above the idle watermark, once no packet uses any slot */
+static void qemu_net_queue_trim(NetQueue *queue)
 {
-    NetPacket *packet, *next;
+    uint32_t i, j;
+
+    if (queue->nr_slabs <= NET_QUEUE_IDLE_SLABS ||
+        queue->nr_free_slots < queue->nr_slabs * NET_QUEUE_SLAB_SLOTS) {
+        return;
+    }
+    for (i = NET_QUEUE_IDLE_SLABS; i < queue->nr_slabs; i++) {
+        g_free(queue->slabs[i]);
+    }
+    queue->nr_slabs = NET_QUEUE_IDLE_SLABS;
+    queue->slabs = g_renew(NetQueueSlot *, queue->slabs, queue->nr_slabs);
+
+    queue->free_slots = NULL;
+    for (i = 0; i < queue->nr_slabs; i++) {
+        for (j = 0; j < NET_QUEUE_SLAB_SLOTS; j++) {
+            queue->slabs[i][j].next = queue->free_slots;
+            queue->free_slots = &queue->slabs[i][j];
+        }
+    }
+    queue->nr_free_slots = queue->nr_slabs * NET_QUEUE_SLAB_SLOTS;
+}
+
+static void qemu_net_packet_free(NetQueue *queue, NetPacket *packet)
+{
+    NetQueueSlot *slot, *next;
+
+    for (slot = packet->slots; slot; slot = next) {
+        next = slot->next;
+        slot->next = queue->free_slots;
+        queue->free_slots = slot;
+        queue->nr_free_slots++;
+    }
+    if (packet->shared) {
+        qemu_net_packet_buf_unref(packet->shared);
+    }
+}
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+/* Describe the contents of @packet, which take at most
+ * NET_QUEUE_PACKET_SLOTS elements */
+static int qemu_net_packet_iov(NetPacket *packet, struct iovec *iov)
+{
+    NetQueueSlot *slot;
+    size_t left = packet->size;
+    int cnt = 0;
+
+    if (packet->shared) {
+        iov[0].iov_base = packet->shared->data;
+        iov[0].iov_len = packet->size;
+        return 1;
+    }
+    for (slot = packet->slots; left; slot = slot->next) {
+        iov[cnt].iov_base = slot->data;
+        iov[cnt].iov_len = MIN(left, NET_QUEUE_SLOT_SIZE);
+        left -= iov[cnt++].iov_len;
     }
+    return cnt;
+}
 
+void qemu_del_net_queue(NetQueue *queue)
+{
+    uint32_t i;
+
+    for (i = 0; i < queue->nq_count; i++) {
+        qemu_net_packet_free(queue,
+                             &queue->ring[(queue->head + i) &
+                                          (queue->ring_size - 1)]);
+    }
+    for (i = 0; i < queue->nr_slabs; i++) {
+        g_free(queue->slabs[i]);
+    }
+    g_free(queue->slabs);
+    g_free(queue->ring);
     g_free(queue);
 }
 
-static void qemu_net_queue_append(NetQueue *queue,
-                                  NetClientState *sender,
-                                  unsigned flags,
-                                  const uint8_t *buf,
-                                  size_t size,
-                                  NetPacketSent *sent_cb)
+/* Make room for one more packet, keeping the ring in order from index 0 */
+static void qemu_net_queue_grow(NetQueue *queue)
 {
-    NetPacket *packet;
+    NetPacket *ring;
+    uint32_t i;
 
-    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
-        return; /* drop if queue full and no callback */
+    if (queue->nq_count < queue->ring_size) {
+        return;
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
-    packet->sender = sender;
-    packet->flags = flags;
-    packet->size = size;
-    packet->sent_cb = sent_cb;
-    memcpy(packet->data, buf, size);
+    ring = g_new(NetPacket, queue->ring_size * 2);
+    for (i = 0; i < queue->nq_count; i++) {
+        ring[i] = queue->ring[(queue->head + i) & (queue->ring_size - 1)];
+    }
+    g_free(queue->ring);
+    queue->ring = ring;
+    queue->ring_size *= 2;
+    queue->head = 0;
+}
+
+static void qemu_net_queue_push_tail(NetQueue *queue, const NetPacket *packet)
+{
+    qemu_net_queue_grow(queue);
+    queue->ring[(queue->head + queue->nq_count) & (queue->ring_size - 1)] =
+        *packet;
+    queue->nq_count++;
+}
 
+static void qemu_net_queue_push_head(NetQueue *queue, const NetPacket *packet)
+{
+    qemu_net_queue_grow(queue);
+    queue->head = (queue->head - 1) & (queue->ring_size - 1);
+    queue->ring[queue->head] = *packet;
     queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+}
+
+static void qemu_net_queue_pop_head(NetQueue *queue, NetPacket *packet)
+{
+    *packet = queue->ring[queue->head];
+    queue->head = (queue->head + 1) & (queue->ring_size - 1);
+    queue->nq_count--;
+}
+
+static void qemu_net_queue_insert(NetQueue *queue, NetPacket *packet)
+{
+    packet->queued_at = get_clock();
+    queue->stats.queued++;
+    qemu_net_queue_push_tail(queue, packet);
+}
+
+/* Histogram bucket i counts waits of less than 2^i microseconds */
+static void qemu_net_queue_account_latency(NetQueue *queue, NetPacket *packet)
+{
+    int64_t us = (get_clock() - packet->queued_at) / SCALE_US;
+    int i = 0;
+
+    while (i < NET_QUEUE_LATENCY_BUCKETS - 1 && us >= (1LL << i)) {
+        i++;
+    }
+    queue->stats.latency[i]++;
+}
+
+/* Queue a reference to @buf instead of a copy of its contents */
+static void qemu_net_queue_append_shared(NetQueue *queue,
+                                         NetClientState *sender,
+                                         unsigned flags,
+                                         NetPacketBuf *buf,
+                                         NetPacketSent *sent_cb)
+{
+    NetPacket packet;
+
+    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        queue->stats.dropped++;
+        return; /* drop if queue full and no callback */
+    }
+    packet.sender = sender;
+    packet.flags = flags;
+    packet.size = buf->size;
+    packet.sent_cb = sent_cb;
+    packet.slots = NULL;
+    packet.shared = buf;
+    buf->refcnt++;
+
+    qemu_net_queue_insert(queue, &packet);
 }
 
 static void qemu_net_queue_append_iov(NetQueue *queue,
@@ -117,32 +349,60 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
                                       int iovcnt,
                                       NetPacketSent *sent_cb)
 {
-    NetPacket *packet;
-    size_t max_len = 0;
-    int i;
+    NetPacket packet;
+    NetQueueSlot *slot;
+    size_t size, offset;
+    int n;
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
+        queue->stats.dropped++;
         return; /* drop if queue full and no callback */
     }
-    for (i = 0; i < iovcnt; i++) {
-        max_len += iov[i].iov_len;
-    }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
-    packet->sender = sender;
-    packet->sent_cb = sent_cb;
-    packet->flags = flags;
-    packet->size = 0;
+    size = iov_size(iov, iovcnt);
+    n = DIV_ROUND_UP(size, NET_QUEUE_SLOT_SIZE);
+    packet.slots = NULL;
+    if (n <= NET_QUEUE_PACKET_SLOTS && n > 0) {
+        /* a sender with a callback stops after this, so it may go over */
+        packet.slots = qemu_net_queue_get_slots(queue, n, sent_cb != NULL);
+        if (!packet.slots) {
+            queue->stats.dropped++;
+            return; /* drop if out of slots and no callback */
+        }
+    } else if (n > 0) {
+        NetPacketBuf *buf = qemu_net_packet_buf_new(iov, iovcnt);
 
-    for (i = 0; i < iovcnt; i++) {
-        size_t len = iov[i].iov_len;
+        qemu_net_queue_append_shared(queue, sender, flags, buf, sent_cb);
+        qemu_net_packet_buf_unref(buf);
+        return;
+    }
 
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
+    packet.sender = sender;
+    packet.flags = flags;
+    packet.size = size;
+    packet.sent_cb = sent_cb;
+    packet.shared = NULL;
+    for (slot = packet.slots, offset = 0; slot; slot = slot->next) {
+        offset += iov_to_buf(iov, iovcnt, offset, slot->data,
+                             NET_QUEUE_SLOT_SIZE);
     }
 
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    qemu_net_queue_insert(queue, &packet);
+}
+
+static void qemu_net_queue_append(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const uint8_t *buf,
+                                  size_t size,
+                                  NetPacketSent *sent_cb)
+{
+    struct iovec iov = {
+        .iov_base = (uint8_t *)buf,
+        .iov_len = size,
+    };
+
+    qemu_net_queue_append_iov(queue, sender, flags, &iov, 1, sent_cb);
 }
 
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
@@ -225,45 +485,192 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     return ret;
 }
 
-void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
+/*
+ * Like qemu_net_queue_send_iov(), but if the packet has to be queued it is
+ * linearized into *@shared, or *@shared is reused when a previous call has
+ * already set it.  That way a packet that goes to several queues is only
+ * copied once.  The caller drops its reference to *@shared, if any, with
+ * qemu_net_packet_buf_unref() when it is done sending.
+ */
+ssize_t qemu_net_queue_send_shared(NetQueue *queue,
+                                   NetClientState *sender,
+                                   unsigned flags,
+                                   const struct iovec *iov,
+                                   int iovcnt,
+                                   NetPacketBuf **shared,
+                                   NetPacketSent *sent_cb)
 {
-    NetPacket *packet, *next;
+    ssize_t ret = 0;
 
-    QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
-        if (packet->sender == from) {
-            QTAILQ_REMOVE(&queue->packets, packet, entry);
-            queue->nq_count--;
-            g_free(packet);
+    if (!queue->delivering && qemu_can_send_packet(sender)) {
+        ret = qemu_net_queue_deliver_iov(queue, sender, flags, iov, iovcnt);
+        if (ret != 0) {
+            qemu_net_queue_flush(queue);
+            return ret;
         }
     }
+
+    if (!*shared) {
+        *shared = qemu_net_packet_buf_new(iov, iovcnt);
+    }
+    qemu_net_queue_append_shared(queue, sender, flags, *shared, sent_cb);
+    return 0;
 }
 
-bool qemu_net_queue_flush(NetQueue *queue)
+int qemu_net_queue_send_iov_batch(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const NetIOVPacket *pkts,
+                                  int count,
+                                  NetPacketSent *sent_cb)
 {
-    while (!QTAILQ_EMPTY(&queue->packets)) {
-        NetPacket *packet;
-        int ret;
-
-        packet = QTAILQ_FIRST(&queue->packets);
-        QTAILQ_REMOVE(&queue->packets, packet, entry);
-        queue->nq_count--;
-
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
-        if (ret == 0) {
-            queue->nq_count++;
-            QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
-            return false;
+    int done;
+
+    if (queue->delivering || !qemu_can_send_packet(sender)) {
+        qemu_net_queue_append_iov(queue, sender, flags, pkts[0].iov,
+                                  pkts[0].iovcnt, sent_cb);
+        return 0;
+    }
+
+    queue->delivering = 1;
+    done = qemu_deliver_packet_iov_batch(sender, flags, pkts, count,
+                                         queue->opaque);
+    queue->delivering = 0;
+
+    if (done < count) {
+        qemu_net_queue_append_iov(queue, sender, flags, pkts[done].iov,
+                                  pkts[done].iovcnt, sent_cb);
+        return done;
+    }
+
+    qemu_net_queue_flush(queue);
+
+    return done;
+}
+
+void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
+{
+    uint32_t i, count = queue->nq_count;
+    NetPacket packet;
+
+    /* rotate the whole ring once, leaving out what @from sent */
+    for (i = 0; i < count; i++) {
+        qemu_net_queue_pop_head(queue, &packet);
+        if (packet.sender == from) {
+            queue->stats.purged++;
+            qemu_net_packet_free(queue, &packet);
+        } else {
+            qemu_net_queue_push_tail(queue, &packet);
+        }
+    }
+}
+
+/*
+ * Take the packets at the head of the queue that can be handed over in one
+ * call: a run of packets from the same sender with the same flags.  Raw
+ * packets are delivered one at a time, they may need receive_raw, and so
+ * are packets with a sent callback, which gets the result of the delivery.
+ * A sender with a callback stops after its first queued packet, so that
+ * costs little.
+ */
+static int qemu_net_queue_take_batch(NetQueue *queue, NetPacket *batch,
+                                     NetIOVPacket *pkts, struct iovec *iov)
+{
+    int count = 0, iovcnt = 0;
+
+    while (queue->nq_count && count < NET_QUEUE_BATCH &&
+           iovcnt + NET_QUEUE_PACKET_SLOTS <= NET_QUEUE_BATCH_IOV) {
+        NetPacket *next = &queue->ring[queue->head];
+
+        if (count && (next->sender != batch[0].sender ||
+                      next->flags != batch[0].flags ||
+                      (next->flags & QEMU_NET_PACKET_FLAG_RAW) ||
+                      next->sent_cb)) {
+            break;
+        }
+        qemu_net_queue_pop_head(queue, &batch[count]);
+        pkts[count].iov = &iov[iovcnt];
+        pkts[count].iovcnt = qemu_net_packet_iov(&batch[count], &iov[iovcnt]);
+        iovcnt += pkts[count].iovcnt;
+        count++;
+        if ((batch[0].flags & QEMU_NET_PACKET_FLAG_RAW) || batch[0].sent_cb) {
+            break;
         }
+    }
+    return count;
+}
 
-        if (packet->sent_cb) {
-            packet->sent_cb(packet->sender, ret);
+/* A packet delivered on its own leaves the receiver's return in *@ret */
+static int qemu_net_queue_deliver_batch(NetQueue *queue, NetPacket *batch,
+                                        NetIOVPacket *pkts, int count,
+                                        ssize_t *ret)
+{
+    uint8_t *data;
+    int done;
+
+    queue->delivering = 1;
+    if (batch[0].flags & QEMU_NET_PACKET_FLAG_RAW) {
+        if (pkts[0].iovcnt == 1) {
+            data = pkts[0].iov[0].iov_base;
+        } else {
+            data = g_malloc(batch[0].size);
+            iov_to_buf(pkts[0].iov, pkts[0].iovcnt, 0, data, batch[0].size);
         }
+        *ret = qemu_deliver_packet(batch[0].sender, batch[0].flags, data,
+                                   batch[0].size, queue->opaque);
+        if (data != pkts[0].iov[0].iov_base) {
+            g_free(data);
+        }
+        done = *ret != 0;
+    } else if (batch[0].sent_cb) {
+        *ret = qemu_deliver_packet_iov(batch[0].sender, batch[0].flags,
+                                       pkts[0].iov, pkts[0].iovcnt,
+                                       queue->opaque);
+        done = *ret != 0;
+    } else {
+        done = qemu_deliver_packet_iov_batch(batch[0].sender, batch[0].flags,
+                                             pkts, count, queue->opaque);
+    }
+    queue->delivering = 0;
+
+    return done;
+}
 
-        g_free(packet);
+bool qemu_net_queue_flush(NetQueue *queue)
+{
+    NetPacket batch[NET_QUEUE_BATCH];
+    NetIOVPacket pkts[NET_QUEUE_BATCH];
+    struct iovec iov[NET_QUEUE_BATCH_IOV];
+    int i, count, done;
+    ssize_t ret = 0;
+
+    while (queue->nq_count) {
+        /* the batch is off the ring while the receiver looks at it */
+        count = qemu_net_queue_take_batch(queue, batch, pkts, iov);
+        done = qemu_net_queue_deliver_batch(queue, batch, pkts, count, &ret);
+
+        for (i = count - 1; i >= done; i--) {
+            qemu_net_queue_push_head(queue, &batch[i]);
+        }
+        for (i = 0; i < done; i++) {
+            qemu_net_queue_account_latency(queue, &batch[i]);
+            if (batch[i].sent_cb) {
+                /* delivered on its own, see qemu_net_queue_take_batch() */
+                batch[i].sent_cb(batch[i].sender, ret);
+            }
+            qemu_net_packet_free(queue, &batch[i]);
+        }
+        if (done < count) {
+            return false;
+        }
     }
+    qemu_net_queue_trim(queue);
     return true;
 }
+
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats)
+{
+    *stats = queue->stats;
+    stats->len = queue->nq_count;
+    stats->slots = queue->nr_slabs * NET_QUEUE_SLAB_SLOTS;
+}
@@ -34,6 +34,10 @@
 #include "hub.h"
 #include "monitor/monitor.h"
 #include "qemu/sockets.h"
+#include "qemu/main-loop.h"
+#include "qemu/event_notifier.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 #include "slirp/libslirp.h"
 #include "sysemu/char.h"
 
@@ -62,6 +66,10 @@ static int get_str_sep(char *buf, int buf_size, const char **pp, int sep)
 #define SLIRP_CFG_HOSTFWD 1
 #define SLIRP_CFG_LEGACY  2
 
+/* Frames held back until slirp_output_flush(), and the largest of them */
+#define SLIRP_OUT_BATCH   64
+#define SLIRP_OUT_MAXLEN  1600
+
 struct slirp_config_str {
     struct slirp_config_str *next;
     int flags;
@@ -76,6 +84,24 @@ typedef struct SlirpState {
 #ifndef _WIN32
     char smb_dir[128];
 #endif
+    NetIOVPacket out_pkts[SLIRP_OUT_BATCH];
+    struct iovec out_iov[SLIRP_OUT_BATCH];
+    uint8_t out_buf[SLIRP_OUT_BATCH][SLIRP_OUT_MAXLEN];
+    int out_count;
+
+    /* With thread=on the stack is polled by a thread of its own, which
+     * can't touch the peer.  Frames it sends are appended to @pending,
+     * each behind its length, and handed over by @pending_bh.
+     */
+    bool threaded;
+    bool thread_quit;
+    bool thread_kicked;
+    QemuThread thread;
+    EventNotifier thread_notifier;
+    QemuMutex pending_lock;
+    GByteArray *pending;
+    GByteArray *spare;
+    QEMUBH *pending_bh;
 } SlirpState;
 
 static struct slirp_config_str *slirp_configs;
@@ -99,18 +125,207 @@ static void slirp_smb_cleanup(SlirpState *s);
 static inline void slirp_smb_cleanup(SlirpState *s) { }
 #endif
 
+static void slirp_send_batch(SlirpState *s, const NetIOVPacket *pkts,
+                             int count)
+{
+    int i;
+
+    /* If the peer filled up, the rest queue up behind the packet it left */
+    i = qemu_sendv_packets_async(&s->nc, pkts, count, NULL);
+    for (i++; i < count; i++) {
+        qemu_sendv_packet(&s->nc, pkts[i].iov, pkts[i].iovcnt);
+    }
+}
+
+static bool slirp_in_thread(SlirpState *s)
+{
+    return s->threaded && qemu_thread_is_self(&s->thread);
+}
+
+static void slirp_output_pending(SlirpState *s, const uint8_t *pkt,
+                                 int pkt_len)
+{
+    uint32_t len = pkt_len;
+
+    qemu_mutex_lock(&s->pending_lock);
+    g_byte_array_append(s->pending, (const guint8 *)&len, sizeof(len));
+    g_byte_array_append(s->pending, pkt, pkt_len);
+    qemu_mutex_unlock(&s->pending_lock);
+}
+
+/* Hand what the thread sent to the peer; called with the BQL held */
+static void slirp_send_pending(void *opaque)
+{
+    SlirpState *s = opaque;
+    NetIOVPacket pkts[SLIRP_OUT_BATCH];
+    struct iovec iov[SLIRP_OUT_BATCH];
+    GByteArray *frames;
+    uint32_t len;
+    guint off = 0;
+    int count = 0;
+
+    /* The thread carries on in the spare buffer meanwhile */
+    qemu_mutex_lock(&s->pending_lock);
+    frames = s->pending;
+    s->pending = s->spare;
+    qemu_mutex_unlock(&s->pending_lock);
+
+    while (off < frames->len) {
+        memcpy(&len, frames->data + off, sizeof(len));
+        iov[count].iov_base = frames->data + off + sizeof(len);
+        iov[count].iov_len = len;
+        pkts[count].iov = &iov[count];
+        pkts[count].iovcnt = 1;
+        off += sizeof(len) + len;
+        if (++count == SLIRP_OUT_BATCH || off == frames->len) {
+            slirp_send_batch(s, pkts, count);
+            count = 0;
+        }
+    }
+    g_byte_array_set_size(frames, 0);
+    s->spare = frames;
+}
+
+void slirp_output_flush(void *opaque)
+{
+    SlirpState *s = opaque;
+
+    if (slirp_in_thread(s)) {
+        /* the thread schedules pending_bh once it is done polling */
+        return;
+    }
+    if (s->threaded) {
+        /* what the thread sent before this must not be overtaken */
+        slirp_send_pending(s);
+    }
+    if (!s->out_count) {
+        return;
+    }
+
+    slirp_send_batch(s, s->out_pkts, s->out_count);
+    s->out_count = 0;
+}
+
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len)
 {
     SlirpState *s = opaque;
+    struct iovec *iov;
 
-    qemu_send_packet(&s->nc, pkt, pkt_len);
+    if (slirp_in_thread(s)) {
+        slirp_output_pending(s, pkt, pkt_len);
+        return;
+    }
+    if (pkt_len > SLIRP_OUT_MAXLEN) {
+        slirp_output_flush(s);
+        qemu_send_packet(&s->nc, pkt, pkt_len);
+        return;
+    }
+    if (s->out_count == SLIRP_OUT_BATCH) {
+        slirp_output_flush(s);
+    }
+
+    iov = &s->out_iov[s->out_count];
+    iov->iov_base = s->out_buf[s->out_count];
+    iov->iov_len = pkt_len;
+    memcpy(iov->iov_base, pkt, pkt_len);
+    s->out_pkts[s->out_count].iov = iov;
+    s->out_pkts[s->out_count].iovcnt = 1;
+    s->out_count++;
 }
 
+/* Make the thread poll again, e.g. for a socket slirp_input() opened */
+static void slirp_kick(SlirpState *s)
+{
+    if (s->threaded && !atomic_xchg(&s->thread_kicked, true)) {
+        event_notifier_set(&s->thread_notifier);
+    }
+}
+
+#ifndef _WIN32
+static void *slirp_thread(void *opaque)
+{
+    SlirpState *s = opaque;
+    GArray *pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+    GPollFD notifier = {
+        .fd = event_notifier_get_fd(&s->thread_notifier),
+        .events = G_IO_IN,
+    };
+    uint32_t timeout;
+    bool pending;
+    int ret;
+
+    while (!atomic_read(&s->thread_quit)) {
+        g_array_set_size(pollfds, 0);
+        g_array_append_val(pollfds, notifier);
+        timeout = UINT32_MAX;
+        atomic_xchg(&s->thread_kicked, false);
+        slirp_instance_pollfds_fill(s->slirp, pollfds, &timeout);
+
+        ret = qemu_poll_ns((GPollFD *)pollfds->data, pollfds->len,
+                           (int64_t)timeout * SCALE_MS);
+        if (g_array_index(pollfds, GPollFD, 0).revents) {
+            event_notifier_test_and_clear(&s->thread_notifier);
+        }
+        slirp_instance_pollfds_poll(s->slirp, pollfds, ret < 0);
+
+        qemu_mutex_lock(&s->pending_lock);
+        pending = s->pending->len;
+        qemu_mutex_unlock(&s->pending_lock);
+        if (pending) {
+            qemu_bh_schedule(s->pending_bh);
+        }
+    }
+
+    g_array_free(pollfds, TRUE);
+    return NULL;
+}
+
+static int slirp_start_thread(SlirpState *s)
+{
+    if (event_notifier_init(&s->thread_notifier, 0) < 0) {
+        error_report("user: could not create the slirp thread notifier");
+        return -1;
+    }
+    qemu_mutex_init(&s->pending_lock);
+    s->pending = g_byte_array_new();
+    s->spare = g_byte_array_new();
+    s->pending_bh = qemu_bh_new(slirp_send_pending, s);
+
+    slirp_set_threaded(s->slirp);
+    s->threaded = true;
+    qemu_thread_create(&s->thread, "slirp", slirp_thread, s,
+                       QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+static void slirp_stop_thread(SlirpState *s)
+{
+    atomic_set(&s->thread_quit, true);
+    event_notifier_set(&s->thread_notifier);
+    qemu_thread_join(&s->thread);
+
+    qemu_bh_delete(s->pending_bh);
+    g_byte_array_free(s->pending, TRUE);
+    g_byte_array_free(s->spare, TRUE);
+    qemu_mutex_destroy(&s->pending_lock);
+    event_notifier_cleanup(&s->thread_notifier);
+}
+#else
+static int slirp_start_thread(SlirpState *s)
+{
+    error_report("user: thread=on is not supported on this host");
+    return -1;
+}
+
+static inline void slirp_stop_thread(SlirpState *s) { }
+#endif
+
 static ssize_t net_slirp_receive(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
 
     slirp_input(s->slirp, buf, size);
+    slirp_kick(s);
 
     return size;
 }
@@ -119,6 +334,9 @@ static void net_slirp_cleanup(NetClientState *nc)
 {
     SlirpState *s = DO_UPCAST(SlirpState, nc, nc);
 
+    if (s->threaded) {
+        slirp_stop_thread(s);
+    }
     slirp_cleanup(s->slirp);
     slirp_smb_cleanup(s);
     QTAILQ_REMOVE(&slirp_stacks, s, entry);
@@ -137,7 +355,8 @@ static int net_slirp_init(NetClientState *peer, const char *model,
                           const char *vhostname, const char *tftp_export,
                           const char *bootfile, const char *vdhcp_start,
                           const char *vnameserver, const char *smb_export,
-                          const char *vsmbserver, const char **dnssearch)
+                          const char *vsmbserver, const char **dnssearch,
+                          bool threaded)
 {
     /* default settings according to historic slirp */
     struct in_addr net  = { .s_addr = htonl(0x0a000200) }; /* 10.0.2.0 */
@@ -267,6 +486,10 @@ static int net_slirp_init(NetClientState *peer, const char *model,
     }
 #endif
 
+    if (threaded && slirp_start_thread(s) < 0) {
+        goto error;
+    }
+
     return 0;
 
 error:
@@ -413,6 +636,7 @@ static int slirp_hostfwd(SlirpState *s, const char *redir_str,
                      redir_str);
         return -1;
     }
+    slirp_kick(s);
     return 0;
 
  fail_syntax:
@@ -584,19 +808,20 @@ struct GuestFwd {
     CharDriverState *hd;
     struct in_addr server;
     int port;
-    Slirp *slirp;
+    SlirpState *s;
 };
 
 static int guestfwd_can_read(void *opaque)
 {
     struct GuestFwd *fwd = opaque;
-    return slirp_socket_can_recv(fwd->slirp, fwd->server, fwd->port);
+    return slirp_socket_can_recv(fwd->s->slirp, fwd->server, fwd->port);
 }
 
 static void guestfwd_read(void *opaque, const uint8_t *buf, int size)
 {
     struct GuestFwd *fwd = opaque;
-    slirp_socket_recv(fwd->slirp, fwd->server, fwd->port, buf, size);
+    slirp_socket_recv(fwd->s->slirp, fwd->server, fwd->port, buf, size);
+    slirp_kick(fwd->s);
 }
 
 static int slirp_guestfwd(SlirpState *s, const char *config_str,
@@ -662,7 +887,7 @@ static int slirp_guestfwd(SlirpState *s, const char *config_str,
         }
         fwd->server = server;
         fwd->port = port;
-        fwd->slirp = s->slirp;
+        fwd->s = s;
 
         qemu_chr_fe_claim_no_fail(fwd->hd);
         qemu_chr_add_handlers(fwd->hd, guestfwd_can_read, guestfwd_read,
@@ -756,7 +981,7 @@ int net_init_slirp(const NetClientOptions *opts, const char *name,
     ret = net_slirp_init(peer, "user", name, user->q_restrict, vnet,
                          user->host, user->hostname, user->tftp,
                          user->bootfile, user->dhcpstart, user->dns, user->smb,
-                         user->smbserver, dnssearch);
+                         user->smbserver, dnssearch, user->thread);
 
     while (slirp_configs) {
         config = slirp_configs;
@@ -89,24 +89,34 @@ static void net_socket_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
-static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/* Most packets come in one or two pieces; larger vectors are allocated */
+#define NET_SOCKET_IOV_MAX  8
+
+/* Send the length prefix and the packet with one sendmsg() */
+static ssize_t net_socket_receive_iov(NetClientState *nc,
+                                      const struct iovec *iov, int iovcnt)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
     uint32_t len = htonl(size);
-    struct iovec iov[] = {
-        {
-            .iov_base = &len,
-            .iov_len  = sizeof(len),
-        }, {
-            .iov_base = (void *)buf,
-            .iov_len  = size,
-        },
-    };
+    struct iovec local[NET_SOCKET_IOV_MAX + 1];
+    struct iovec *out = local;
     size_t remaining;
     ssize_t ret;
 
-    remaining = iov_size(iov, 2) - s->send_index;
-    ret = iov_send(s->fd, iov, 2, s->send_index, remaining);
+    if (iovcnt > NET_SOCKET_IOV_MAX) {
+        out = g_new(struct iovec, iovcnt + 1);
+    }
+    out[0].iov_base = &len;
+    out[0].iov_len = sizeof(len);
+    memcpy(out + 1, iov, iovcnt * sizeof(*iov));
+
+    remaining = sizeof(len) + size - s->send_index;
+    ret = iov_send(s->fd, out, iovcnt + 1, s->send_index, remaining);
+
+    if (out != local) {
+        g_free(out);
+    }
 
     if (ret == -1 && errno == EAGAIN) {
         ret = 0; /* handled further down */
@@ -124,6 +134,16 @@ static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t
     return size;
 }
 
+static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len  = size,
+    };
+
+    return net_socket_receive_iov(nc, &iov, 1);
+}
+
 static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
@@ -142,6 +162,21 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
     return ret;
 }
 
+/* Complete packets found in one read, passed to the peer together */
+#define NET_SOCKET_BATCH    64
+
+static void net_socket_send_batch(NetSocketState *s, NetIOVPacket *pkts,
+                                  int count)
+{
+    int i;
+
+    i = qemu_sendv_packets_async(&s->nc, pkts, count, NULL);
+    /* pkts[i] was queued, the rest follows it into the queue */
+    for (i++; i < count; i++) {
+        qemu_sendv_packet(&s->nc, pkts[i].iov, pkts[i].iovcnt);
+    }
+}
+
 static void net_socket_send(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -149,6 +184,9 @@ static void net_socket_send(void *opaque)
     unsigned l;
     uint8_t buf1[NET_BUFSIZE];
     const uint8_t *buf;
+    NetIOVPacket pkts[NET_SOCKET_BATCH];
+    struct iovec iov[NET_SOCKET_BATCH];
+    int count = 0;
 
     size = qemu_recv(s->fd, buf1, sizeof(buf1), 0);
     if (size < 0) {
@@ -177,6 +215,28 @@ static void net_socket_send(void *opaque)
     }
     buf = buf1;
     while (size > 0) {
+        /* packets that were read in full are sent from where they are */
+        if (s->state == 0 && s->index == 0 && size >= 4) {
+            l = ldl_be_p(buf);
+            if (l <= size - 4 && l <= sizeof(s->buf)) {
+                iov[count].iov_base = (uint8_t *)buf + 4;
+                iov[count].iov_len = l;
+                pkts[count].iov = &iov[count];
+                pkts[count].iovcnt = 1;
+                buf += 4 + l;
+                size -= 4 + l;
+                if (++count == NET_SOCKET_BATCH) {
+                    net_socket_send_batch(s, pkts, count);
+                    count = 0;
+                }
+                continue;
+            }
+        }
+        if (count) {
+            net_socket_send_batch(s, pkts, count);
+            count = 0;
+        }
+
         /* reassemble a packet from the network */
         switch(s->state) {
         case 0:
@@ -218,6 +278,9 @@ static void net_socket_send(void *opaque)
             break;
         }
     }
+    if (count) {
+        net_socket_send_batch(s, pkts, count);
+    }
 }
 
 static void net_socket_send_dgram(void *opaque)
@@ -424,6 +487,7 @@ static NetClientInfo net_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive,
+    .receive_iov = net_socket_receive_iov,
     .cleanup = net_socket_cleanup,
 };
 
@@ -44,12 +44,15 @@
 
 #include "net/vhost_net.h"
 
+/* Packets read from the fd before they are handed to the peer */
+#define TAP_RX_BATCH 8
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    uint8_t buf[TAP_RX_BATCH][NET_BUFSIZE];
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
@@ -188,26 +191,49 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
+    struct iovec iov[TAP_RX_BATCH];
+    NetIOVPacket pkts[TAP_RX_BATCH];
+    int size, count, sent, i;
 
     while (qemu_can_send_packet(&s->nc)) {
-        uint8_t *buf = s->buf;
+        for (count = 0; count < TAP_RX_BATCH; count++) {
+            uint8_t *buf = s->buf[count];
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
-        if (size <= 0) {
-            break;
+            size = tap_read_packet(s->fd, buf, sizeof(s->buf[count]));
+            if (size <= 0) {
+                break;
+            }
+
+            if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+                buf  += s->host_vnet_hdr_len;
+                size -= s->host_vnet_hdr_len;
+            }
+
+            iov[count].iov_base = buf;
+            iov[count].iov_len = size;
+            pkts[count].iov = &iov[count];
+            pkts[count].iovcnt = 1;
         }
 
-        if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
+        if (count == 0) {
+            break;
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
+        sent = qemu_sendv_packets_async(&s->nc, pkts, count,
+                                        tap_send_completed);
+        if (sent < count) {
+            /* The peer is full and queued pkts[sent].  The packets after it
+             * are already off the fd, so queue them behind it. */
+            for (i = sent + 1; i < count; i++) {
+                qemu_sendv_packet_async(&s->nc, pkts[i].iov, pkts[i].iovcnt,
+                                        tap_send_completed);
+            }
             tap_read_poll(s, false);
             break;
-        } else if (size < 0) {
+        }
+
+        if (count < TAP_RX_BATCH) {
+            /* the fd is drained */
             break;
         }
     }
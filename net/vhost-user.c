@@ -14,12 +14,20 @@
 #include "sysemu/char.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 
 typedef struct VhostUserState {
     NetClientState nc;
     CharDriverState *chr;
     bool vhostforce;
     VHostNetState *vhost_net;
+    /* Features the guest acked, restored when the backend reconnects */
+    unsigned acked_features;
+    /* Whether the backend is there; nc.link_down is left to the user */
+    bool connected;
+    /* Only used by the first queue pair, which owns the chardev */
+    guint watch;
+    QEMUBH *closed_bh;
 } VhostUserState;
 
 typedef struct VhostUserChardevProps {
@@ -35,43 +43,101 @@ VHostNetState *vhost_user_get_vhost_net(NetClientState *nc)
     return s->vhost_net;
 }
 
+bool vhost_user_connected(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    return s->connected;
+}
+
 static int vhost_user_running(VhostUserState *s)
 {
     return (s->vhost_net) ? 1 : 0;
 }
 
-static int vhost_user_start(VhostUserState *s)
+static void vhost_user_stop(int queues, NetClientState *ncs[])
 {
-    VhostNetOptions options;
-
-    if (vhost_user_running(s)) {
-        return 0;
-    }
+    VhostUserState *s;
+    int i;
 
-    options.backend_type = VHOST_BACKEND_TYPE_USER;
-    options.net_backend = &s->nc;
-    options.opaque = s->chr;
-    options.force = s->vhostforce;
+    for (i = 0; i < queues; i++) {
+        assert(ncs[i]->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
 
-    s->vhost_net = vhost_net_init(&options);
+        s = DO_UPCAST(VhostUserState, nc, ncs[i]);
+        if (!vhost_user_running(s)) {
+            continue;
+        }
 
-    return vhost_user_running(s) ? 0 : -1;
+        s->acked_features = vhost_net_get_acked_features(s->vhost_net);
+        vhost_net_cleanup(s->vhost_net);
+        s->vhost_net = 0;
+    }
 }
 
-static void vhost_user_stop(VhostUserState *s)
+static int vhost_user_start(int queues, NetClientState *ncs[])
 {
-    if (vhost_user_running(s)) {
-        vhost_net_cleanup(s->vhost_net);
+    VhostNetOptions options;
+    VhostUserState *s;
+    uint64_t max_queues;
+    int i;
+
+    options.backend_type = VHOST_BACKEND_TYPE_USER;
+
+    for (i = 0; i < queues; i++) {
+        assert(ncs[i]->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+
+        s = DO_UPCAST(VhostUserState, nc, ncs[i]);
+        if (vhost_user_running(s)) {
+            continue;
+        }
+
+        options.net_backend = ncs[i];
+        options.opaque = s->chr;
+        options.force = s->vhostforce;
+
+        s->vhost_net = vhost_net_init(&options);
+        if (!s->vhost_net) {
+            error_report("failed to init vhost_net for queue %d", i);
+            goto err;
+        }
+        if (s->acked_features) {
+            vhost_net_ack_features(s->vhost_net, s->acked_features);
+        }
+
+        if (i == 0) {
+            max_queues = vhost_net_get_max_queues(s->vhost_net);
+            if (queues > max_queues) {
+                error_report("vhost-user backend supports %" PRIu64
+                             " queues, %d requested", max_queues, queues);
+                goto err;
+            }
+        }
     }
 
-    s->vhost_net = 0;
+    return 0;
+
+err:
+    vhost_user_stop(i + 1, ncs);
+    return -1;
 }
 
 static void vhost_user_cleanup(NetClientState *nc)
 {
     VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
 
-    vhost_user_stop(s);
+    if (s->vhost_net) {
+        vhost_net_cleanup(s->vhost_net);
+        s->vhost_net = 0;
+    }
+    if (nc->queue_index == 0) {
+        if (s->watch) {
+            g_source_remove(s->watch);
+            s->watch = 0;
+        }
+        qemu_bh_delete(s->closed_bh);
+        qemu_chr_add_handlers(s->chr, NULL, NULL, NULL, NULL);
+    }
+
     qemu_purge_queued_packets(nc);
 }
 
@@ -97,61 +163,140 @@ static NetClientInfo net_vhost_user_info = {
         .has_ufo = vhost_user_has_ufo,
 };
 
-static void net_vhost_link_down(VhostUserState *s, bool link_down)
+/* Tell the frontend, which starts or stops vhost accordingly */
+static void net_vhost_user_set_connected(int queues, NetClientState *ncs[],
+                                         bool connected)
 {
-    s->nc.link_down = link_down;
+    NetClientState *peer = ncs[0]->peer;
+    int i;
 
-    if (s->nc.peer) {
-        s->nc.peer->link_down = link_down;
+    for (i = 0; i < queues; i++) {
+        DO_UPCAST(VhostUserState, nc, ncs[i])->connected = connected;
     }
-
-    if (s->nc.info->link_status_changed) {
-        s->nc.info->link_status_changed(&s->nc);
+    if (peer && peer->info->link_status_changed) {
+        peer->info->link_status_changed(peer);
     }
+}
+
+/* Have the frontend stop vhost and save the ring state, then drop the vhost
+ * devices of every queue pair.
+ */
+static void net_vhost_user_down(VhostUserState *s)
+{
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    int queues;
 
-    if (s->nc.peer && s->nc.peer->info->link_status_changed) {
-        s->nc.peer->info->link_status_changed(s->nc.peer);
+    if (!s->connected) {
+        return;
     }
+
+    queues = qemu_find_net_clients_except(s->nc.name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
+    net_vhost_user_set_connected(queues, ncs, false);
+    vhost_user_stop(queues, ncs);
+}
+
+static void net_vhost_user_closed_bh(void *opaque)
+{
+    VhostUserState *s = opaque;
+
+    net_vhost_user_down(s);
+    error_report("chardev \"%s\" went down", s->chr->label);
+}
+
+static gboolean net_vhost_user_watch(GIOChannel *chan, GIOCondition cond,
+                                     void *opaque)
+{
+    VhostUserState *s = opaque;
+
+    s->watch = 0;
+    qemu_chr_disconnect(s->chr);
+
+    return FALSE;
 }
 
 static void net_vhost_user_event(void *opaque, int event)
 {
     VhostUserState *s = opaque;
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    VhostUserState *q;
+    int queues, i;
 
+    queues = qemu_find_net_clients_except(s->nc.name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
     switch (event) {
     case CHR_EVENT_OPENED:
-        vhost_user_start(s);
-        net_vhost_link_down(s, false);
-        error_report("chardev \"%s\" went up\n", s->chr->label);
+        /* Finish tearing down the previous connection first.  Its devices
+         * were cut off from the chardev when it closed, so nothing of this
+         * reaches the new backend.
+         */
+        qemu_bh_cancel(s->closed_bh);
+        net_vhost_user_down(s);
+
+        if (vhost_user_start(queues, ncs) < 0) {
+            qemu_chr_disconnect(s->chr);
+            return;
+        }
+        /* Nobody reads from the socket, so watch for the backend hanging
+         * up ourselves.
+         */
+        s->watch = qemu_chr_fe_add_watch(s->chr, G_IO_HUP,
+                                         net_vhost_user_watch, s);
+        net_vhost_user_set_connected(queues, ncs, true);
+        error_report("chardev \"%s\" went up", s->chr->label);
         break;
     case CHR_EVENT_CLOSED:
-        net_vhost_link_down(s, true);
-        vhost_user_stop(s);
-        error_report("chardev \"%s\" went down\n", s->chr->label);
+        if (s->watch) {
+            g_source_remove(s->watch);
+            s->watch = 0;
+        }
+        for (i = 0; i < queues; i++) {
+            q = DO_UPCAST(VhostUserState, nc, ncs[i]);
+            if (q->vhost_net) {
+                vhost_net_backend_lost(q->vhost_net);
+            }
+        }
+        /* This can be raised by a failing read in the middle of a vhost
+         * request, so leave the teardown to the main loop.
+         */
+        qemu_bh_schedule(s->closed_bh);
         break;
     }
 }
 
 static int net_vhost_user_init(NetClientState *peer, const char *device,
                                const char *name, CharDriverState *chr,
-                               bool vhostforce)
+                               bool vhostforce, int queues)
 {
     NetClientState *nc;
-    VhostUserState *s;
+    VhostUserState *s, *first = NULL;
+    int i;
 
-    nc = qemu_new_net_client(&net_vhost_user_info, peer, device, name);
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_vhost_user_info, peer, device, name);
 
-    snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user to %s",
-             chr->label);
+        snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user%d to %s",
+                 i, chr->label);
 
-    s = DO_UPCAST(VhostUserState, nc, nc);
+        nc->queue_index = i;
 
-    /* We don't provide a receive callback */
-    s->nc.receive_disabled = 1;
-    s->chr = chr;
-    s->vhostforce = vhostforce;
+        s = DO_UPCAST(VhostUserState, nc, nc);
 
-    qemu_chr_add_handlers(s->chr, NULL, NULL, net_vhost_user_event, s);
+        /* We don't provide a receive callback */
+        s->nc.receive_disabled = 1;
+        s->chr = chr;
+        s->vhostforce = vhostforce;
+
+        if (!first) {
+            first = s;
+        }
+    }
+
+    /* The first queue pair handles the connection for all of them */
+    first->closed_bh = qemu_bh_new(net_vhost_user_closed_bh, first);
+    qemu_chr_add_handlers(chr, NULL, NULL, net_vhost_user_event, first);
 
     return 0;
 }
@@ -231,6 +376,7 @@ int net_init_vhost_user(const NetClientOptions *opts, const char *name,
     const NetdevVhostUserOptions *vhost_user_opts;
     CharDriverState *chr;
     bool vhostforce;
+    int queues;
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
     vhost_user_opts = opts->vhost_user;
@@ -254,5 +400,12 @@ int net_init_vhost_user(const NetClientOptions *opts, const char *name,
         vhostforce = false;
     }
 
-    return net_vhost_user_init(peer, "vhost_user", name, chr, vhostforce);
+    queues = vhost_user_opts->has_queues ? vhost_user_opts->queues : 1;
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_report("vhost-user: invalid number of queues %d", queues);
+        return -1;
+    }
+
+    return net_vhost_user_init(peer, "vhost_user", name, chr, vhostforce,
+                               queues);
 }
@@ -5,6 +5,10 @@
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "trace.h"
+#ifdef CONFIG_MSG_ZEROCOPY
+#include <poll.h>
+#include <linux/errqueue.h>
+#endif
 
 #define IO_BUF_SIZE 32768
 #define MAX_IOV_SIZE MIN(IOV_MAX, 64)
@@ -15,6 +19,7 @@ struct QEMUFile {
 
     int64_t bytes_xfer;
     int64_t xfer_limit;
+    int64_t total_transferred; /* bytes handed to the backend */
 
     int64_t pos; /* start of buffer when writing, end of buffer
                     when reading */
@@ -24,6 +29,12 @@ struct QEMUFile {
 
     struct iovec iov[MAX_IOV_SIZE];
     unsigned int iovcnt;
+    uint64_t iov_async; /* bit n set: iov[n] was queued without a copy */
+
+    /* iov holds a run of qemu_put_buffer_at() data, not part of the stream */
+    bool iov_positioned;
+    int64_t positioned_start;
+    int64_t positioned_len;
 
     int last_error;
 };
@@ -36,6 +47,8 @@ typedef struct QEMUFileStdio {
 typedef struct QEMUFileSocket {
     int fd;
     QEMUFile *file;
+    uint32_t zerocopy_sent;
+    uint32_t zerocopy_done;
 } QEMUFileSocket;
 
 static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
@@ -52,6 +65,148 @@ static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
     return len;
 }
 
+#ifdef CONFIG_MSG_ZEROCOPY
+/* Longest wait for completions between two checks for an error */
+#define ZEROCOPY_REAP_POLL_MS 100
+
+/*
+ * Reap MSG_ZEROCOPY completions from the socket error queue.  With @wait,
+ * block until every zero-copy send issued so far has completed, i.e. the
+ * kernel no longer references any guest page passed to sendmsg(), or until
+ * the file has an error; cancelling the migration sets one.
+ */
+static int socket_zerocopy_reap(QEMUFileSocket *s, bool wait)
+{
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+    struct pollfd pfd;
+    int ret;
+
+    while (s->zerocopy_done != s->zerocopy_sent) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(s->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                return -errno;
+            }
+            if (!wait) {
+                return 0;
+            }
+            ret = qemu_file_get_error(s->file);
+            if (ret) {
+                return ret;
+            }
+            /* The error queue is signalled as POLLERR */
+            pfd.fd = s->fd;
+            pfd.events = 0;
+            if (poll(&pfd, 1, ZEROCOPY_REAP_POLL_MS) < 0 && errno != EINTR) {
+                return -errno;
+            }
+            continue;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 &&
+                  cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+                serr->ee_errno != 0) {
+                return serr->ee_errno ? -serr->ee_errno : -EIO;
+            }
+            /* [ee_info, ee_data] is the range of completed sends */
+            s->zerocopy_done += serr->ee_data - serr->ee_info + 1;
+            trace_qemu_file_zerocopy_done(serr->ee_info, serr->ee_data,
+                                          !!(serr->ee_code &
+                                             SO_EE_CODE_ZEROCOPY_COPIED));
+        }
+    }
+    return 0;
+}
+
+static ssize_t socket_writev_buffer_zerocopy(void *opaque, struct iovec *iov,
+                                             int iovcnt, int64_t pos)
+{
+    QEMUFileSocket *s = opaque;
+    struct iovec local_iov[MAX_IOV_SIZE];
+    struct iovec *cur = local_iov;
+    unsigned int cnt = iovcnt;
+    ssize_t size = iov_size(iov, iovcnt);
+    ssize_t done = 0;
+    struct msghdr msg;
+    bool copy = false;
+    ssize_t len;
+    int ret;
+
+    memcpy(local_iov, iov, iovcnt * sizeof(*iov));
+    while (done < size) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = cur;
+        msg.msg_iovlen = cnt;
+
+        len = sendmsg(s->fd, &msg, copy ? 0 : MSG_ZEROCOPY);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == ENOBUFS && !copy) {
+                if (s->zerocopy_done == s->zerocopy_sent) {
+                    /* Nothing left to reap, the kernel cannot pin any more
+                     * pages for us; send this piece the ordinary way.
+                     */
+                    trace_qemu_file_zerocopy_fallback(size - done);
+                    copy = true;
+                    continue;
+                }
+                /* Too many completions pending, wait for some */
+                ret = socket_zerocopy_reap(s, true);
+                if (ret < 0) {
+                    return ret;
+                }
+                continue;
+            }
+            return -errno;
+        }
+        if (!copy) {
+            s->zerocopy_sent++;
+        }
+        done += len;
+        iov_discard_front(&cur, &cnt, len);
+    }
+
+    /* Keep the error queue short */
+    ret = socket_zerocopy_reap(s, false);
+    return ret < 0 ? ret : size;
+}
+
+static int socket_zerocopy_after_ram_iterate(QEMUFile *f, void *opaque,
+                                             uint64_t flags)
+{
+    qemu_fflush(f);
+    return socket_zerocopy_reap(opaque, true);
+}
+
+static int socket_zerocopy_close(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    int ret;
+
+    ret = socket_zerocopy_reap(s, true);
+    closesocket(s->fd);
+    g_free(s);
+    return ret;
+}
+#endif
+
 static int socket_get_fd(void *opaque)
 {
     QEMUFileSocket *s = opaque;
@@ -346,6 +501,16 @@ static const QEMUFileOps socket_write_ops = {
     .close =      socket_close
 };
 
+#ifdef CONFIG_MSG_ZEROCOPY
+static const QEMUFileOps socket_write_zerocopy_ops = {
+    .get_fd =     socket_get_fd,
+    .writev_buffer = socket_writev_buffer,
+    .writev_buffer_zerocopy = socket_writev_buffer_zerocopy,
+    .after_ram_iterate = socket_zerocopy_after_ram_iterate,
+    .close =      socket_zerocopy_close
+};
+#endif
+
 bool qemu_file_mode_is_not_valid(const char *mode)
 {
     if (mode == NULL ||
@@ -377,6 +542,32 @@ QEMUFile *qemu_fopen_socket(int fd, const char *mode)
     return s->file;
 }
 
+/*
+ * Open a socket for writing a migration stream whose guest pages are sent
+ * with MSG_ZEROCOPY.  Falls back to a normal socket QEMUFile when the host
+ * does not support it.
+ */
+QEMUFile *qemu_fopen_socket_zerocopy(int fd)
+{
+#ifdef CONFIG_MSG_ZEROCOPY
+    QEMUFileSocket *s;
+    int val = 1;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val)) == 0) {
+        s = g_malloc0(sizeof(QEMUFileSocket));
+        s->fd = fd;
+        qemu_set_block(s->fd);
+        s->file = qemu_fopen_ops(s, &socket_write_zerocopy_ops);
+        return s->file;
+    }
+    error_report("Zero-copy send not supported on this socket: %s",
+                 strerror(errno));
+#else
+    error_report("Zero-copy send not supported by this build");
+#endif
+    return qemu_fopen_socket(fd, "wb");
+}
+
 QEMUFile *qemu_fopen(const char *filename, const char *mode)
 {
     QEMUFileStdio *s;
@@ -438,6 +629,49 @@ static inline bool qemu_file_is_writable(QEMUFile *f)
     return f->ops->writev_buffer || f->ops->put_buffer;
 }
 
+/*
+ * Write out the pending iovec.  Runs of entries queued by
+ * qemu_put_buffer_async() go through writev_buffer_zerocopy when the
+ * backend provides it; everything else points into f->buf, which is reused
+ * as soon as we return, and must be copied by writev_buffer.
+ */
+static ssize_t qemu_file_writev(QEMUFile *f)
+{
+    unsigned int start, i;
+    ssize_t ret, total = 0;
+
+    if (f->iov_positioned) {
+        return f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt,
+                                     f->positioned_start);
+    }
+    if (!f->ops->writev_buffer_zerocopy || !f->iov_async) {
+        return f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
+    }
+
+    for (start = 0; start < f->iovcnt; start = i) {
+        bool async = f->iov_async & (1ULL << start);
+
+        for (i = start + 1; i < f->iovcnt; i++) {
+            if (!!(f->iov_async & (1ULL << i)) != async) {
+                break;
+            }
+        }
+        if (async) {
+            ret = f->ops->writev_buffer_zerocopy(f->opaque, f->iov + start,
+                                                 i - start, f->pos + total);
+        } else {
+            ret = f->ops->writev_buffer(f->opaque, f->iov + start,
+                                        i - start, f->pos + total);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+        total += ret;
+    }
+
+    return total;
+}
+
 /**
  * Flushes QEMUFile buffer
  *
@@ -454,7 +688,7 @@ void qemu_fflush(QEMUFile *f)
 
     if (f->ops->writev_buffer) {
         if (f->iovcnt > 0) {
-            ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
+            ret = qemu_file_writev(f);
         }
     } else {
         if (f->buf_index > 0) {
@@ -462,10 +696,15 @@ void qemu_fflush(QEMUFile *f)
         }
     }
     if (ret >= 0) {
-        f->pos += ret;
+        if (!f->iov_positioned) {
+            f->pos += ret;
+        }
+        f->total_transferred += ret;
     }
     f->buf_index = 0;
     f->iovcnt = 0;
+    f->iov_async = 0;
+    f->iov_positioned = false;
     if (ret < 0) {
         qemu_file_set_error(f, ret);
     }
@@ -610,13 +849,49 @@ int qemu_fclose(QEMUFile *f)
     return ret;
 }
 
-static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
+/*
+ * Push out everything written so far and wait for the backend to finish
+ * with it, without closing the file.
+ *
+ * Returns negative error value if any error happened on previous operations
+ * or while finishing.
+ */
+int qemu_file_finish(QEMUFile *f)
+{
+    qemu_fflush(f);
+    if (f->ops->finish) {
+        int ret = f->ops->finish(f->opaque);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+    return qemu_file_get_error(f);
+}
+
+/*
+ * Stream data never shares a write with a qemu_put_buffer_at() run.
+ * Nothing sits in f->buf while such a run is queued, so flushing here
+ * before f->buf is filled cannot lose anything.
+ */
+static inline void qemu_file_end_positioned(QEMUFile *f)
+{
+    if (f->iov_positioned) {
+        qemu_fflush(f);
+    }
+}
+
+static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size,
+                         bool async)
 {
     /* check for adjacent buffer and coalesce them */
     if (f->iovcnt > 0 && buf == f->iov[f->iovcnt - 1].iov_base +
-        f->iov[f->iovcnt - 1].iov_len) {
+        f->iov[f->iovcnt - 1].iov_len &&
+        async == !!(f->iov_async & (1ULL << (f->iovcnt - 1)))) {
         f->iov[f->iovcnt - 1].iov_len += size;
     } else {
+        if (async) {
+            f->iov_async |= 1ULL << f->iovcnt;
+        }
         f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
         f->iov[f->iovcnt++].iov_len = size;
     }
@@ -637,8 +912,9 @@ void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
         return;
     }
 
+    qemu_file_end_positioned(f);
     f->bytes_xfer += size;
-    add_to_iovec(f, buf, size);
+    add_to_iovec(f, buf, size, true);
 }
 
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
@@ -649,6 +925,7 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
         return;
     }
 
+    qemu_file_end_positioned(f);
     while (size > 0) {
         l = IO_BUF_SIZE - f->buf_index;
         if (l > size) {
@@ -657,7 +934,7 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
         memcpy(f->buf + f->buf_index, buf, l);
         f->bytes_xfer += l;
         if (f->ops->writev_buffer) {
-            add_to_iovec(f, f->buf + f->buf_index, l);
+            add_to_iovec(f, f->buf + f->buf_index, l, false);
         }
         f->buf_index += l;
         if (f->buf_index == IO_BUF_SIZE) {
@@ -677,10 +954,11 @@ void qemu_put_byte(QEMUFile *f, int v)
         return;
     }
 
+    qemu_file_end_positioned(f);
     f->buf[f->buf_index] = v;
     f->bytes_xfer++;
     if (f->ops->writev_buffer) {
-        add_to_iovec(f, f->buf + f->buf_index, 1);
+        add_to_iovec(f, f->buf + f->buf_index, 1, false);
     }
     f->buf_index++;
     if (f->buf_index == IO_BUF_SIZE) {
@@ -801,12 +1079,94 @@ int qemu_get_byte(QEMUFile *f)
     return result;
 }
 
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t size,
+                        int64_t pos)
+{
+    if (f->last_error) {
+        return;
+    }
+    if (!f->ops->seekable || !f->ops->writev_buffer) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return;
+    }
+
+    /* Pages that follow each other in the file go out in a single write */
+    if (f->iovcnt &&
+        (!f->iov_positioned ||
+         pos != f->positioned_start + f->positioned_len)) {
+        qemu_fflush(f);
+    }
+    if (!f->iovcnt) {
+        f->iov_positioned = true;
+        f->positioned_start = pos;
+        f->positioned_len = 0;
+    }
+    f->positioned_len += size;
+    f->bytes_xfer += size;
+    add_to_iovec(f, buf, size, false);
+}
+
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t size, int64_t pos)
+{
+    size_t done = 0;
+    int len;
+
+    assert(!qemu_file_is_writable(f));
+
+    if (!f->ops->seekable) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return 0;
+    }
+    while (done < size && !f->last_error) {
+        len = f->ops->get_buffer(f->opaque, buf + done, pos + done,
+                                 MIN(size - done, INT_MAX));
+        if (len <= 0) {
+            qemu_file_set_error(f, len < 0 ? len : -EIO);
+            break;
+        }
+        done += len;
+    }
+
+    return done;
+}
+
+bool qemu_file_is_seekable(QEMUFile *f)
+{
+    return f->ops->seekable;
+}
+
+void qemu_file_set_pos(QEMUFile *f, int64_t pos)
+{
+    if (!f->ops->seekable) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return;
+    }
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        /* Drop whatever was read ahead */
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    f->pos = pos;
+}
+
 int64_t qemu_ftell(QEMUFile *f)
 {
     qemu_fflush(f);
     return f->pos;
 }
 
+/*
+ * Bytes written so far, positioned writes included.  Unlike qemu_ftell()
+ * this does not count the parts of the file that were skipped over.
+ */
+int64_t qemu_file_total_transferred(QEMUFile *f)
+{
+    qemu_fflush(f);
+    return f->total_transferred;
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (qemu_file_get_error(f)) {
@@ -1400,6 +1400,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "         [,bootfile=f][,hostfwd=rule][,guestfwd=rule]"
 #ifndef _WIN32
                                              "[,smb=dir[,smbserver=addr]]\n"
+    "         [,thread=on|off]\n"
 #endif
     "                connect the user mode network stack to VLAN 'n', configure its\n"
     "                DHCP server and enabled optional services\n"
@@ -1475,6 +1476,13 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+#endif
+#ifdef CONFIG_AF_XDP
+    "-net af-xdp,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m]\n"
+    "                attach to queues m..m+n-1 of the host network interface 'name'\n"
+    "                through AF_XDP sockets; zero-copy is used when the driver\n"
+    "                supports it in native mode, unless 'force-copy=on'\n"
 #endif
     "-net dump[,vlan=n][,file=f][,len=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
@@ -1492,6 +1500,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #endif
 #ifdef CONFIG_NETMAP
     "netmap|"
+#endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp|"
 #endif
     "vhost-user|"
     "socket|"
@@ -1656,6 +1667,11 @@ so that QEMU behaves similar to an inetd process for that virtual server:
 qemu -net 'user,guestfwd=tcp:10.0.2.100:1234-cmd:netcat 10.10.1.1 4321'
 @end example
 
+@item thread=on|off
+Poll the host side sockets of the stack in a thread of its own rather than in
+the main loop. Frames for the guest are still handed over from the main loop.
+Not available on Windows.
+
 @end table
 
 Note: Legacy stand-alone options -tftp, -bootp, -smb and -redir are still
@@ -1876,6 +1892,27 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
+@item -netdev af-xdp,id=@var{id},ifname=@var{name}[,mode=native|skb][,force-copy=on|off][,queues=@var{n}][,start-queue=@var{m}]
+Attach to queues @var{m} to @var{m}+@var{n}-1 of the host network interface
+@var{name} through AF_XDP sockets, one per queue pair.  The packet buffers
+are allocated by QEMU and shared with the kernel.  In native mode the
+driver can receive into and send from them directly (zero-copy); in
+@option{skb} mode, with @option{force-copy=on}, or if the driver does not
+support it, the kernel copies.  By default native mode is tried first.
+The interface must be configured so that the traffic for QEMU ends up in
+those queues, for example with @code{ethtool -N}.  This option is only
+available if QEMU has been compiled with libxdp.
+
+Example:
+@example
+# test against a veth pair
+ip link add veth0 type veth peer name veth1
+ip link set veth0 up; ip link set veth1 up
+qemu-system-x86_64 linux.img \
+                   -netdev af-xdp,id=n1,ifname=veth0,mode=skb \
+                   -device virtio-net-pci,netdev=n1
+@end example
+
 @item -netdev hubport,id=@var{id},hubid=@var{hubid}
 
 Create a hub port on QEMU "vlan" @var{hubid}.
@@ -1884,13 +1921,19 @@ The hubport netdev lets you connect a NIC to a QEMU "vlan" instead of a single
 netdev.  @code{-net} and @code{-device} with parameter @option{vlan} create the
 required hub automatically.
 
-@item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off]
+@item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off][,queues=n]
 
 Establish a vhost-user netdev, backed by a chardev @var{id}. The chardev should
 be a unix domain socket backed one. The vhost-user uses a specifically defined
 protocol to pass vhost ioctl replacement messages to an application on the other
 end of the socket. On non-MSIX guests, the feature can be forced with
-@var{vhostforce}.
+@var{vhostforce}. Use 'queues=@var{n}' to specify the number of queue pairs
+to be created for multiqueue vhost-user; the backend must support at least
+that many.
+
+When the chardev is a server socket, the backend may go away and connect
+again; the link is reported down in the meantime and the virtqueues resume
+where the backend last left them.
 
 Example:
 @example
@@ -705,6 +705,58 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i",
+        .mhandler.cmd_new = qmp_marshal_input_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Start measuring the guest dirty page rate without migrating. The result is
+available through query-dirty-rate once the measurement window has elapsed.
+
+Arguments:
+
+- "calc-time": length of the measurement window in seconds (json-int)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 1 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the result of the last dirty page rate measurement.
+
+returns a json-object with the following information:
+- "status": "unstarted", "measuring", "measured" or "failed" (json-string)
+- "dirty-rate": dirty page rate in MB/s, only present when measured (json-int)
+- "start-time": start of the measurement in seconds (json-int)
+- "calc-time": length of the measurement window in seconds (json-int)
+- "vcpu-dirty-rate": per-vCPU dirty page rate, only available with TCG
+  (json-array of json-object with "id" and "dirty-rate")
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": { "status": "measured", "dirty-rate": 108,
+                 "start-time": 3712, "calc-time": 1 } }
+
 EQMP
 
     {
@@ -3044,6 +3096,8 @@ The main json-object contains the following:
             but this way upper levels don't need to care about page
             size (json-int)
          - "dirty-sync-count": times that dirty ram was synchronized (json-int)
+         - "dirty-sync-duration": time spent in the last dirty ram
+            synchronization, in microseconds (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3528,6 +3582,61 @@ Example:
       ]
    }
 
+EQMP
+
+    {
+        .name       = "query-netdev-stats",
+        .args_type  = "name:s?,histogram:b?",
+        .mhandler.cmd_new = qmp_marshal_input_query_netdev_stats,
+    },
+
+SQMP
+query-netdev-stats
+------------------
+
+Show packet counters of net clients.
+
+Returns a json-array of counters for all net clients (or for the given
+one), returning an error if the given net client doesn't exist.
+
+Arguments:
+
+- "name": net client name (json-string, optional)
+- "histogram": include the queue latency histogram (json-bool, optional)
+
+Each array entry contains the following:
+
+- "name": net client name (json-string)
+- "tx-packets": packets passed to the peer (json-int)
+- "tx-bytes": bytes passed to the peer (json-int)
+- "rx-packets": packets received from the peer (json-int)
+- "rx-bytes": bytes received from the peer (json-int)
+- "queued": packets that waited in the incoming queue (json-int)
+- "dropped": packets that were discarded (json-int)
+- "purged": packets removed from the incoming queue undelivered (json-int)
+- "queue-len": packets in the incoming queue (json-int)
+- "queue-latency": a json-array where element i counts the packets that
+  waited less than 2^i microseconds in the incoming queue, and the last
+  element all longer waits (only with "histogram": true)
+
+Example:
+
+-> { "execute": "query-netdev-stats", "arguments": { "name": "net0" } }
+<- { "return": [
+        {
+            "name": "net0",
+            "tx-packets": 18342,
+            "tx-bytes": 26318771,
+            "rx-packets": 9120,
+            "rx-bytes": 612904,
+            "queued": 37,
+            "dropped": 0,
+            "purged": 0,
+            "queue-len": 0
+        }
+      ]
+   }
+
 EQMP
 
     {
@@ -134,9 +134,12 @@ diddit:
 
 #ifndef FULL_BOLT
 	/*
-	 * This prevents us from malloc()ing too many mbufs
+	 * This prevents us from malloc()ing too many mbufs.  While a batch
+	 * of input is processed, the caller drains the queues at the end.
 	 */
-	if_start(ifm->slirp);
+	if (!slirp->if_batching) {
+		if_start(ifm->slirp);
+	}
 #endif
 }
 
@@ -234,4 +237,5 @@ void if_start(Slirp *slirp)
     }
 
     slirp->if_start_busy = false;
+    slirp_output_flush(slirp->opaque);
 }
@@ -20,10 +20,23 @@ void slirp_pollfds_fill(GArray *pollfds, uint32_t *timeout);
 
 void slirp_pollfds_poll(GArray *pollfds, int select_error);
 
+/* A threaded stack is left out of the two above; its thread polls it with
+ * these instead.  Either way, the entry points of a stack are serialized by
+ * a lock of its own and slirp_output() is called with that lock held.
+ */
+void slirp_set_threaded(Slirp *slirp);
+void slirp_instance_pollfds_fill(Slirp *slirp, GArray *pollfds,
+                                 uint32_t *timeout);
+void slirp_instance_pollfds_poll(Slirp *slirp, GArray *pollfds,
+                                 int select_error);
+
 void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len);
 
 /* you must provide the following functions: */
 void slirp_output(void *opaque, const uint8_t *pkt, int pkt_len);
+/* called after a burst of slirp_output() calls; packets may be held until
+ * then */
+void slirp_output_flush(void *opaque);
 
 int slirp_add_hostfwd(Slirp *slirp, int is_udp,
                       struct in_addr host_addr, int host_port,
@@ -134,6 +134,7 @@ void free(void *ptr);
 #include "debug.h"
 
 #include "qemu/queue.h"
+#include "qemu/thread.h"
 #include "qemu/sockets.h"
 
 #include "libslirp.h"
@@ -203,6 +204,8 @@ bool arp_table_search(Slirp *slirp, uint32_t ip_addr,
 
 struct Slirp {
     QTAILQ_ENTRY(Slirp) entry;
+    QemuMutex lock;         /* held by every libslirp entry point */
+    bool threaded;          /* polled by its own thread, not the main loop */
     u_int time_fasttimo;
     u_int last_slowtimo;
     bool do_slowtimo;
@@ -229,6 +232,7 @@ struct Slirp {
     struct mbuf if_batchq;  /* queue for non-interactive data */
     struct mbuf *next_m;    /* pointer to next mbuf to output */
     bool if_start_busy;     /* avoid if_start recursion */
+    bool if_batching;       /* if_output leaves if_start to the caller */
 
     /* ip states */
     struct ipq ipq;         /* ip reass. queue */
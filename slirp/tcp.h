@@ -38,8 +38,9 @@ typedef	uint32_t tcp_seq;
 #define      PR_SLOWHZ       2               /* 2 slow timeouts per second (approx) */
 #define      PR_FASTHZ       5               /* 5 fast timeouts per second (not important) */
 
-#define TCP_SNDSPACE 8192
-#define TCP_RCVSPACE 8192
+/* Enough to keep a full unscaled window (TCP_MAXWIN) in flight */
+#define TCP_SNDSPACE 65536
+#define TCP_RCVSPACE 65536
 
 /*
  * TCP header.
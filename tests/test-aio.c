@@ -430,6 +430,81 @@ static void test_wait_event_notifier_noflush(void)
 
 #if !defined(_WIN32)
 
+/* Enough handlers to make aio-posix.c switch to epoll */
+#define MANY_EVENT_NOTIFIERS 100
+
+static void test_wait_many_event_notifiers(void)
+{
+    EventNotifierTestData data[MANY_EVENT_NOTIFIERS];
+    int i;
+
+    for (i = 0; i < MANY_EVENT_NOTIFIERS; i++) {
+        data[i] = (EventNotifierTestData) { .n = 0, .active = 1 };
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+    g_assert(!aio_poll(ctx, false));
+
+    event_notifier_set(&data[MANY_EVENT_NOTIFIERS - 1].e);
+    wait_until_inactive(&data[MANY_EVENT_NOTIFIERS - 1]);
+    g_assert_cmpint(data[MANY_EVENT_NOTIFIERS - 1].n, ==, 1);
+    g_assert_cmpint(data[0].n, ==, 0);
+
+    /* Removing a handler takes it out of the interest set */
+    aio_set_event_notifier(ctx, &data[0].e, NULL);
+    event_notifier_set(&data[0].e);
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data[0].n, ==, 0);
+
+    event_notifier_set(&data[1].e);
+    wait_until_inactive(&data[1]);
+    g_assert_cmpint(data[1].n, ==, 1);
+
+    for (i = 0; i < MANY_EVENT_NOTIFIERS; i++) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    g_assert(!aio_poll(ctx, false));
+}
+
+static bool event_poll_cb(void *opaque)
+{
+    EventNotifierTestData *data = container_of(opaque, EventNotifierTestData,
+                                               e);
+    if (data->active <= 0) {
+        return false;
+    }
+    data->n++;
+    data->active--;
+    return true;
+}
+
+static void test_poll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 1 };
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_ready_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, event_poll_cb);
+    aio_context_set_poll_params(ctx, SCALE_MS * 10);
+    ctx->poll_ns = ctx->poll_max_ns;
+
+    /* The poll handler finds work although the notifier was never set */
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(data.active, ==, 0);
+
+    /* Polling gives up and the notifier is still dispatched */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 2);
+
+    aio_context_set_poll_params(ctx, 0);
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 2);
+    event_notifier_cleanup(&data.e);
+}
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -858,6 +933,8 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
 #if !defined(_WIN32)
+    g_test_add_func("/aio/event/wait/many",         test_wait_many_event_notifiers);
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 #endif
 
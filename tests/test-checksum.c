@@ -0,0 +1,140 @@
+/*
+ * Test the Internet checksum helpers against a byte at a time reference
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "net/checksum.h"
+
+#define BUF_SIZE (64 * 1024 + 64)
+
+static uint8_t buf[BUF_SIZE];
+
+static void fill_buf(void)
+{
+    GRand *rand = g_rand_new_with_seed(0xc0ffee);
+    int i;
+
+    for (i = 0; i < BUF_SIZE; i++) {
+        buf[i] = g_rand_int(rand);
+    }
+    g_rand_free(rand);
+}
+
+static uint32_t ref_checksum_add_cont(int len, const uint8_t *data, int seq)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i = seq; i < seq + len; i++) {
+        if (i & 1) {
+            sum += (uint32_t)data[i - seq];
+        } else {
+            sum += (uint32_t)data[i - seq] << 8;
+        }
+    }
+    return sum;
+}
+
+static void test_checksum_lengths(void)
+{
+    int off, len, seq;
+
+    /* every alignment, every tail length and both byte lanes */
+    for (off = 0; off < 32; off++) {
+        for (len = 0; len < 300; len++) {
+            for (seq = 0; seq < 2; seq++) {
+                uint32_t ref = ref_checksum_add_cont(len, buf + off, seq);
+                uint32_t sum = net_checksum_add_cont(len, buf + off, seq);
+
+                g_assert_cmphex(net_checksum_finish(sum), ==,
+                                net_checksum_finish(ref));
+            }
+        }
+    }
+}
+
+static void test_checksum_large(void)
+{
+    static const int lens[] = { 1500, 1514, 9000, 9018, 65535, 65536 };
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(lens); i++) {
+        g_assert_cmphex(net_raw_checksum(buf + 1, lens[i]), ==,
+                        net_checksum_finish(ref_checksum_add_cont(lens[i],
+                                                                  buf + 1, 0)));
+    }
+}
+
+static void test_checksum_ones(void)
+{
+    uint8_t ones[64];
+
+    /* a sum that is a multiple of 0xffff must not fold to zero */
+    memset(ones, 0xff, sizeof(ones));
+    g_assert_cmphex(net_raw_checksum(ones, sizeof(ones)), ==, 0);
+    memset(ones, 0, sizeof(ones));
+    g_assert_cmphex(net_raw_checksum(ones, sizeof(ones)), ==, 0xffff);
+}
+
+static void test_checksum_iov(void)
+{
+    struct iovec iov[5];
+    size_t sizes[5] = { 7, 1, 64, 33, 1500 };
+    size_t total = 0;
+    uint32_t off, size;
+    int i;
+
+    for (i = 0; i < 5; i++) {
+        iov[i].iov_base = buf + total;
+        iov[i].iov_len = sizes[i];
+        total += sizes[i];
+    }
+
+    for (off = 0; off < 80; off += 3) {
+        size = total - off - 5;
+        g_assert_cmphex(
+            net_checksum_finish(net_checksum_add_iov(iov, 5, off, size)), ==,
+            net_checksum_finish(ref_checksum_add_cont(size, buf + off, 0)));
+    }
+}
+
+static void perf_checksum(void)
+{
+    static const int lens[] = { 64, 1500, 9000, 65536 };
+    uint64_t bytes;
+    uint32_t sum = 0;
+    double duration;
+    int i, j, iters;
+
+    for (i = 0; i < ARRAY_SIZE(lens); i++) {
+        iters = (256 * 1024 * 1024) / lens[i];
+        g_test_timer_start();
+        for (j = 0; j < iters; j++) {
+            sum += net_checksum_add(lens[i], buf);
+        }
+        duration = g_test_timer_elapsed();
+        bytes = (uint64_t)iters * lens[i];
+
+        g_test_message("%5d byte packets: %f s, %.1f MB/s (sum %x)\n",
+                       lens[i], duration, bytes / duration / 1e6, sum);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    fill_buf();
+    g_test_add_func("/checksum/lengths", test_checksum_lengths);
+    g_test_add_func("/checksum/large", test_checksum_large);
+    g_test_add_func("/checksum/ones", test_checksum_ones);
+    g_test_add_func("/checksum/iov", test_checksum_iov);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/checksum", perf_checksum);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,229 @@
+/*
+ * Test the software TCP/UDP segmentation shared by the emulated NICs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/iov.h"
+#include "net/checksum.h"
+#include "net/gso.h"
+#include "net/tap.h"
+
+#define ETH_HLEN    14
+#define IP4_HLEN    20
+#define IP6_HLEN    40
+#define TCP_HLEN    20
+#define UDP_HLEN    8
+#define PAYLOAD     3000
+#define MSS         1000
+
+typedef struct Frame {
+    uint8_t data[NET_GSO_MAX_HDR_LEN + 0x10000];
+    size_t size;
+    int segs;
+} Frame;
+
+static uint8_t pkt[NET_GSO_MAX_HDR_LEN + PAYLOAD];
+static Frame frames[8];
+static int nframes;
+
+static void save_frame(void *opaque, const struct iovec *iov, int iovcnt,
+                       int segs)
+{
+    Frame *f = &frames[nframes++];
+
+    g_assert_cmpint(nframes, <=, ARRAY_SIZE(frames));
+    f->size = iov_to_buf(iov, iovcnt, 0, f->data, sizeof(f->data));
+    f->segs = segs;
+}
+
+/* Build Ethernet + IP + TCP/UDP headers followed by PAYLOAD bytes */
+static NetGso build_packet(bool ipv6, bool udp)
+{
+    NetGso gso = {
+        .type = udp ? VIRTIO_NET_HDR_GSO_UDP :
+                ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4,
+        .l3_off = ETH_HLEN,
+        .l4_off = ETH_HLEN + (ipv6 ? IP6_HLEN : IP4_HLEN),
+        .mss = MSS,
+    };
+    uint8_t *ip = pkt + ETH_HLEN;
+    uint8_t *l4 = pkt + gso.l4_off;
+    int i;
+
+    gso.hdr_len = gso.l4_off + (udp ? UDP_HLEN : TCP_HLEN);
+    memset(pkt, 0, gso.hdr_len);
+    stw_be_p(pkt + 12, ipv6 ? 0x86dd : 0x0800);
+    if (ipv6) {
+        ip[0] = 0x60;
+        ip[6] = udp ? 17 : 6;
+        for (i = 0; i < 32; i++) {
+            ip[8 + i] = i * 7;
+        }
+    } else {
+        ip[0] = 0x45;
+        stw_be_p(ip + 4, 0x1234);
+        ip[9] = udp ? 17 : 6;
+        stl_be_p(ip + 12, 0x0a000001);
+        stl_be_p(ip + 16, 0x0a000002);
+    }
+    stw_be_p(l4, 1024);
+    stw_be_p(l4 + 2, 80);
+    if (!udp) {
+        stl_be_p(l4 + 4, 0xfffffc00);
+        l4[12] = (TCP_HLEN / 4) << 4;
+        l4[13] = 0x19;      /* ACK, PSH, FIN */
+    }
+    for (i = 0; i < PAYLOAD; i++) {
+        pkt[gso.hdr_len + i] = i * 13 + 5;
+    }
+    return gso;
+}
+
+static uint16_t l4_checksum(const uint8_t *frame, size_t size, bool ipv6,
+                            bool udp, const NetGso *gso)
+{
+    const uint8_t *ip = frame + gso->l3_off;
+    uint32_t l4_len = size - gso->l4_off;
+    uint32_t sum;
+
+    if (ipv6) {
+        sum = net_checksum_add(32, (uint8_t *)ip + 8);
+    } else {
+        sum = net_checksum_add(8, (uint8_t *)ip + 12);
+    }
+    sum += (udp ? 17 : 6) + l4_len;
+    sum += net_checksum_add(l4_len, (uint8_t *)frame + gso->l4_off);
+    return net_checksum_finish(sum);
+}
+
+static void check_segments(bool ipv6, bool udp)
+{
+    NetGso gso = build_packet(ipv6, udp);
+    struct iovec iov[3];
+    int i;
+
+    /* split the frame in odd places, the payload must not be copied */
+    iov[0].iov_base = pkt;
+    iov[0].iov_len = 7;
+    iov[1].iov_base = pkt + 7;
+    iov[1].iov_len = gso.hdr_len + 1501 - 7;
+    iov[2].iov_base = pkt + gso.hdr_len + 1501;
+    iov[2].iov_len = PAYLOAD - 1501;
+
+    nframes = 0;
+    g_assert_cmpint(net_gso_send(iov, 3, &gso, false, save_frame, NULL), ==,
+                    PAYLOAD / MSS);
+    g_assert_cmpint(nframes, ==, PAYLOAD / MSS);
+
+    for (i = 0; i < nframes; i++) {
+        Frame *f = &frames[i];
+        uint8_t *ip = f->data + gso.l3_off;
+        uint8_t *l4 = f->data + gso.l4_off;
+
+        g_assert_cmpint(f->size, ==, gso.hdr_len + MSS);
+        g_assert_cmpint(f->segs, ==, 1);
+        g_assert(!memcmp(f->data + gso.hdr_len, pkt + gso.hdr_len + i * MSS,
+                         MSS));
+        if (ipv6) {
+            g_assert_cmpint(lduw_be_p(ip + 4), ==, f->size - gso.l4_off);
+        } else {
+            g_assert_cmpint(lduw_be_p(ip + 2), ==, f->size - gso.l3_off);
+            g_assert_cmphex(lduw_be_p(ip + 4), ==, 0x1234 + i);
+            g_assert_cmphex(net_raw_checksum(ip, IP4_HLEN), ==, 0);
+        }
+        if (udp) {
+            g_assert_cmpint(lduw_be_p(l4 + 4), ==, f->size - gso.l4_off);
+        } else {
+            g_assert_cmphex((uint32_t)ldl_be_p(l4 + 4), ==,
+                            (uint32_t)(0xfffffc00 + i * MSS));
+            g_assert_cmphex(l4[13], ==, i == nframes - 1 ? 0x19 : 0x10);
+        }
+        g_assert_cmphex(l4_checksum(f->data, f->size, ipv6, udp, &gso), ==, 0);
+    }
+}
+
+static void test_gso_tcp4(void)
+{
+    check_segments(false, false);
+}
+
+static void test_gso_tcp6(void)
+{
+    check_segments(true, false);
+}
+
+static void test_gso_udp4(void)
+{
+    check_segments(false, true);
+}
+
+static void test_gso_vnet_hdr(void)
+{
+    NetGso gso = build_packet(false, false);
+    struct iovec iov = { .iov_base = pkt, .iov_len = gso.hdr_len + PAYLOAD };
+    struct virtio_net_hdr vhdr;
+    Frame *f = &frames[0];
+
+    nframes = 0;
+    g_assert_cmpint(net_gso_send(&iov, 1, &gso, true, save_frame, NULL), ==,
+                    PAYLOAD / MSS);
+    g_assert_cmpint(nframes, ==, 1);
+    g_assert_cmpint(f->segs, ==, PAYLOAD / MSS);
+    g_assert_cmpint(f->size, ==, sizeof(vhdr) + iov.iov_len);
+
+    memcpy(&vhdr, f->data, sizeof(vhdr));
+    g_assert_cmpint(vhdr.flags, ==, VIRTIO_NET_HDR_F_NEEDS_CSUM);
+    g_assert_cmpint(vhdr.gso_type, ==, VIRTIO_NET_HDR_GSO_TCPV4);
+    g_assert_cmpint(vhdr.gso_size, ==, MSS);
+    g_assert_cmpint(vhdr.hdr_len, ==, gso.hdr_len);
+    g_assert_cmpint(vhdr.csum_start, ==, gso.l4_off);
+    g_assert_cmpint(vhdr.csum_offset, ==, 16);
+    g_assert_cmpint(lduw_be_p(f->data + sizeof(vhdr) + gso.l3_off + 2), ==,
+                    iov.iov_len - gso.l3_off);
+
+    /* UDP is never handed to the peer, but still gets an empty header */
+    gso = build_packet(false, true);
+    iov.iov_len = gso.hdr_len + PAYLOAD;
+    nframes = 0;
+    g_assert_cmpint(net_gso_send(&iov, 1, &gso, true, save_frame, NULL), ==,
+                    PAYLOAD / MSS);
+    g_assert_cmpint(nframes, ==, PAYLOAD / MSS);
+    memcpy(&vhdr, f->data, sizeof(vhdr));
+    g_assert_cmpint(vhdr.gso_type, ==, VIRTIO_NET_HDR_GSO_NONE);
+    g_assert_cmpint(f->size, ==, sizeof(vhdr) + gso.hdr_len + MSS);
+}
+
+static void test_gso_malformed(void)
+{
+    NetGso gso = build_packet(false, false);
+    struct iovec iov = { .iov_base = pkt, .iov_len = gso.hdr_len - 1 };
+
+    nframes = 0;
+    g_assert_cmpint(net_gso_send(&iov, 1, &gso, false, save_frame, NULL), ==,
+                    -1);
+    iov.iov_len = gso.hdr_len + PAYLOAD;
+    gso.mss = 0;
+    g_assert_cmpint(net_gso_send(&iov, 1, &gso, false, save_frame, NULL), ==,
+                    -1);
+    gso.mss = MSS;
+    gso.l4_off = gso.hdr_len;
+    g_assert_cmpint(net_gso_send(&iov, 1, &gso, false, save_frame, NULL), ==,
+                    -1);
+    g_assert_cmpint(nframes, ==, 0);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/gso/tcp4", test_gso_tcp4);
+    g_test_add_func("/gso/tcp6", test_gso_tcp6);
+    g_test_add_func("/gso/udp4", test_gso_udp4);
+    g_test_add_func("/gso/vnet-hdr", test_gso_vnet_hdr);
+    g_test_add_func("/gso/malformed", test_gso_malformed);
+    return g_test_run();
+}
@@ -0,0 +1,377 @@
+/*
+ * Test the packet queue that sits in front of each net client
+ *
+ * The delivery side is replaced by a receiver that records what it gets
+ * and can be told to stall, as a busy backend would.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/iov.h"
+#include "net/net.h"
+#include "net/queue.h"
+
+typedef struct TestReceiver {
+    bool stalled;
+    bool numbered;      /* check packets made by numbered_packet() */
+    ssize_t result;     /* returned instead of the size, if nonzero */
+    uint32_t next_seq;
+    int packets;
+    int batches;
+    uint8_t data[NET_BUFSIZE];
+    size_t size;
+} TestReceiver;
+
+/* Only compared against, never dereferenced */
+static int sender_a, sender_b;
+#define SENDER_A ((NetClientState *)&sender_a)
+#define SENDER_B ((NetClientState *)&sender_b)
+
+int qemu_can_send_packet(NetClientState *sender)
+{
+    return 1;
+}
+
+ssize_t qemu_deliver_packet(NetClientState *sender, unsigned flags,
+                            const uint8_t *data, size_t size, void *opaque)
+{
+    TestReceiver *r = opaque;
+
+    if (r->stalled) {
+        return 0;
+    }
+    g_assert_cmpint(size, <=, sizeof(r->data));
+    memcpy(r->data, data, size);
+    r->size = size;
+    r->packets++;
+    if (r->numbered) {
+        uint32_t seq = ldl_le_p(data);
+        size_t i;
+
+        g_assert_cmpint(seq, ==, r->next_seq);
+        for (i = 4; i < size; i++) {
+            g_assert_cmpint(data[i], ==, (uint8_t)(seq + i));
+        }
+        r->next_seq++;
+    }
+    return r->result ? r->result : size;
+}
+
+ssize_t qemu_deliver_packet_iov(NetClientState *sender, unsigned flags,
+                                const struct iovec *iov, int iovcnt,
+                                void *opaque)
+{
+    static uint8_t buf[NET_BUFSIZE];
+    size_t size = iov_to_buf(iov, iovcnt, 0, buf, sizeof(buf));
+
+    return qemu_deliver_packet(sender, flags, buf, size, opaque);
+}
+
+int qemu_deliver_packet_iov_batch(NetClientState *sender, unsigned flags,
+                                  const NetIOVPacket *pkts, int count,
+                                  void *opaque)
+{
+    TestReceiver *r = opaque;
+    int done;
+
+    r->batches++;
+    for (done = 0; done < count; done++) {
+        if (!qemu_deliver_packet_iov(sender, flags, pkts[done].iov,
+                                     pkts[done].iovcnt, opaque)) {
+            break;
+        }
+    }
+    return done;
+}
+
+static const uint8_t payload[] = "a packet for every port";
+
+static void send_shared(NetQueue **queues, int n, NetPacketBuf **shared)
+{
+    struct iovec iov[2] = {
+        { .iov_base = (uint8_t *)payload, .iov_len = 5 },
+        { .iov_base = (uint8_t *)payload + 5,
+          .iov_len = sizeof(payload) - 5 },
+    };
+    int i;
+
+    for (i = 0; i < n; i++) {
+        qemu_net_queue_send_shared(queues[i], SENDER_A,
+                                   QEMU_NET_PACKET_FLAG_NONE, iov, 2, shared,
+                                   NULL);
+    }
+}
+
+static void test_queue_shared_direct(void)
+{
+    TestReceiver r[2] = { { 0 } };
+    NetQueue *queues[2] = {
+        qemu_new_net_queue(&r[0]),
+        qemu_new_net_queue(&r[1]),
+    };
+    NetPacketBuf *shared = NULL;
+    int i;
+
+    /* nothing is copied when every receiver takes the packet */
+    send_shared(queues, 2, &shared);
+    g_assert(shared == NULL);
+    for (i = 0; i < 2; i++) {
+        g_assert_cmpint(r[i].packets, ==, 1);
+        g_assert_cmpint(r[i].size, ==, sizeof(payload));
+        g_assert(!memcmp(r[i].data, payload, sizeof(payload)));
+        qemu_del_net_queue(queues[i]);
+    }
+}
+
+static void test_queue_shared_stalled(void)
+{
+    TestReceiver r[3] = { { 0 } };
+    NetQueue *queues[3];
+    NetPacketBuf *shared = NULL;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        queues[i] = qemu_new_net_queue(&r[i]);
+    }
+    r[0].stalled = true;
+    r[2].stalled = true;
+
+    send_shared(queues, 3, &shared);
+    g_assert(shared != NULL);
+    qemu_net_packet_buf_unref(shared);
+    g_assert_cmpint(r[0].packets, ==, 0);
+    g_assert_cmpint(r[1].packets, ==, 1);
+    g_assert_cmpint(r[2].packets, ==, 0);
+
+    /* the queues still hold the packet after the sender let go of it */
+    r[0].stalled = false;
+    g_assert(qemu_net_queue_flush(queues[0]));
+    g_assert_cmpint(r[0].packets, ==, 1);
+    g_assert_cmpint(r[0].size, ==, sizeof(payload));
+    g_assert(!memcmp(r[0].data, payload, sizeof(payload)));
+
+    /* purging drops the last reference */
+    qemu_net_queue_purge(queues[2], SENDER_B);
+    qemu_net_queue_purge(queues[2], SENDER_A);
+    r[2].stalled = false;
+    g_assert(qemu_net_queue_flush(queues[2]));
+    g_assert_cmpint(r[2].packets, ==, 0);
+
+    for (i = 0; i < 3; i++) {
+        qemu_del_net_queue(queues[i]);
+    }
+}
+
+static void test_queue_stats(void)
+{
+    TestReceiver r = { 0 };
+    NetQueue *queue = qemu_new_net_queue(&r);
+    NetQueueStats stats;
+    uint64_t delivered;
+    int i;
+
+    r.stalled = true;
+    for (i = 0; i < 3; i++) {
+        qemu_net_queue_send(queue, SENDER_A, QEMU_NET_PACKET_FLAG_NONE,
+                            payload, sizeof(payload), NULL);
+    }
+    qemu_net_queue_send(queue, SENDER_B, QEMU_NET_PACKET_FLAG_NONE,
+                        payload, sizeof(payload), NULL);
+    qemu_net_queue_get_stats(queue, &stats);
+    g_assert_cmpint(stats.queued, ==, 4);
+    g_assert_cmpint(stats.len, ==, 4);
+    g_assert_cmpint(stats.dropped, ==, 0);
+
+    qemu_net_queue_purge(queue, SENDER_B);
+    r.stalled = false;
+    g_assert(qemu_net_queue_flush(queue));
+    g_assert_cmpint(r.packets, ==, 3);
+
+    qemu_net_queue_get_stats(queue, &stats);
+    g_assert_cmpint(stats.len, ==, 0);
+    g_assert_cmpint(stats.purged, ==, 1);
+    delivered = 0;
+    for (i = 0; i < NET_QUEUE_LATENCY_BUCKETS; i++) {
+        delivered += stats.latency[i];
+    }
+    g_assert_cmpint(delivered, ==, 3);
+
+    /* packets sent straight through are not counted by the queue */
+    qemu_net_queue_send(queue, SENDER_A, QEMU_NET_PACKET_FLAG_NONE,
+                        payload, sizeof(payload), NULL);
+    qemu_net_queue_get_stats(queue, &stats);
+    g_assert_cmpint(stats.queued, ==, 4);
+    g_assert_cmpint(r.packets, ==, 4);
+
+    qemu_del_net_queue(queue);
+}
+
+static uint8_t *numbered_packet(uint32_t seq, size_t size)
+{
+    static uint8_t pkt[NET_BUFSIZE];
+    size_t i;
+
+    stl_le_p(pkt, seq);
+    for (i = 4; i < size; i++) {
+        pkt[i] = seq + i;
+    }
+    return pkt;
+}
+
+static NetClientState *sent_sender;
+static ssize_t sent_ret;
+
+static void sent_cb(NetClientState *sender, ssize_t ret)
+{
+    sent_sender = sender;
+    sent_ret = ret;
+}
+
+static void test_queue_ring(void)
+{
+    static TestReceiver r;
+    NetQueue *queue = qemu_new_net_queue(&r);
+    size_t size;
+    uint32_t seq;
+
+    /* enough to wrap and grow the ring, with frames that span slots */
+    r.stalled = true;
+    r.numbered = true;
+    for (seq = 0; seq < 1000; seq++) {
+        size = 4 + (seq * 37) % 5000;
+        if (seq == 500) {
+            size = NET_BUFSIZE;
+        }
+        qemu_net_queue_send(queue, SENDER_A, QEMU_NET_PACKET_FLAG_NONE,
+                            numbered_packet(seq, size), size, NULL);
+        if (seq % 300 == 299) {
+            /* let some go, so the ring does not start at zero */
+            r.stalled = false;
+            qemu_net_queue_flush(queue);
+            r.stalled = true;
+        }
+    }
+
+    r.stalled = false;
+    g_assert(qemu_net_queue_flush(queue));
+    g_assert_cmpint(r.next_seq, ==, 1000);
+    g_assert_cmpint(r.packets, ==, 1000);
+
+    /* runs from the same sender go to the receiver together */
+    g_assert_cmpint(r.batches, <, r.packets / 16);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_queue_bounded(void)
+{
+    static TestReceiver r;
+    NetQueue *queue = qemu_new_net_queue(&r);
+    uint8_t *pkt = numbered_packet(0, 3000);
+    NetQueueStats stats;
+    int i;
+
+    /* each of these takes two slots */
+    r.stalled = true;
+    for (i = 0; i < 3000; i++) {
+        qemu_net_queue_send(queue, SENDER_A, QEMU_NET_PACKET_FLAG_NONE,
+                            pkt, 3000, NULL);
+    }
+    qemu_net_queue_get_stats(queue, &stats);
+    g_assert_cmpint(stats.len, ==, 2048);
+    g_assert_cmpint(stats.dropped, ==, 3000 - 2048);
+
+    /* a sender that waits for its callback is never dropped */
+    g_assert_cmpint(qemu_net_queue_send(queue, SENDER_B,
+                                        QEMU_NET_PACKET_FLAG_NONE,
+                                        pkt, 3000, sent_cb), ==, 0);
+    qemu_net_queue_get_stats(queue, &stats);
+    g_assert_cmpint(stats.len, ==, 2049);
+
+    r.stalled = false;
+    g_assert(qemu_net_queue_flush(queue));
+    g_assert_cmpint(r.packets, ==, 2049);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_queue_sent_cb(void)
+{
+    TestReceiver r = { 0 };
+    NetQueue *queue = qemu_new_net_queue(&r);
+    int i;
+
+    r.stalled = true;
+    for (i = 0; i < 4; i++) {
+        qemu_net_queue_send(queue, SENDER_A, QEMU_NET_PACKET_FLAG_NONE,
+                            payload, sizeof(payload), NULL);
+    }
+    g_assert_cmpint(qemu_net_queue_send(queue, SENDER_B,
+                                        QEMU_NET_PACKET_FLAG_NONE,
+                                        payload, sizeof(payload), sent_cb),
+                    ==, 0);
+
+    /* the callback sees what the receiver returned, not the size */
+    r.stalled = false;
+    r.result = -EIO;
+    sent_sender = NULL;
+    g_assert(qemu_net_queue_flush(queue));
+    g_assert_cmpint(r.packets, ==, 5);
+    g_assert(sent_sender == SENDER_B);
+    g_assert_cmpint(sent_ret, ==, -EIO);
+
+    qemu_del_net_queue(queue);
+}
+
+static void test_queue_trim(void)
+{
+    static TestReceiver r;
+    NetQueue *queue = qemu_new_net_queue(&r);
+    NetQueueStats stats;
+    uint32_t seq, idle_slots = 0;
+    int round;
+
+    r.numbered = true;
+    for (round = 0; round < 2; round++) {
+        /* a burst of two-slot packets */
+        r.stalled = true;
+        for (seq = round * 1000; seq < (round + 1) * 1000; seq++) {
+            qemu_net_queue_send(queue, SENDER_A, QEMU_NET_PACKET_FLAG_NONE,
+                                numbered_packet(seq, 3000), 3000, NULL);
+        }
+        qemu_net_queue_get_stats(queue, &stats);
+        g_assert_cmpint(stats.slots, >=, 2000);
+
+        r.stalled = false;
+        g_assert(qemu_net_queue_flush(queue));
+        g_assert_cmpint(r.next_seq, ==, (round + 1) * 1000);
+
+        /* once drained, only a few slabs are kept */
+        qemu_net_queue_get_stats(queue, &stats);
+        g_assert_cmpint(stats.len, ==, 0);
+        g_assert_cmpint(stats.slots, <, 2000);
+        if (round) {
+            g_assert_cmpint(stats.slots, ==, idle_slots);
+        }
+        idle_slots = stats.slots;
+    }
+
+    qemu_del_net_queue(queue);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/queue/shared-direct", test_queue_shared_direct);
+    g_test_add_func("/net/queue/shared-stalled", test_queue_shared_stalled);
+    g_test_add_func("/net/queue/stats", test_queue_stats);
+    g_test_add_func("/net/queue/ring", test_queue_ring);
+    g_test_add_func("/net/queue/bounded", test_queue_bounded);
+    g_test_add_func("/net/queue/sent-cb", test_queue_sent_cb);
+    g_test_add_func("/net/queue/trim", test_queue_trim);
+    return g_test_run();
+}
@@ -0,0 +1,375 @@
+/*
+ * Test the stream side of the socket netdev over a socketpair
+ *
+ * net/socket.c is set up with fd= as usual, but the net layer around it
+ * is replaced: packets it sends to its peer are recorded and checked, and
+ * the fd handlers it registers are called directly by the test.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include "qemu-common.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "monitor/monitor.h"
+#include "net/net.h"
+#include "net/clients.h"
+
+#define FRAMES          1000
+
+typedef struct TestSocket {
+    NetClientState *nc;
+    int fd;             /* our end of the socketpair */
+    int peer_fd;        /* the netdev's end */
+
+    /* Handlers the netdev registered for its end */
+    IOHandler *fd_read;
+    IOHandler *fd_write;
+    void *opaque;
+
+    /* Packets the netdev sent to its peer */
+    uint32_t next_seq;
+    int packets;
+    int batches;
+    int max_batch;
+    int room;           /* taken by the peer per batch, -1 for no limit */
+    int queued;
+
+    /* The packet the net layer would retry after a 0 return */
+    const struct iovec *retry_iov;
+    int retry_iovcnt;
+
+    /* What arrived on our end, up to the first incomplete frame */
+    uint8_t rx[2 * NET_BUFSIZE];
+    size_t rx_len;
+    uint64_t rx_total;
+    int partial;
+} TestSocket;
+
+static TestSocket ts;
+
+static size_t frame_size(uint32_t seq)
+{
+    if (seq % 100 == 50) {
+        return 9000;
+    }
+    return 4 + (seq * 37) % 1500;
+}
+
+static void fill_frame(uint8_t *buf, uint32_t seq, size_t size)
+{
+    size_t i;
+
+    stl_le_p(buf, seq);
+    for (i = 4; i < size; i++) {
+        buf[i] = seq + i;
+    }
+}
+
+static void check_frame(const uint8_t *buf, size_t size)
+{
+    uint32_t seq = ldl_le_p(buf);
+    size_t i;
+
+    g_assert_cmpint(seq, ==, ts.next_seq);
+    g_assert_cmpint(size, ==, frame_size(seq));
+    for (i = 4; i < size; i++) {
+        g_assert_cmpint(buf[i], ==, (uint8_t)(seq + i));
+    }
+    ts.next_seq++;
+    ts.packets++;
+}
+
+static void check_frame_iov(const struct iovec *iov, int iovcnt)
+{
+    static uint8_t buf[NET_BUFSIZE];
+    size_t size = iov_to_buf(iov, iovcnt, 0, buf, sizeof(buf));
+
+    check_frame(buf, size);
+}
+
+/* The parts of the net layer that net/socket.c uses */
+
+NetClientState *qemu_new_net_client(NetClientInfo *info,
+                                    NetClientState *peer,
+                                    const char *model,
+                                    const char *name)
+{
+    NetClientState *nc = g_malloc0(info->size);
+
+    nc->info = info;
+    nc->peer = peer;
+    nc->model = g_strdup(model);
+    nc->name = g_strdup(name);
+    ts.nc = nc;
+    return nc;
+}
+
+int qemu_can_send_packet(NetClientState *nc)
+{
+    return 1;
+}
+
+void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
+{
+    check_frame(buf, size);
+}
+
+ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
+                          int iovcnt)
+{
+    /* only used for what follows a queued packet, so it queues too */
+    check_frame_iov(iov, iovcnt);
+    ts.queued++;
+    return 0;
+}
+
+int qemu_sendv_packets_async(NetClientState *nc, const NetIOVPacket *pkts,
+                             int count, NetPacketSent *sent_cb)
+{
+    int i;
+
+    ts.batches++;
+    ts.max_batch = MAX(ts.max_batch, count);
+    for (i = 0; i < count; i++) {
+        check_frame_iov(pkts[i].iov, pkts[i].iovcnt);
+        if (i == ts.room) {
+            ts.queued++;
+            return i;
+        }
+    }
+    return count;
+}
+
+void qemu_flush_queued_packets(NetClientState *nc)
+{
+    g_assert(ts.retry_iov);
+    if (nc->info->receive_iov(nc, ts.retry_iov, ts.retry_iovcnt)) {
+        ts.retry_iov = NULL;
+    }
+}
+
+int qemu_set_fd_handler2(int fd,
+                         IOCanReadHandler *fd_read_poll,
+                         IOHandler *fd_read,
+                         IOHandler *fd_write,
+                         void *opaque)
+{
+    ts.fd_read = fd_read;
+    ts.fd_write = fd_write;
+    ts.opaque = opaque;
+    return 0;
+}
+
+int qemu_set_fd_handler(int fd,
+                        IOHandler *fd_read,
+                        IOHandler *fd_write,
+                        void *opaque)
+{
+    return qemu_set_fd_handler2(fd, NULL, fd_read, fd_write, opaque);
+}
+
+int monitor_handle_fd_param(Monitor *mon, const char *fdname)
+{
+    return atoi(fdname);
+}
+
+int parse_host_port(struct sockaddr_in *saddr, const char *str)
+{
+    return -1;
+}
+
+static void socket_setup(void)
+{
+    NetdevSocketOptions sock = { 0 };
+    NetClientOptions opts = {
+        .kind = NET_CLIENT_OPTIONS_KIND_SOCKET,
+        .socket = &sock,
+    };
+    char fdname[16];
+    int sv[2];
+
+    memset(&ts, 0, sizeof(ts));
+    ts.room = -1;
+    g_assert_cmpint(socketpair(PF_UNIX, SOCK_STREAM, 0, sv), ==, 0);
+    ts.fd = sv[0];
+    ts.peer_fd = sv[1];
+    snprintf(fdname, sizeof(fdname), "%d", sv[1]);
+    sock.has_fd = true;
+    sock.fd = fdname;
+    g_assert_cmpint(net_init_socket(&opts, "socket0", NULL), ==, 0);
+    g_assert(ts.nc);
+    g_assert(ts.fd_read);
+    g_assert(!ts.fd_write);
+}
+
+static void socket_teardown(void)
+{
+    ts.nc->info->cleanup(ts.nc);
+    g_assert(!ts.fd_read);
+    g_assert(!ts.fd_write);
+    g_free(ts.nc->model);
+    g_free(ts.nc->name);
+    g_free(ts.nc);
+    close(ts.fd);
+}
+
+/* Write numbered frames to the netdev in chunks of the given sizes */
+static void stream_to_netdev(const size_t *chunks, int nr_chunks)
+{
+    static uint8_t stream[FRAMES * (4 + 9000)];
+    size_t len = 0, off = 0;
+    uint32_t seq;
+    int i = 0;
+
+    for (seq = 0; seq < FRAMES; seq++) {
+        size_t size = frame_size(seq);
+
+        stl_be_p(stream + len, size);
+        fill_frame(stream + len + 4, seq, size);
+        len += 4 + size;
+    }
+
+    while (off < len) {
+        size_t chunk = MIN(chunks[i++ % nr_chunks], len - off);
+
+        g_assert_cmpint(write(ts.fd, stream + off, chunk), ==, chunk);
+        off += chunk;
+        /* each chunk fits in one read */
+        ts.fd_read(ts.opaque);
+    }
+    g_assert_cmpint(ts.next_seq, ==, FRAMES);
+    g_assert_cmpint(ts.packets, ==, FRAMES);
+}
+
+/* Frame and header boundaries fall anywhere in a read */
+static const size_t recv_chunks[] = { 7, 1000, 3, 20000, 1, 1500, 65536 };
+
+static void test_socket_stream_recv(void)
+{
+    socket_setup();
+    stream_to_netdev(recv_chunks, ARRAY_SIZE(recv_chunks));
+
+    /* the small frames in one read go to the peer together */
+    g_assert_cmpint(ts.max_batch, >, 8);
+    g_assert_cmpint(ts.queued, ==, 0);
+    socket_teardown();
+}
+
+static void test_socket_stream_recv_stalled(void)
+{
+    /* the rest of a batch follows the packet the peer left */
+    socket_setup();
+    ts.room = 3;
+    stream_to_netdev(recv_chunks, ARRAY_SIZE(recv_chunks));
+    g_assert_cmpint(ts.queued, >, 0);
+    socket_teardown();
+}
+
+static int socket_pending(int fd)
+{
+    int avail;
+
+    g_assert_cmpint(ioctl(fd, FIONREAD, &avail), ==, 0);
+    return avail;
+}
+
+/* Read up to max bytes from our end and check the frames in them */
+static void socket_drain(size_t max)
+{
+    ssize_t len;
+    uint32_t size;
+
+    max = MIN(max, sizeof(ts.rx) - ts.rx_len);
+    len = read(ts.fd, ts.rx + ts.rx_len, max);
+    if (len < 0) {
+        g_assert_cmpint(errno, ==, EAGAIN);
+        return;
+    }
+    ts.rx_len += len;
+    ts.rx_total += len;
+    while (ts.rx_len >= 4) {
+        size = ldl_be_p(ts.rx);
+        g_assert_cmpint(size, <=, NET_BUFSIZE);
+        if (ts.rx_len < 4 + size) {
+            break;
+        }
+        check_frame(ts.rx + 4, size);
+        ts.rx_len -= 4 + size;
+        memmove(ts.rx, ts.rx + 4 + size, ts.rx_len);
+    }
+}
+
+static void test_socket_stream_send(void)
+{
+    static uint8_t frame[9000];
+    struct iovec iov[12];
+    uint64_t start = 0;
+    int sndbuf = 4096;
+    uint32_t seq;
+
+    socket_setup();
+    g_assert_cmpint(setsockopt(ts.peer_fd, SOL_SOCKET, SO_SNDBUF,
+                               &sndbuf, sizeof(sndbuf)), ==, 0);
+    qemu_set_nonblock(ts.fd);
+
+    for (seq = 0; seq < FRAMES; seq++) {
+        size_t size = frame_size(seq);
+        int iovcnt = 1 + seq % ARRAY_SIZE(iov);
+        size_t off = 0;
+        ssize_t ret;
+        int i;
+
+        /* in one piece, a few, or more than fit in the on-stack vector */
+        fill_frame(frame, seq, size);
+        for (i = 0; i < iovcnt; i++) {
+            iov[i].iov_base = frame + off;
+            iov[i].iov_len = i == iovcnt - 1 ? size - off
+                                             : MIN(size - off, 3 + i);
+            off += iov[i].iov_len;
+        }
+
+        ret = ts.nc->info->receive_iov(ts.nc, iov, iovcnt);
+        if (ret) {
+            g_assert_cmpint(ret, ==, size);
+        } else {
+            ts.retry_iov = iov;
+            ts.retry_iovcnt = iovcnt;
+            if (ts.rx_total + socket_pending(ts.fd) > start) {
+                ts.partial++;
+            }
+            while (ts.retry_iov) {
+                g_assert(ts.fd_write);
+                socket_drain(1000);
+                ts.fd_write(ts.opaque);
+            }
+        }
+        start += 4 + size;
+    }
+    while (ts.rx_total < start) {
+        socket_drain(sizeof(ts.rx));
+    }
+
+    g_assert_cmpint(ts.next_seq, ==, FRAMES);
+    g_assert_cmpint(ts.rx_len, ==, 0);
+    /* some frames went out in pieces and were resumed from send_index */
+    g_assert_cmpint(ts.partial, >, 0);
+    g_assert(!ts.fd_write);
+    socket_teardown();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/socket/stream-recv", test_socket_stream_recv);
+    g_test_add_func("/net/socket/stream-recv-stalled",
+                    test_socket_stream_recv_stalled);
+    g_test_add_func("/net/socket/stream-send", test_socket_stream_send);
+    return g_test_run();
+}
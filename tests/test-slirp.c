@@ -0,0 +1,537 @@
+/*
+ * TCP throughput through slirp, from a local server to a minimal guest
+ *
+ * The slirp netdev of net/slirp.c is set up as usual, but the net layer
+ * around it is replaced: its peer is a "guest" TCP receiver that checks
+ * that the stream arrives in order and intact and acks everything it got
+ * after each poll of the slirp sockets.  The guest can be told to take
+ * only a few frames per poll and queue the rest, as a busy NIC would.
+ * With thread=on, the test takes the place of the main loop and runs the
+ * bottom half through which the slirp thread hands its frames over.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/iov.h"
+#include "qemu/atomic.h"
+#include "qemu/event_notifier.h"
+#include "block/aio.h"
+#include "net/checksum.h"
+#include "net/eth.h"
+#include "net/net.h"
+#include "net/clients.h"
+#include "sysemu/char.h"
+#include "slirp/libslirp.h"
+
+#define ETH_HLEN        14
+#define ETH_P_ARP       0x0806
+#define IP_HLEN         20
+#define TCP_HLEN        20
+#define TCP_SYN_HLEN    24      /* with an MSS option */
+
+#define TCP_FIN         0x01
+#define TCP_SYN         0x02
+#define TCP_RST         0x04
+#define TCP_ACK         0x10
+
+#define GUEST_PORT      40000
+#define GUEST_WIN       65535
+
+#define GUEST_FRAME_MAX 2048
+#define GUEST_BACKLOG   256
+
+static const uint8_t guest_mac[6] = { 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 };
+static const uint8_t slirp_mac[6] = { 0x52, 0x55, 0x0a, 0x00, 0x02, 0x02 };
+static const uint8_t guest_ip[4] = { 10, 0, 2, 15 };
+static const uint8_t host_ip[4] = { 10, 0, 2, 2 };
+
+typedef struct TestGuest {
+    NetClientState *slirp_nc;
+    uint16_t server_port;
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    bool connected;
+    bool fin;
+    bool need_ack;
+    uint64_t received;
+    int frames;
+    int batches;
+
+    /* Frames taken before the guest stalls in each poll, -1 for no limit */
+    int room;
+    int room_per_poll;
+    /* What the net layer would queue for a stalled guest, in order */
+    uint8_t backlog[GUEST_BACKLOG][GUEST_FRAME_MAX];
+    size_t backlog_len[GUEST_BACKLOG];
+    int backlog_count;
+    int queued;
+} TestGuest;
+
+typedef struct TestServer {
+    int listen_fd;
+    uint64_t size;
+} TestServer;
+
+#define PATTERN_PERIOD  251
+#define SEND_CHUNK      65536
+
+static TestGuest guest;
+
+/* The stream repeats every PATTERN_PERIOD bytes */
+static uint8_t pattern[PATTERN_PERIOD + SEND_CHUNK];
+
+static void fill_pattern(void)
+{
+    int i;
+
+    for (i = 0; i < sizeof(pattern); i++) {
+        pattern[i] = i % PATTERN_PERIOD;
+    }
+}
+
+static void guest_receive(const uint8_t *pkt, int pkt_len)
+{
+    const uint8_t *ip = pkt + ETH_HLEN;
+    const uint8_t *tcp;
+    uint32_t seq, len;
+    uint8_t flags;
+
+    guest.frames++;
+    if (pkt_len < ETH_HLEN + IP_HLEN + TCP_HLEN ||
+        lduw_be_p(pkt + 12) != ETH_P_IP || ip[9] != IP_PROTO_TCP) {
+        return;
+    }
+
+    tcp = ip + (ip[0] & 0xf) * 4;
+    g_assert_cmpint(lduw_be_p(tcp + 2), ==, GUEST_PORT);
+    seq = ldl_be_p(tcp + 4);
+    flags = tcp[13];
+    len = lduw_be_p(ip + 2) - (tcp - ip) - (tcp[12] >> 4) * 4;
+    g_assert(!(flags & TCP_RST));
+
+    if (flags & TCP_SYN) {
+        guest.rcv_nxt = seq + 1;
+        guest.connected = true;
+    } else if (seq == guest.rcv_nxt) {
+        g_assert(!memcmp(tcp + (tcp[12] >> 4) * 4,
+                         pattern + guest.received % PATTERN_PERIOD, len));
+        guest.received += len;
+        guest.rcv_nxt += len;
+        if (flags & TCP_FIN) {
+            guest.rcv_nxt++;
+            guest.fin = true;
+        }
+    }
+    guest.need_ack = true;
+}
+
+/* Take a frame if the guest has room, otherwise queue it */
+static bool guest_deliver(const struct iovec *iov, int iovcnt)
+{
+    size_t len = iov_size(iov, iovcnt);
+
+    g_assert_cmpint(len, <=, GUEST_FRAME_MAX);
+    if (guest.backlog_count || !guest.room) {
+        g_assert_cmpint(guest.backlog_count, <, GUEST_BACKLOG);
+        iov_to_buf(iov, iovcnt, 0, guest.backlog[guest.backlog_count], len);
+        guest.backlog_len[guest.backlog_count++] = len;
+        guest.queued++;
+        return false;
+    }
+    if (guest.room > 0) {
+        guest.room--;
+    }
+    if (iovcnt == 1) {
+        guest_receive(iov[0].iov_base, len);
+    } else {
+        uint8_t buf[GUEST_FRAME_MAX];
+
+        iov_to_buf(iov, iovcnt, 0, buf, len);
+        guest_receive(buf, len);
+    }
+    return true;
+}
+
+/* The guest caught up with what was queued for it */
+static void guest_drain(void)
+{
+    int i;
+
+    for (i = 0; i < guest.backlog_count; i++) {
+        guest_receive(guest.backlog[i], guest.backlog_len[i]);
+    }
+    guest.backlog_count = 0;
+    guest.room = guest.room_per_poll;
+}
+
+/* The parts of the net layer that net/slirp.c uses */
+
+NetClientState *qemu_new_net_client(NetClientInfo *info,
+                                    NetClientState *peer,
+                                    const char *model,
+                                    const char *name)
+{
+    NetClientState *nc = g_malloc0(info->size);
+
+    nc->info = info;
+    nc->peer = peer;
+    nc->model = g_strdup(model);
+    nc->name = g_strdup(name);
+    guest.slirp_nc = nc;
+    return nc;
+}
+
+void qemu_del_net_client(NetClientState *nc)
+{
+    nc->info->cleanup(nc);
+    g_free(nc->model);
+    g_free(nc->name);
+    g_free(nc);
+}
+
+void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
+{
+    struct iovec iov = { .iov_base = (uint8_t *)buf, .iov_len = size };
+
+    guest_deliver(&iov, 1);
+}
+
+ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
+                          int iovcnt)
+{
+    return guest_deliver(iov, iovcnt) ? iov_size(iov, iovcnt) : 0;
+}
+
+int qemu_sendv_packets_async(NetClientState *nc, const NetIOVPacket *pkts,
+                             int count, NetPacketSent *sent_cb)
+{
+    int i;
+
+    guest.batches++;
+    for (i = 0; i < count; i++) {
+        if (!guest_deliver(pkts[i].iov, pkts[i].iovcnt)) {
+            break;
+        }
+    }
+    return i;
+}
+
+NetClientState *net_hub_find_client_by_name(int hub_id, const char *name)
+{
+    return NULL;
+}
+
+int net_hub_id_for_client(NetClientState *nc, int *id)
+{
+    return -1;
+}
+
+CharDriverState *qemu_chr_new(const char *label, const char *filename,
+                              void (*init)(struct CharDriverState *s))
+{
+    return NULL;
+}
+
+void qemu_chr_add_handlers(CharDriverState *s,
+                           IOCanReadHandler *fd_can_read,
+                           IOReadHandler *fd_read,
+                           IOEventHandler *fd_event,
+                           void *opaque)
+{
+}
+
+void qemu_chr_fe_claim_no_fail(CharDriverState *s)
+{
+}
+
+/* The one bottom half there is, that of a threaded slirp */
+
+struct QEMUBH {
+    QEMUBHFunc *cb;
+    void *opaque;
+    bool scheduled;
+};
+
+static QEMUBH *slirp_bh;
+static EventNotifier bh_notifier;
+
+QEMUBH *qemu_bh_new(QEMUBHFunc *cb, void *opaque)
+{
+    g_assert(!slirp_bh);
+    slirp_bh = g_new0(QEMUBH, 1);
+    slirp_bh->cb = cb;
+    slirp_bh->opaque = opaque;
+    return slirp_bh;
+}
+
+void qemu_bh_schedule(QEMUBH *bh)
+{
+    atomic_set(&bh->scheduled, true);
+    event_notifier_set(&bh_notifier);
+}
+
+void qemu_bh_delete(QEMUBH *bh)
+{
+    g_assert(bh == slirp_bh);
+    g_free(bh);
+    slirp_bh = NULL;
+}
+
+/* What the main loop does for a threaded slirp: run its bottom half */
+static void slirp_wait_bh(void)
+{
+    GPollFD pfd = {
+        .fd = event_notifier_get_fd(&bh_notifier),
+        .events = G_IO_IN,
+    };
+
+    g_poll(&pfd, 1, 100);
+    event_notifier_test_and_clear(&bh_notifier);
+    if (atomic_xchg(&slirp_bh->scheduled, false)) {
+        slirp_bh->cb(slirp_bh->opaque);
+    }
+}
+
+static void guest_input(const uint8_t *pkt, int len)
+{
+    g_assert_cmpint(guest.slirp_nc->info->receive(guest.slirp_nc, pkt, len),
+                    ==, len);
+}
+
+static void guest_send_arp(void)
+{
+    uint8_t pkt[64];
+
+    /* A gratuitous ARP tells slirp where the guest is */
+    memset(pkt, 0, sizeof(pkt));
+    memset(pkt, 0xff, 6);
+    memcpy(pkt + 6, guest_mac, 6);
+    stw_be_p(pkt + 12, ETH_P_ARP);
+    stw_be_p(pkt + 14, 1);
+    stw_be_p(pkt + 16, ETH_P_IP);
+    pkt[18] = 6;
+    pkt[19] = 4;
+    stw_be_p(pkt + 20, 1);
+    memcpy(pkt + 22, guest_mac, 6);
+    memcpy(pkt + 28, guest_ip, 4);
+    memcpy(pkt + 38, guest_ip, 4);
+    guest_input(pkt, sizeof(pkt));
+}
+
+static void guest_send_tcp(uint8_t flags)
+{
+    uint8_t pkt[ETH_HLEN + IP_HLEN + TCP_SYN_HLEN];
+    uint8_t *ip = pkt + ETH_HLEN;
+    uint8_t *tcp = ip + IP_HLEN;
+    int tcp_hlen = (flags & TCP_SYN) ? TCP_SYN_HLEN : TCP_HLEN;
+    int len = ETH_HLEN + IP_HLEN + tcp_hlen;
+
+    memset(pkt, 0, sizeof(pkt));
+    memcpy(pkt, slirp_mac, 6);
+    memcpy(pkt + 6, guest_mac, 6);
+    stw_be_p(pkt + 12, ETH_P_IP);
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, IP_HLEN + tcp_hlen);
+    ip[8] = 64;
+    ip[9] = IP_PROTO_TCP;
+    memcpy(ip + 12, guest_ip, 4);
+    memcpy(ip + 16, host_ip, 4);
+    stw_be_p(ip + 10, net_raw_checksum(ip, IP_HLEN));
+
+    stw_be_p(tcp, GUEST_PORT);
+    stw_be_p(tcp + 2, guest.server_port);
+    stl_be_p(tcp + 4, guest.snd_nxt);
+    stl_be_p(tcp + 8, guest.rcv_nxt);
+    tcp[12] = (tcp_hlen / 4) << 4;
+    tcp[13] = flags;
+    stw_be_p(tcp + 14, GUEST_WIN);
+    if (flags & TCP_SYN) {
+        tcp[20] = 2;
+        tcp[21] = 4;
+        stw_be_p(tcp + 22, 1460);
+        guest.snd_nxt++;
+    }
+    net_checksum_calculate(pkt, len);
+
+    guest_input(pkt, len);
+}
+
+/* One iteration of what the main loop does for slirp */
+static void slirp_poll(GArray *pollfds)
+{
+    uint32_t timeout = 100;
+    int ret;
+
+    g_array_set_size(pollfds, 0);
+    slirp_pollfds_fill(pollfds, &timeout);
+    ret = g_poll((GPollFD *)pollfds->data, pollfds->len, timeout);
+    slirp_pollfds_poll(pollfds, ret < 0);
+}
+
+static void *server_thread(void *opaque)
+{
+    TestServer *server = opaque;
+    uint64_t off;
+    ssize_t len;
+    int fd;
+
+    fd = qemu_accept(server->listen_fd, NULL, NULL);
+    g_assert_cmpint(fd, >=, 0);
+
+    for (off = 0; off < server->size; off += len) {
+        len = MIN(SEND_CHUNK, server->size - off);
+        len = send(fd, pattern + off % PATTERN_PERIOD, len, 0);
+        g_assert_cmpint(len, >, 0);
+    }
+    closesocket(fd);
+    return NULL;
+}
+
+static double transfer(uint64_t size, int room_per_poll, bool threaded)
+{
+    NetdevUserOptions user = {
+        .has_thread = threaded,
+        .thread = threaded,
+    };
+    NetClientOptions opts = {
+        .kind = NET_CLIENT_OPTIONS_KIND_USER,
+        .user = &user,
+    };
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    TestServer server = { .size = size };
+    QemuThread thread;
+    GArray *pollfds;
+    uint32_t timeout = 100;
+    double duration;
+
+    server.listen_fd = qemu_socket(AF_INET, SOCK_STREAM, 0);
+    g_assert_cmpint(server.listen_fd, >=, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    g_assert_cmpint(bind(server.listen_fd, (struct sockaddr *)&addr,
+                         sizeof(addr)), ==, 0);
+    g_assert_cmpint(listen(server.listen_fd, 1), ==, 0);
+    g_assert_cmpint(getsockname(server.listen_fd, (struct sockaddr *)&addr,
+                                &addrlen), ==, 0);
+    qemu_thread_create(&thread, "slirp-server", server_thread, &server,
+                       QEMU_THREAD_JOINABLE);
+
+    memset(&guest, 0, sizeof(guest));
+    guest.room = guest.room_per_poll = room_per_poll;
+    g_assert_cmpint(net_init_slirp(&opts, "user0", NULL), ==, 0);
+    g_assert(guest.slirp_nc);
+    g_assert(!slirp_bh == !threaded);
+    guest.server_port = ntohs(addr.sin_port);
+    guest.snd_nxt = 0x1000;
+    pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
+
+    g_test_timer_start();
+    guest_send_arp();
+    guest_send_tcp(TCP_SYN);
+    while (!guest.fin) {
+        /* Acks can clock out more data before slirp polls again */
+        while (guest.need_ack) {
+            guest.need_ack = false;
+            guest_send_tcp(guest.connected ? TCP_ACK : TCP_SYN);
+        }
+        if (threaded) {
+            /* The main loop has nothing to poll for it */
+            g_array_set_size(pollfds, 0);
+            slirp_pollfds_fill(pollfds, &timeout);
+            g_assert_cmpint(pollfds->len, ==, 0);
+            slirp_wait_bh();
+        } else {
+            slirp_poll(pollfds);
+        }
+        guest_drain();
+    }
+    duration = g_test_timer_elapsed();
+
+    g_assert_cmpint(guest.received, ==, size);
+
+    qemu_thread_join(&thread);
+    g_array_free(pollfds, TRUE);
+    qemu_del_net_client(guest.slirp_nc);
+    g_assert(!slirp_bh);
+    closesocket(server.listen_fd);
+    return duration;
+}
+
+static void test_slirp_tcp_stream(void)
+{
+    transfer(4 * 1024 * 1024, -1, false);
+
+    /* Each poll sends out a window's worth of segments at once */
+    g_assert_cmpint(guest.queued, ==, 0);
+    g_assert_cmpint(guest.frames, >, 8 * guest.batches);
+}
+
+static void test_slirp_tcp_stream_stalled(void)
+{
+    /* The rest of a batch queues up behind the frame the guest left */
+    transfer(4 * 1024 * 1024, 5, false);
+    g_assert_cmpint(guest.queued, >, 0);
+}
+
+static void test_slirp_tcp_stream_thread(void)
+{
+    transfer(4 * 1024 * 1024, -1, true);
+
+    /* What the thread read in one poll reaches the guest together */
+    g_assert_cmpint(guest.frames, >, 8 * guest.batches);
+}
+
+static void test_slirp_tcp_stream_thread_stalled(void)
+{
+    transfer(4 * 1024 * 1024, 5, true);
+    g_assert_cmpint(guest.queued, >, 0);
+}
+
+static void perf_transfer(bool threaded)
+{
+    uint64_t size = 1024 * 1024 * 1024;
+    double duration = transfer(size, -1, threaded);
+
+    g_test_message("%" PRIu64 " MB in %f s, %.1f Mbit/s, "
+                   "%.1f frames per batch\n",
+                   size >> 20, duration, size * 8 / duration / 1e6,
+                   (double)guest.frames / guest.batches);
+}
+
+static void perf_slirp_tcp_stream(void)
+{
+    perf_transfer(false);
+}
+
+static void perf_slirp_tcp_stream_thread(void)
+{
+    perf_transfer(true);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    fill_pattern();
+    g_assert_cmpint(event_notifier_init(&bh_notifier, 0), ==, 0);
+    g_test_add_func("/slirp/tcp-stream", test_slirp_tcp_stream);
+    g_test_add_func("/slirp/tcp-stream-stalled",
+                    test_slirp_tcp_stream_stalled);
+    g_test_add_func("/slirp/tcp-stream-thread", test_slirp_tcp_stream_thread);
+    g_test_add_func("/slirp/tcp-stream-thread-stalled",
+                    test_slirp_tcp_stream_thread_stalled);
+    if (g_test_perf()) {
+        g_test_add_func("/perf/slirp/tcp-stream", perf_slirp_tcp_stream);
+        g_test_add_func("/perf/slirp/tcp-stream-thread",
+                        perf_slirp_tcp_stream_thread);
+    }
+    return g_test_run();
+}
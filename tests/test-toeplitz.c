@@ -0,0 +1,115 @@
+/*
+ * Test the Toeplitz hash against the RSS verification suite
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include "qemu/toeplitz.h"
+
+typedef struct {
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t ip_hash;
+    uint32_t l4_hash;
+} ToeplitzTest;
+
+static const ToeplitzTest test_ipv4_data[] = {
+    { { 66, 9, 149, 187 }, { 161, 142, 100, 80 }, 2794, 1766,
+      0x323e8fc2, 0x51ccc178 },
+    { { 199, 92, 111, 2 }, { 65, 69, 140, 83 }, 14230, 4739,
+      0xd718262a, 0xc626b0ea },
+    { { 24, 19, 198, 95 }, { 12, 22, 207, 184 }, 12898, 38024,
+      0xd2d0a5de, 0x5c2b394a },
+    { { 38, 27, 205, 30 }, { 209, 142, 163, 6 }, 48228, 2217,
+      0x82989176, 0xafc7327f },
+    { { 153, 39, 163, 191 }, { 202, 188, 127, 2 }, 44251, 1303,
+      0x5d1809c5, 0x10e828a2 },
+};
+
+static const ToeplitzTest test_ipv6_data[] = {
+    { { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x1f, 0xff,
+        0, 0, 0, 0, 0, 0, 0, 0x07 },
+      { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x00, 0x03,
+        0, 0, 0, 0, 0, 0, 0, 0x01 },
+      2794, 1766, 0x2cc18cd5, 0x40207d3d },
+    { { 0x3f, 0xfe, 0x05, 0x01, 0x00, 0x08, 0x00, 0x00,
+        0x02, 0x60, 0x97, 0xff, 0xfe, 0x40, 0xef, 0xab },
+      { 0xff, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01 },
+      14230, 4739, 0x0f0c461c, 0xdde51bbf },
+    { { 0x3f, 0xfe, 0x19, 0x00, 0x45, 0x45, 0x00, 0x03,
+        0x02, 0x00, 0xf8, 0xff, 0xfe, 0x21, 0x67, 0xcf },
+      { 0xfe, 0x80, 0, 0, 0, 0, 0, 0,
+        0x02, 0x00, 0xf8, 0xff, 0xfe, 0x21, 0x67, 0xcf },
+      44251, 38024, 0x4b61e985, 0x02d1feef },
+};
+
+static void check_hash(const ToeplitzTest *test, size_t addr_len)
+{
+    uint8_t input[2 * 16 + 4];
+    size_t len = 0;
+    uint32_t hash;
+
+    memcpy(input, test->src, addr_len);
+    len += addr_len;
+    memcpy(input + len, test->dst, addr_len);
+    len += addr_len;
+
+    hash = toeplitz_hash(toeplitz_default_key, sizeof(toeplitz_default_key),
+                         input, len);
+    g_assert_cmphex(hash, ==, test->ip_hash);
+
+    input[len++] = test->sport >> 8;
+    input[len++] = test->sport;
+    input[len++] = test->dport >> 8;
+    input[len++] = test->dport;
+
+    hash = toeplitz_hash(toeplitz_default_key, sizeof(toeplitz_default_key),
+                         input, len);
+    g_assert_cmphex(hash, ==, test->l4_hash);
+}
+
+static void test_toeplitz_ipv4(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(test_ipv4_data); i++) {
+        check_hash(&test_ipv4_data[i], 4);
+    }
+}
+
+static void test_toeplitz_ipv6(void)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(test_ipv6_data); i++) {
+        check_hash(&test_ipv6_data[i], 16);
+    }
+}
+
+static void test_toeplitz_short_key(void)
+{
+    static const uint8_t data[] = { 0xde, 0xad, 0xbe, 0xef, 0x12, 0x34 };
+    uint8_t padded[sizeof(data) + 4] = { 0 };
+
+    /* Key bits past the end of a short key behave as zeroes */
+    memcpy(padded, toeplitz_default_key, 6);
+    g_assert_cmphex(toeplitz_hash(toeplitz_default_key, 6,
+                                  data, sizeof(data)),
+                    ==, toeplitz_hash(padded, sizeof(padded),
+                                      data, sizeof(data)));
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/toeplitz/ipv4", test_toeplitz_ipv4);
+    g_test_add_func("/toeplitz/ipv6", test_toeplitz_ipv6);
+    g_test_add_func("/toeplitz/short-key", test_toeplitz_short_key);
+    return g_test_run();
+}
@@ -47,11 +47,25 @@
 #define QEMU_CMD        QEMU_CMD_ACCEL QEMU_CMD_MEM QEMU_CMD_CHR \
                         QEMU_CMD_NETDEV QEMU_CMD_NET QEMU_CMD_ROM
 
+/* QEMU only takes the backend back when it is the server */
+#define QEMU_CMD_RECONNECT  QEMU_CMD_ACCEL QEMU_CMD_MEM QEMU_CMD_CHR \
+                            ",server,nowait" QEMU_CMD_NETDEV QEMU_CMD_NET \
+                            QEMU_CMD_ROM
+
+#define MQ_QUEUES           2
+#define QEMU_CMD_MQ         QEMU_CMD_ACCEL QEMU_CMD_MEM QEMU_CMD_CHR \
+                            QEMU_CMD_NETDEV ",queues=2" \
+                            " -device virtio-net-pci,netdev=net0,mq=on," \
+                            "vectors=6 " QEMU_CMD_ROM
+
 #define HUGETLBFS_MAGIC       0x958458f6
 
 /*********** FROM hw/virtio/vhost-user.c *************************************/
 
 #define VHOST_MEMORY_MAX_NREGIONS    8
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+
+#define VHOST_USER_PROTOCOL_F_MQ    0
 
 typedef enum VhostUserRequest {
     VHOST_USER_NONE = 0,
@@ -69,6 +83,10 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_VRING_KICK = 12,
     VHOST_USER_SET_VRING_CALL = 13,
     VHOST_USER_SET_VRING_ERR = 14,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_GET_QUEUE_NUM = 17,
+    VHOST_USER_SET_VRING_ENABLE = 18,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -113,9 +131,15 @@ static VhostUserMsg m __attribute__ ((unused));
 
 int fds_num = 0, fds[VHOST_MEMORY_MAX_NREGIONS];
 static VhostUserMemory memory;
+static const char *hugefs;
 static GMutex *data_mutex;
 static GCond *data_cond;
 
+/* What the backend of the multiqueue test was asked */
+static CharDriverState *mq_chr;
+static bool mq_got_queue_num;
+static uint32_t mq_vring_enable;
+
 static gint64 _get_time(void)
 {
 #ifdef HAVE_MONOTONIC_TIME
@@ -293,11 +317,39 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
         /* send back features to qemu */
         msg.flags |= VHOST_USER_REPLY_MASK;
         msg.size = sizeof(m.u64);
-        msg.u64 = 0;
+        msg.u64 = 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+        p = (uint8_t *) &msg;
+        qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
+        break;
+
+    case VHOST_USER_GET_PROTOCOL_FEATURES:
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        msg.size = sizeof(m.u64);
+        msg.u64 = 1ULL << VHOST_USER_PROTOCOL_F_MQ;
         p = (uint8_t *) &msg;
         qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
         break;
 
+    case VHOST_USER_GET_QUEUE_NUM:
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        msg.size = sizeof(m.u64);
+        if (chr == mq_chr) {
+            msg.u64 = MQ_QUEUES;
+            mq_got_queue_num = true;
+        } else {
+            msg.u64 = 1;
+        }
+        p = (uint8_t *) &msg;
+        qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
+        break;
+
+    case VHOST_USER_SET_VRING_ENABLE:
+        if (chr == mq_chr) {
+            mq_vring_enable |= 1 << msg.state.index;
+            g_cond_signal(data_cond);
+        }
+        break;
+
     case VHOST_USER_GET_VRING_BASE:
         /* send back vring base to qemu */
         msg.flags |= VHOST_USER_REPLY_MASK;
@@ -333,6 +385,106 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
     g_mutex_unlock(data_mutex);
 }
 
+static void test_reconnect(void)
+{
+    QTestState *s, *old_qtest = global_qtest;
+    CharDriverState *chr;
+    char *socket_path;
+    char *qemu_cmd;
+    char *chr_name;
+    char *chr_path;
+    int i, j;
+
+    socket_path = g_strdup_printf("/tmp/vhost-%d-reconnect.sock", getpid());
+    qemu_cmd = g_strdup_printf(QEMU_CMD_RECONNECT, hugefs, socket_path);
+    s = qtest_start(qemu_cmd);
+    g_free(qemu_cmd);
+
+    /* The memory table comes again on every connection, and the vhost
+     * devices of the previous one must not send anything on the new one.
+     */
+    for (i = 0; i < 3; i++) {
+        g_mutex_lock(data_mutex);
+        for (j = 0; j < fds_num; j++) {
+            close(fds[j]);
+        }
+        fds_num = 0;
+        g_mutex_unlock(data_mutex);
+
+        chr_name = g_strdup_printf("reconnect%d", i);
+        chr_path = g_strdup_printf("unix:%s", socket_path);
+        chr = qemu_chr_new(chr_name, chr_path, NULL);
+        g_free(chr_name);
+        g_free(chr_path);
+        g_assert(chr);
+        qemu_chr_add_handlers(chr, chr_can_read, chr_read, NULL, chr);
+
+        read_guest_mem();
+
+        g_mutex_lock(data_mutex);
+        qemu_chr_disconnect(chr);
+        qemu_chr_delete(chr);
+        g_mutex_unlock(data_mutex);
+    }
+
+    qtest_quit(s);
+    global_qtest = old_qtest;
+    unlink(socket_path);
+    g_free(socket_path);
+}
+
+static void test_multiqueue(void)
+{
+    QTestState *s, *old_qtest = global_qtest;
+    uint32_t mask = ((1 << (MQ_QUEUES * 2)) - 1) & ~3;
+    CharDriverState *chr;
+    char *socket_path;
+    char *qemu_cmd;
+    char *chr_path;
+    gint64 end_time;
+
+    socket_path = g_strdup_printf("/tmp/vhost-%d-mq.sock", getpid());
+    chr_path = g_strdup_printf("unix:%s,server,nowait", socket_path);
+    chr = qemu_chr_new("mq", chr_path, NULL);
+    g_free(chr_path);
+    g_assert(chr);
+
+    g_mutex_lock(data_mutex);
+    mq_chr = chr;
+    mq_got_queue_num = false;
+    mq_vring_enable = 0;
+    g_mutex_unlock(data_mutex);
+    qemu_chr_add_handlers(chr, chr_can_read, chr_read, NULL, chr);
+
+    qemu_cmd = g_strdup_printf(QEMU_CMD_MQ, hugefs, socket_path);
+    s = qtest_start(qemu_cmd);
+    g_free(qemu_cmd);
+
+    /* The rings of the queue pairs past the first are enabled or disabled
+     * once the guest has set the features.
+     */
+    g_mutex_lock(data_mutex);
+    g_assert(mq_got_queue_num);
+    end_time = _get_time() + 5 * G_TIME_SPAN_SECOND;
+    while ((mq_vring_enable & mask) != mask) {
+        if (!_cond_wait_until(data_cond, data_mutex, end_time)) {
+            break;
+        }
+    }
+    g_assert_cmphex(mq_vring_enable & mask, ==, mask);
+    g_mutex_unlock(data_mutex);
+
+    qtest_quit(s);
+    global_qtest = old_qtest;
+
+    g_mutex_lock(data_mutex);
+    mq_chr = NULL;
+    qemu_chr_delete(chr);
+    g_mutex_unlock(data_mutex);
+    unlink(socket_path);
+    g_free(socket_path);
+}
+
 static const char *init_hugepagefs(void)
 {
     const char *path;
@@ -370,7 +522,6 @@ int main(int argc, char **argv)
 {
     QTestState *s = NULL;
     CharDriverState *chr = NULL;
-    const char *hugefs = 0;
     char *socket_path = 0;
     char *qemu_cmd = 0;
     char *chr_path = 0;
@@ -404,6 +555,8 @@ int main(int argc, char **argv)
     g_free(qemu_cmd);
 
     qtest_add_func("/vhost-user/read-guest-mem", read_guest_mem);
+    qtest_add_func("/vhost-user/reconnect", test_reconnect);
+    qtest_add_func("/vhost-user/multiqueue", test_multiqueue);
 
     ret = g_test_run();
 
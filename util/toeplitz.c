@@ -0,0 +1,43 @@
+/*
+ * Toeplitz hash, as used for receive side scaling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/toeplitz.h"
+
+const uint8_t toeplitz_default_key[TOEPLITZ_DEFAULT_KEY_SIZE] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+uint32_t toeplitz_hash(const uint8_t *key, size_t key_len,
+                       const uint8_t *data, size_t len)
+{
+    uint32_t hash = 0;
+    uint32_t window = 0;
+    size_t i;
+    int bit;
+
+    /* window holds the 32 key bits lined up with the current input bit */
+    for (i = 0; i < 4; i++) {
+        window = (window << 8) | (i < key_len ? key[i] : 0);
+    }
+
+    for (i = 0; i < len; i++) {
+        uint8_t next = i + 4 < key_len ? key[i + 4] : 0;
+
+        for (bit = 7; bit >= 0; bit--) {
+            if (data[i] & (1 << bit)) {
+                hash ^= window;
+            }
+            window = (window << 1) | ((next >> bit) & 1);
+        }
+    }
+
+    return hash;
+}